@@ -0,0 +1,315 @@
+// Benchmarks dmap's modes against other hash maps on the same workloads and keys.
+// usage: dmap_bench [-s sizes] [-w workloads] [-i maps] [-m min_ops] [-r reps] [-S seed] [-c]
+// Every measurement is repeated reps times and the run with the median ns/op is reported.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+static const char *bench_workload_names[BENCH_NUM_WORKLOADS] = {
+    "int_insert", "int_grow", "int_hit", "int_miss", "int_churn", "int_iter",
+    "str_insert", "str_hit", "str_miss", "str_churn",
+};
+
+// the maps built in, each list NULL terminated
+static const BenchBackend *const bench_lists[] = {
+    bench_dmap_backends,
+#ifdef BENCH_HAVE_STD
+    bench_std_backends,
+#endif
+#ifdef BENCH_HAVE_ABSL
+    bench_absl_backends,
+#endif
+#ifdef BENCH_HAVE_KHASH
+    bench_khash_backends,
+#endif
+};
+#define BENCH_NUM_LISTS (sizeof(bench_lists) / sizeof(bench_lists[0]))
+
+// roughly L1, L2, last level cache and far beyond it, for 8 byte keys and values
+static const size_t bench_default_sizes[] = {1000, 32000, 1000000, 8000000};
+
+// MARK: allocator
+// sizes are kept in a 16 byte prefix, so alignment stays that of malloc
+static size_t bench_bytes;
+
+size_t bench_live_bytes(void) {
+    return bench_bytes;
+}
+void *bench_malloc(size_t size) {
+    size_t *p = (size_t*)malloc(size + 16);
+    if(!p) return NULL;
+    p[0] = size;
+    bench_bytes += size;
+    return (char*)p + 16;
+}
+void *bench_calloc(size_t n, size_t size) {
+    void *p = bench_malloc(n * size);
+    if(p) memset(p, 0, n * size);
+    return p;
+}
+void *bench_realloc(void *ptr, size_t size) {
+    if(!ptr) return bench_malloc(size);
+    size_t *h = (size_t*)((char*)ptr - 16);
+    size_t old = h[0];
+    h = (size_t*)realloc(h, size + 16);
+    if(!h) return NULL;
+    h[0] = size;
+    bench_bytes += size;
+    bench_bytes -= old;
+    return (char*)h + 16;
+}
+void bench_free(void *ptr) {
+    if(!ptr) return;
+    size_t *h = (size_t*)((char*)ptr - 16);
+    bench_bytes -= h[0];
+    free(h);
+}
+
+// MARK: keys
+static uint64_t bench_splitmix(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+typedef struct BenchKeyStore {
+    uint64_t *ints;
+    char **strs;
+    uint32_t *str_lens;
+    char *str_buf;
+    uint32_t *order;
+} BenchKeyStore;
+
+// 2 * max_n keys of each kind, distinct: strings are "key-<i>-" followed by 0 to 16 hex digits of noise,
+// 6 to 30 bytes long
+static void bench_make_keys(BenchKeyStore *ks, size_t max_n, uint64_t seed) {
+    size_t count = 2 * max_n;
+    ks->ints = (uint64_t*)malloc(count * sizeof(uint64_t));
+    ks->strs = (char**)malloc(count * sizeof(char*));
+    ks->str_lens = (uint32_t*)malloc(count * sizeof(uint32_t));
+    ks->str_buf = (char*)malloc(count * 32);
+    ks->order = (uint32_t*)malloc(max_n * sizeof(uint32_t));
+    if(!ks->ints || !ks->strs || !ks->str_lens || !ks->str_buf || !ks->order){
+        fprintf(stderr, "out of memory generating %zu keys\n", count);
+        exit(1);
+    }
+    uint64_t state = seed;
+    char *p = ks->str_buf;
+    for(size_t i = 0; i < count; i++){
+        uint64_t h = bench_splitmix(&state);
+        ks->ints[i] = h; // distinct with overwhelming probability; checked by the workloads' counts
+        int len = snprintf(p, 32, "key-%zu-", i);
+        for(int d = 0; d < (int)(h % 17); d++){
+            p[len++] = "0123456789abcdef"[(h >> (4 * d)) & 15];
+        }
+        p[len] = '\0';
+        ks->strs[i] = p;
+        ks->str_lens[i] = (uint32_t)len;
+        p += len + 1;
+    }
+}
+// random permutation of [0, n), the order lookups go in so they don't follow insertion order
+static void bench_shuffle(uint32_t *order, size_t n, uint64_t seed) {
+    uint64_t state = seed ^ n;
+    for(size_t i = 0; i < n; i++){
+        order[i] = (uint32_t)i;
+    }
+    for(size_t i = n - 1; i > 0; i--){
+        size_t j = (size_t)(bench_splitmix(&state) % (i + 1));
+        uint32_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+}
+
+// MARK: runs
+typedef struct BenchSummary {
+    double ns_per_op;
+    double bytes_per_entry;
+    double p50, p99, p999; // ns per op, over batches of BENCH_BATCH
+    bool ok;
+} BenchSummary;
+
+static int bench_cmp_float(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+static int bench_cmp_summary(const void *a, const void *b) {
+    double x = ((const BenchSummary*)a)->ns_per_op, y = ((const BenchSummary*)b)->ns_per_op;
+    return (x > y) - (x < y);
+}
+static double bench_percentile(const float *sorted, size_t n, double q) {
+    if(n == 0) return 0;
+    size_t i = (size_t)(q * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+static BenchSummary bench_measure(const BenchBackend *b, BenchWorkload w, const BenchKeys *k, float *samples, size_t max_samples) {
+    size_t live = bench_live_bytes();
+    BenchRun r;
+    memset(&r, 0, sizeof(r));
+    r.samples = samples;
+    r.max_samples = max_samples;
+    b->run(b->cfg, w, k, &r);
+    qsort(r.samples, r.num_samples, sizeof(float), bench_cmp_float);
+    BenchSummary s;
+    s.ns_per_op = r.ops ? (double)r.elapsed_ns / (double)r.ops : 0;
+    s.bytes_per_entry = (double)r.bytes / (double)k->n;
+    s.p50 = bench_percentile(r.samples, r.num_samples, 0.50);
+    s.p99 = bench_percentile(r.samples, r.num_samples, 0.99);
+    s.p999 = bench_percentile(r.samples, r.num_samples, 0.999);
+    s.ok = r.found == r.expected;
+    if(!s.ok){
+        fprintf(stderr, "%s %s n=%zu: got %zu, expected %zu\n", b->name, bench_workload_names[w], k->n, r.found, r.expected);
+    }
+    if(bench_live_bytes() != live){
+        // a map that leaks would make every later bytes/entry wrong
+        fprintf(stderr, "%s %s n=%zu: %zu bytes still allocated\n", b->name, bench_workload_names[w], k->n, bench_live_bytes() - live);
+        s.ok = false;
+    }
+    return s;
+}
+
+// MARK: options
+static bool bench_listed(const char *list, const char *name, bool substring) {
+    if(!list) return true;
+    size_t len = strlen(name);
+    for(const char *p = list; *p; ){
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if(substring){
+            for(size_t i = 0; n && i + n <= len; i++){
+                if(strncmp(name + i, p, n) == 0) return true;
+            }
+        } else if(n == len && strncmp(name, p, n) == 0){
+            return true;
+        }
+        p += n + (end ? 1 : 0);
+    }
+    return false;
+}
+static void bench_usage(void) {
+    printf("usage: dmap_bench [options]\n"
+           "  -s N,N,...   map sizes (default 1000,32000,1000000,8000000)\n"
+           "  -w a,b,...   workloads (default all):");
+    for(int w = 0; w < BENCH_NUM_WORKLOADS; w++){
+        printf(" %s", bench_workload_names[w]);
+    }
+    printf("\n"
+           "  -i a,b,...   maps whose name contains one of these (default all):");
+    for(size_t l = 0; l < BENCH_NUM_LISTS; l++){
+        for(const BenchBackend *b = bench_lists[l]; b->name; b++){
+            printf(" %s", b->name);
+        }
+    }
+    printf("\n"
+           "  -m N         time at least N operations per measurement (default 1000000)\n"
+           "  -r N         repetitions, the median is reported (default 3)\n"
+           "  -S N         key seed (default 1)\n"
+           "  -c           CSV output\n");
+}
+
+int main(int argc, char **argv) {
+    size_t sizes[64];
+    size_t num_sizes = 0;
+    const char *workloads = NULL, *maps = NULL;
+    size_t min_ops = 1000000;
+    int reps = 3;
+    uint64_t seed = 1;
+    bool csv = false;
+    for(int i = 1; i < argc; i++){
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "-c") == 0){
+            csv = true;
+            continue;
+        }
+        if(strcmp(arg, "-h") == 0 || !val || arg[0] != '-' || strlen(arg) != 2){
+            bench_usage();
+            return strcmp(arg, "-h") == 0 ? 0 : 1;
+        }
+        i++;
+        switch(arg[1]){
+            case 's':
+                for(const char *p = val; *p && num_sizes < 64; ){
+                    char *end;
+                    unsigned long long n = strtoull(p, &end, 10);
+                    if(end == p || n == 0 || n > 0x7fffffffu / 2){
+                        fprintf(stderr, "bad size list: %s\n", val);
+                        return 1;
+                    }
+                    sizes[num_sizes++] = (size_t)n;
+                    p = *end == ',' ? end + 1 : end;
+                }
+                break;
+            case 'w': workloads = val; break;
+            case 'i': maps = val; break;
+            case 'm': min_ops = (size_t)strtoull(val, NULL, 10); break;
+            case 'r': reps = atoi(val) > 0 ? atoi(val) : 1; break;
+            case 'S': seed = strtoull(val, NULL, 10); break;
+            default: bench_usage(); return 1;
+        }
+    }
+    if(num_sizes == 0){
+        num_sizes = sizeof(bench_default_sizes) / sizeof(bench_default_sizes[0]);
+        memcpy(sizes, bench_default_sizes, sizeof(bench_default_sizes));
+    }
+    size_t max_n = 0;
+    for(size_t i = 0; i < num_sizes; i++){
+        max_n = sizes[i] > max_n ? sizes[i] : max_n;
+    }
+    BenchKeyStore ks;
+    bench_make_keys(&ks, max_n, seed);
+    size_t max_samples = (min_ops + max_n) / BENCH_BATCH + 1024;
+    float *samples = (float*)malloc(max_samples * sizeof(float));
+    BenchSummary *runs = (BenchSummary*)malloc((size_t)reps * sizeof(BenchSummary));
+    if(!samples || !runs){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if(csv){
+        printf("workload,size,map,ns_per_op,bytes_per_entry,p50_ns,p99_ns,p999_ns\n");
+    } else {
+        printf("# %d repetitions (median), at least %zu ops each; latency percentiles over batches of %d ops\n", reps, min_ops, BENCH_BATCH);
+        printf("%-11s %9s  %-20s %9s %11s %9s %9s %9s\n", "workload", "size", "map", "ns/op", "bytes/entry", "p50", "p99", "p99.9");
+    }
+    int failures = 0;
+    for(size_t si = 0; si < num_sizes; si++){
+        size_t n = sizes[si];
+        bench_shuffle(ks.order, n, seed);
+        BenchKeys k = {n, ks.ints, (const char *const*)ks.strs, ks.str_lens, ks.order, min_ops};
+        for(int w = 0; w < BENCH_NUM_WORKLOADS; w++){
+            if(!bench_listed(workloads, bench_workload_names[w], false)) continue;
+            for(size_t l = 0; l < BENCH_NUM_LISTS; l++){
+                for(const BenchBackend *b = bench_lists[l]; b->name; b++){
+                    if(!bench_listed(maps, b->name, true)) continue;
+                    bool ok = true;
+                    for(int rep = 0; rep < reps; rep++){
+                        runs[rep] = bench_measure(b, (BenchWorkload)w, &k, samples, max_samples);
+                        ok = ok && runs[rep].ok;
+                    }
+                    qsort(runs, (size_t)reps, sizeof(BenchSummary), bench_cmp_summary);
+                    BenchSummary *s = &runs[reps / 2];
+                    failures += !ok;
+                    if(csv){
+                        printf("%s,%zu,%s,%.2f,%.1f,%.2f,%.2f,%.2f\n", bench_workload_names[w], n, b->name, s->ns_per_op, s->bytes_per_entry, s->p50, s->p99, s->p999);
+                    } else {
+                        printf("%-11s %9zu  %-20s %9.2f %11.1f %9.2f %9.2f %9.2f%s\n", bench_workload_names[w], n, b->name, s->ns_per_op, s->bytes_per_entry, s->p50, s->p99, s->p999, ok ? "" : "  FAILED");
+                    }
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    free(runs);
+    free(samples);
+    free(ks.ints);
+    free(ks.strs);
+    free(ks.str_lens);
+    free(ks.str_buf);
+    free(ks.order);
+    return failures ? 1 : 0;
+}
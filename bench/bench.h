@@ -0,0 +1,97 @@
+#ifndef DMAP_BENCH_H
+#define DMAP_BENCH_H
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Harness shared by the backends. Each backend defines a few macros for its map (see workloads.h) and includes
+// workloads.h, which expands to the same workload loops for every map, so nothing is called through a pointer
+// on the measured path.
+
+#define BENCH_BATCH 64 // operations timed together; latency percentiles are over these batches
+
+typedef enum BenchWorkload {
+    BENCH_INT_INSERT, // n new keys into a map reserved for them
+    BENCH_INT_GROW,   // n new keys into an empty map, through every resize
+    BENCH_INT_HIT,    // lookups of keys in the map, in random order
+    BENCH_INT_MISS,   // lookups of keys not in the map
+    BENCH_INT_CHURN,  // delete the oldest key and insert a new one, the map staying at n entries
+    BENCH_INT_ITER,   // visit every entry; per entry
+    BENCH_STR_INSERT,
+    BENCH_STR_HIT,
+    BENCH_STR_MISS,
+    BENCH_STR_CHURN,
+    BENCH_NUM_WORKLOADS,
+} BenchWorkload;
+
+// keys for a map of n entries. ints/strs hold 2n distinct keys: [0, n) are inserted, [n, 2n) are the misses
+// and the keys churn cycles through
+typedef struct BenchKeys {
+    size_t n;
+    const uint64_t *ints;
+    const char *const *strs; // NUL terminated
+    const uint32_t *str_lens;
+    const uint32_t *order;   // random permutation of [0, n), the lookup order
+    size_t min_ops;          // small maps repeat the workload until at least this many operations are timed
+} BenchKeys;
+
+typedef struct BenchRun {
+    uint64_t elapsed_ns;
+    size_t ops;
+    size_t bytes;   // allocated by the map while it held n entries
+    size_t found;   // lookups that found their key, entries visited or left in the map
+    size_t expected; // what found has to be for the map to have done the work correctly
+    uint64_t check; // sum of the values read, so the lookups can't be optimized away
+    float *samples; // ns per op of each batch
+    size_t num_samples;
+    size_t max_samples;
+    uint64_t lap;
+} BenchRun;
+
+typedef struct BenchBackend {
+    const char *name;
+    const void *cfg; // passed to the backend's map constructor
+    void (*run)(const void *cfg, BenchWorkload w, const BenchKeys *k, BenchRun *r);
+} BenchBackend;
+
+// live bytes allocated through the counting allocator below; every backend's maps allocate through it
+size_t bench_live_bytes(void);
+void *bench_malloc(size_t size);
+void *bench_calloc(size_t n, size_t size);
+void *bench_realloc(void *p, size_t size);
+void bench_free(void *p);
+
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+static inline void bench_begin(BenchRun *r) {
+    r->lap = bench_now_ns();
+}
+// ends a batch of ops operations started by bench_begin or the previous lap
+static inline void bench_lap(BenchRun *r, size_t ops) {
+    uint64_t now = bench_now_ns();
+    r->elapsed_ns += now - r->lap;
+    r->ops += ops;
+    if(r->num_samples < r->max_samples){
+        r->samples[r->num_samples++] = (float)(now - r->lap) / (float)ops;
+    }
+    r->lap = bench_now_ns();
+}
+
+// NULL terminated, defined by each backend that is built
+extern const BenchBackend bench_dmap_backends[];
+extern const BenchBackend bench_std_backends[];
+extern const BenchBackend bench_absl_backends[];
+extern const BenchBackend bench_khash_backends[];
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DMAP_BENCH_H
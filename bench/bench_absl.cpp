@@ -0,0 +1,45 @@
+#include "bench.h"
+#include <string>
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/string_view.h"
+
+// allocations are counted by the operator new in bench_std.cpp
+
+namespace {
+
+using IntMap = absl::flat_hash_map<uint64_t, uint64_t>;
+using StrMap = absl::flat_hash_map<std::string, uint64_t>; // looked up by absl::string_view, its hash is transparent
+
+template<typename Map, typename Key>
+inline uint64_t *bench_find(Map *m, const Key &key) {
+    auto it = m->find(key);
+    return it == m->end() ? nullptr : &it->second;
+}
+
+#define INT_MAP IntMap *
+#define INT_NEW(m, cfg) ((void)(cfg), (m) = new IntMap())
+#define INT_FREE(m) delete (m)
+#define INT_RESERVE(m, n) (m)->reserve(n)
+#define INT_PUT(m, key, val) (*(m))[key] = (val)
+#define INT_GETP(m, key) bench_find((m), (key))
+#define INT_DEL(m, key) (m)->erase(key)
+#define INT_COUNT(m) (m)->size()
+#define INT_SUM(m, sum, count) for(const auto &e : *(m)) { (sum) += e.second; (count)++; }
+
+#define STR_MAP StrMap *
+#define STR_NEW(m, cfg) ((void)(cfg), (m) = new StrMap())
+#define STR_FREE(m) delete (m)
+#define STR_RESERVE(m, n) (m)->reserve(n)
+#define STR_PUT(m, str, len, val) (*(m))[absl::string_view((str), (len))] = (val)
+#define STR_GETP(m, str, len) bench_find((m), absl::string_view((str), (len)))
+#define STR_DEL(m, str, len) (m)->erase(absl::string_view((str), (len)))
+#define STR_COUNT(m) (m)->size()
+
+#include "workloads.h"
+
+} // namespace
+
+extern "C" const BenchBackend bench_absl_backends[] = {
+    {"absl::flat_hash_map", nullptr, bench_run},
+    {nullptr, nullptr, nullptr},
+};
@@ -0,0 +1,57 @@
+#include "../dmap.h"
+#include "bench.h"
+
+// dmap allocates through the counting allocator like every other backend
+static void *bench_dmap_alloc(void *ctx, size_t size, size_t alignment) {
+    (void)ctx; (void)alignment; // never above 16 with these options, which bench_malloc guarantees
+    return bench_malloc(size);
+}
+static void *bench_dmap_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    (void)ctx; (void)old_size;
+    return bench_realloc(ptr, new_size);
+}
+static void bench_dmap_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    bench_free(ptr);
+}
+static DmapOptions bench_dmap_options(const void *cfg) {
+    DmapOptions o = *(const DmapOptions*)cfg;
+    o.allocator = (DmapAllocator){bench_dmap_alloc, bench_dmap_realloc, bench_dmap_free, NULL};
+    return o;
+}
+
+#define INT_MAP uint64_t *
+#define INT_NEW(m, cfg) do { (m) = NULL; dmap_init((m), bench_dmap_options(cfg)); } while(0)
+#define INT_FREE(m) dmap_free(m)
+#define INT_RESERVE(m, n) dmap_reserve((m), (n))
+#define INT_PUT(m, key, val) (void)dmap_insert((m), &(key), (val))
+#define INT_GETP(m, key) dmap_getp((m), &(key))
+#define INT_DEL(m, key) dmap_delete((m), &(key))
+#define INT_COUNT(m) dmap_count(m)
+#define INT_SUM(m, sum, count) dmap_foreach((m), i) { (sum) += (m)[i]; (count)++; }
+
+#define STR_MAP uint64_t *
+#define STR_NEW(m, cfg) do { (m) = NULL; dmap_kstr_init((m), bench_dmap_options(cfg)); } while(0)
+#define STR_FREE(m) dmap_free(m)
+#define STR_RESERVE(m, n) dmap_kstr_reserve((m), (n))
+#define STR_PUT(m, str, len, val) (void)dmap_kstr_insert((m), (void*)(str), (len), (val))
+#define STR_GETP(m, str, len) dmap_kstr_getp((m), (void*)(str), (len))
+#define STR_DEL(m, str, len) dmap_kstr_delete((m), (void*)(str), (len))
+#define STR_COUNT(m) dmap_count(m)
+
+#include "workloads.h"
+
+static const DmapOptions bench_dmap_linear = {0};
+static const DmapOptions bench_dmap_ctrl = {.use_ctrl_bytes = true};
+static const DmapOptions bench_dmap_robin_hood = {.robin_hood = true};
+static const DmapOptions bench_dmap_arena = {.use_key_arena = true};
+static const DmapOptions bench_dmap_bloom = {.bloom_bits_per_key = 10};
+
+const BenchBackend bench_dmap_backends[] = {
+    {"dmap", &bench_dmap_linear, bench_run},
+    {"dmap_ctrl", &bench_dmap_ctrl, bench_run},
+    {"dmap_robin_hood", &bench_dmap_robin_hood, bench_run},
+    {"dmap_key_arena", &bench_dmap_arena, bench_run},
+    {"dmap_bloom", &bench_dmap_bloom, bench_run},
+    {0},
+};
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+// khash allocates through these, so its maps are counted like the others
+#define kcalloc(N, Z) bench_calloc((N), (Z))
+#define kmalloc(Z) bench_malloc(Z)
+#define krealloc(P, Z) bench_realloc((P), (Z))
+#define kfree(P) bench_free(P)
+#include "khash.h"
+
+KHASH_MAP_INIT_INT64(bench_int, uint64_t)
+KHASH_MAP_INIT_STR(bench_str, uint64_t)
+
+static inline uint64_t *bench_kh_int_getp(khash_t(bench_int) *m, uint64_t key) {
+    khiter_t it = kh_get(bench_int, m, key);
+    return it == kh_end(m) ? NULL : &kh_val(m, it);
+}
+static inline void bench_kh_int_put(khash_t(bench_int) *m, uint64_t key, uint64_t val) {
+    int ret;
+    khiter_t it = kh_put(bench_int, m, key, &ret);
+    kh_val(m, it) = val;
+}
+static inline void bench_kh_int_del(khash_t(bench_int) *m, uint64_t key) {
+    khiter_t it = kh_get(bench_int, m, key);
+    if(it != kh_end(m)) kh_del(bench_int, m, it);
+}
+// khash keeps the key pointer it is given; the map owns a copy, like the other maps do
+static inline void bench_kh_str_put(khash_t(bench_str) *m, const char *str, size_t len, uint64_t val) {
+    int ret;
+    khiter_t it = kh_put(bench_str, m, str, &ret);
+    if(ret > 0){
+        char *copy = (char*)bench_malloc(len + 1);
+        memcpy(copy, str, len + 1);
+        kh_key(m, it) = copy;
+    }
+    kh_val(m, it) = val;
+}
+static inline uint64_t *bench_kh_str_getp(khash_t(bench_str) *m, const char *str) {
+    khiter_t it = kh_get(bench_str, m, str);
+    return it == kh_end(m) ? NULL : &kh_val(m, it);
+}
+static inline void bench_kh_str_del(khash_t(bench_str) *m, const char *str) {
+    khiter_t it = kh_get(bench_str, m, str);
+    if(it != kh_end(m)){
+        bench_free((void*)kh_key(m, it));
+        kh_del(bench_str, m, it);
+    }
+}
+static void bench_kh_str_free(khash_t(bench_str) *m) {
+    for(khiter_t it = kh_begin(m); it != kh_end(m); it++){
+        if(kh_exist(m, it)) bench_free((void*)kh_key(m, it));
+    }
+    kh_destroy(bench_str, m);
+}
+
+#define INT_MAP khash_t(bench_int) *
+#define INT_NEW(m, cfg) ((void)(cfg), (m) = kh_init(bench_int))
+#define INT_FREE(m) kh_destroy(bench_int, (m))
+#define INT_RESERVE(m, n) kh_resize(bench_int, (m), (khint_t)((n) / 0.77 + 1)) // buckets, kept below its load factor
+#define INT_PUT(m, key, val) bench_kh_int_put((m), (key), (val))
+#define INT_GETP(m, key) bench_kh_int_getp((m), (key))
+#define INT_DEL(m, key) bench_kh_int_del((m), (key))
+#define INT_COUNT(m) kh_size(m)
+#define INT_SUM(m, sum, count) for(khiter_t it = kh_begin(m); it != kh_end(m); it++) if(kh_exist((m), it)) { (sum) += kh_val((m), it); (count)++; }
+
+#define STR_MAP khash_t(bench_str) *
+#define STR_NEW(m, cfg) ((void)(cfg), (m) = kh_init(bench_str))
+#define STR_FREE(m) bench_kh_str_free(m)
+#define STR_RESERVE(m, n) kh_resize(bench_str, (m), (khint_t)((n) / 0.77 + 1))
+#define STR_PUT(m, str, len, val) bench_kh_str_put((m), (str), (len), (val))
+#define STR_GETP(m, str, len) bench_kh_str_getp((m), (str))
+#define STR_DEL(m, str, len) bench_kh_str_del((m), (str))
+#define STR_COUNT(m) kh_size(m)
+
+#include "workloads.h"
+
+const BenchBackend bench_khash_backends[] = {
+    {"khash", NULL, bench_run},
+    {0},
+};
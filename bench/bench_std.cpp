@@ -0,0 +1,66 @@
+#include "bench.h"
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Every C++ allocation goes through the counting allocator, which is how the std and absl maps are measured
+void *operator new(size_t size) {
+    void *p = bench_malloc(size);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { bench_free(p); }
+void operator delete(void *p, size_t) noexcept { bench_free(p); }
+
+namespace {
+
+using IntMap = std::unordered_map<uint64_t, uint64_t>;
+
+// lookups by string_view where the library allows it (C++20), a temporary std::string otherwise
+#if defined(__cpp_lib_generic_unordered_lookup) && __cpp_lib_generic_unordered_lookup >= 201811L
+struct StrHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+};
+using StrMap = std::unordered_map<std::string, uint64_t, StrHash, std::equal_to<>>;
+inline std::string_view bench_key(const char *s, size_t len) { return std::string_view(s, len); }
+#else
+using StrMap = std::unordered_map<std::string, uint64_t>;
+inline std::string bench_key(const char *s, size_t len) { return std::string(s, len); }
+#endif
+
+template<typename Map, typename Key>
+inline uint64_t *bench_find(Map *m, const Key &key) {
+    auto it = m->find(key);
+    return it == m->end() ? nullptr : &it->second;
+}
+
+#define INT_MAP IntMap *
+#define INT_NEW(m, cfg) ((void)(cfg), (m) = new IntMap())
+#define INT_FREE(m) delete (m)
+#define INT_RESERVE(m, n) (m)->reserve(n)
+#define INT_PUT(m, key, val) (*(m))[key] = (val)
+#define INT_GETP(m, key) bench_find((m), (key))
+#define INT_DEL(m, key) (m)->erase(key)
+#define INT_COUNT(m) (m)->size()
+#define INT_SUM(m, sum, count) for(const auto &e : *(m)) { (sum) += e.second; (count)++; }
+
+#define STR_MAP StrMap *
+#define STR_NEW(m, cfg) ((void)(cfg), (m) = new StrMap())
+#define STR_FREE(m) delete (m)
+#define STR_RESERVE(m, n) (m)->reserve(n)
+#define STR_PUT(m, str, len, val) (m)->insert_or_assign(std::string((str), (len)), (val))
+#define STR_GETP(m, str, len) bench_find((m), bench_key((str), (len)))
+#define STR_DEL(m, str, len) (m)->erase(std::string((str), (len)))
+#define STR_COUNT(m) (m)->size()
+
+#include "workloads.h"
+
+} // namespace
+
+extern "C" const BenchBackend bench_std_backends[] = {
+    {"std::unordered_map", nullptr, bench_run},
+    {nullptr, nullptr, nullptr},
+};
@@ -0,0 +1,215 @@
+// Workload loops, expanded once per backend. Before including this, a backend defines:
+//   INT_MAP, STR_MAP                 map types: uint64_t keys, and string keys, to uint64_t values
+//   INT_NEW(m, cfg), INT_FREE(m)     create from the backend's cfg / destroy
+//   INT_RESERVE(m, n)                make room for n entries
+//   INT_PUT(m, key, val)             insert or update; key is a uint64_t lvalue
+//   INT_GETP(m, key)                 pointer to the value, or NULL
+//   INT_DEL(m, key)
+//   INT_COUNT(m)                     number of entries
+//   INT_SUM(m, sum, count)           adds every value to sum and the number of entries to count
+// and the same STR_ ones minus STR_SUM, taking (m, str, len) for keys. Strings are NUL terminated, so len
+// may be ignored. Everything is in the subset of C that also compiles as C++.
+#include "bench.h"
+
+#define BENCH_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// repeats for small maps, so that every measurement times at least min_ops operations
+static size_t bench_passes(const BenchKeys *k, size_t ops_per_pass) {
+    size_t passes = (k->min_ops + ops_per_pass - 1) / ops_per_pass;
+    return passes ? passes : 1;
+}
+
+static void bench_int_fill(INT_MAP *mp, const BenchKeys *k) {
+    for(size_t i = 0; i < k->n; i++){
+        uint64_t key = k->ints[i];
+        INT_PUT(*mp, key, (uint64_t)i);
+    }
+}
+static void bench_str_fill(STR_MAP *mp, const BenchKeys *k) {
+    for(size_t i = 0; i < k->n; i++){
+        STR_PUT(*mp, k->strs[i], k->str_lens[i], (uint64_t)i);
+    }
+}
+
+static void bench_int_insert(const void *cfg, const BenchKeys *k, BenchRun *r, int reserve) {
+    size_t n = k->n;
+    size_t rounds = bench_passes(k, n);
+    for(size_t round = 0; round < rounds; round++){
+        size_t base = bench_live_bytes();
+        INT_MAP m;
+        INT_NEW(m, cfg);
+        if(reserve){
+            INT_RESERVE(m, n);
+        }
+        bench_begin(r);
+        for(size_t i = 0; i < n; i += BENCH_BATCH){
+            size_t end = BENCH_MIN(i + BENCH_BATCH, n);
+            for(size_t j = i; j < end; j++){
+                uint64_t key = k->ints[j];
+                INT_PUT(m, key, (uint64_t)j);
+            }
+            bench_lap(r, end - i);
+        }
+        r->bytes = bench_live_bytes() - base;
+        r->found += (size_t)INT_COUNT(m);
+        INT_FREE(m);
+    }
+    r->expected = n * rounds;
+}
+// miss looks up keys [n, 2n) instead of the ones in the map
+static void bench_int_lookup(const void *cfg, const BenchKeys *k, BenchRun *r, int miss) {
+    size_t n = k->n;
+    size_t base = bench_live_bytes();
+    INT_MAP m;
+    INT_NEW(m, cfg);
+    bench_int_fill(&m, k);
+    r->bytes = bench_live_bytes() - base;
+    const uint64_t *keys = miss ? k->ints + n : k->ints;
+    size_t passes = bench_passes(k, n);
+    for(size_t pass = 0; pass < passes; pass++){
+        bench_begin(r);
+        for(size_t i = 0; i < n; i += BENCH_BATCH){
+            size_t end = BENCH_MIN(i + BENCH_BATCH, n);
+            for(size_t j = i; j < end; j++){
+                uint64_t key = keys[k->order[j]];
+                uint64_t *v = INT_GETP(m, key);
+                if(v){
+                    r->found++;
+                    r->check += *v;
+                }
+            }
+            bench_lap(r, end - i);
+        }
+    }
+    r->expected = miss ? 0 : n * passes;
+    INT_FREE(m);
+}
+// the map holds keys [s + 1, s + n] of the 2n after step s, wrapping around
+static void bench_int_churn(const void *cfg, const BenchKeys *k, BenchRun *r) {
+    size_t n = k->n;
+    size_t base = bench_live_bytes();
+    INT_MAP m;
+    INT_NEW(m, cfg);
+    bench_int_fill(&m, k);
+    r->bytes = bench_live_bytes() - base;
+    size_t ops = bench_passes(k, n) * n;
+    bench_begin(r);
+    for(size_t i = 0; i < ops; i += BENCH_BATCH){
+        size_t end = BENCH_MIN(i + BENCH_BATCH, ops);
+        for(size_t s = i; s < end; s++){
+            uint64_t old_key = k->ints[s % (2 * n)];
+            uint64_t new_key = k->ints[(s + n) % (2 * n)];
+            INT_DEL(m, old_key);
+            INT_PUT(m, new_key, (uint64_t)s);
+        }
+        bench_lap(r, end - i);
+    }
+    r->found = (size_t)INT_COUNT(m);
+    r->expected = n;
+    INT_FREE(m);
+}
+static void bench_int_iter(const void *cfg, const BenchKeys *k, BenchRun *r) {
+    size_t n = k->n;
+    size_t base = bench_live_bytes();
+    INT_MAP m;
+    INT_NEW(m, cfg);
+    bench_int_fill(&m, k);
+    r->bytes = bench_live_bytes() - base;
+    size_t passes = bench_passes(k, n);
+    for(size_t pass = 0; pass < passes; pass++){
+        bench_begin(r);
+        INT_SUM(m, r->check, r->found);
+        bench_lap(r, n);
+    }
+    r->expected = n * passes;
+    INT_FREE(m);
+}
+
+static void bench_str_insert(const void *cfg, const BenchKeys *k, BenchRun *r) {
+    size_t n = k->n;
+    size_t rounds = bench_passes(k, n);
+    for(size_t round = 0; round < rounds; round++){
+        size_t base = bench_live_bytes();
+        STR_MAP m;
+        STR_NEW(m, cfg);
+        STR_RESERVE(m, n);
+        bench_begin(r);
+        for(size_t i = 0; i < n; i += BENCH_BATCH){
+            size_t end = BENCH_MIN(i + BENCH_BATCH, n);
+            for(size_t j = i; j < end; j++){
+                STR_PUT(m, k->strs[j], k->str_lens[j], (uint64_t)j);
+            }
+            bench_lap(r, end - i);
+        }
+        r->bytes = bench_live_bytes() - base;
+        r->found += (size_t)STR_COUNT(m);
+        STR_FREE(m);
+    }
+    r->expected = n * rounds;
+}
+static void bench_str_lookup(const void *cfg, const BenchKeys *k, BenchRun *r, int miss) {
+    size_t n = k->n;
+    size_t base = bench_live_bytes();
+    STR_MAP m;
+    STR_NEW(m, cfg);
+    bench_str_fill(&m, k);
+    r->bytes = bench_live_bytes() - base;
+    size_t first = miss ? n : 0;
+    size_t passes = bench_passes(k, n);
+    for(size_t pass = 0; pass < passes; pass++){
+        bench_begin(r);
+        for(size_t i = 0; i < n; i += BENCH_BATCH){
+            size_t end = BENCH_MIN(i + BENCH_BATCH, n);
+            for(size_t j = i; j < end; j++){
+                size_t idx = first + k->order[j];
+                uint64_t *v = STR_GETP(m, k->strs[idx], k->str_lens[idx]);
+                if(v){
+                    r->found++;
+                    r->check += *v;
+                }
+            }
+            bench_lap(r, end - i);
+        }
+    }
+    r->expected = miss ? 0 : n * passes;
+    STR_FREE(m);
+}
+static void bench_str_churn(const void *cfg, const BenchKeys *k, BenchRun *r) {
+    size_t n = k->n;
+    size_t base = bench_live_bytes();
+    STR_MAP m;
+    STR_NEW(m, cfg);
+    bench_str_fill(&m, k);
+    r->bytes = bench_live_bytes() - base;
+    size_t ops = bench_passes(k, n) * n;
+    bench_begin(r);
+    for(size_t i = 0; i < ops; i += BENCH_BATCH){
+        size_t end = BENCH_MIN(i + BENCH_BATCH, ops);
+        for(size_t s = i; s < end; s++){
+            size_t old_idx = s % (2 * n);
+            size_t new_idx = (s + n) % (2 * n);
+            STR_DEL(m, k->strs[old_idx], k->str_lens[old_idx]);
+            STR_PUT(m, k->strs[new_idx], k->str_lens[new_idx], (uint64_t)s);
+        }
+        bench_lap(r, end - i);
+    }
+    r->found = (size_t)STR_COUNT(m);
+    r->expected = n;
+    STR_FREE(m);
+}
+
+static void bench_run(const void *cfg, BenchWorkload w, const BenchKeys *k, BenchRun *r) {
+    switch(w){
+        case BENCH_INT_INSERT: bench_int_insert(cfg, k, r, 1); break;
+        case BENCH_INT_GROW:   bench_int_insert(cfg, k, r, 0); break;
+        case BENCH_INT_HIT:    bench_int_lookup(cfg, k, r, 0); break;
+        case BENCH_INT_MISS:   bench_int_lookup(cfg, k, r, 1); break;
+        case BENCH_INT_CHURN:  bench_int_churn(cfg, k, r); break;
+        case BENCH_INT_ITER:   bench_int_iter(cfg, k, r); break;
+        case BENCH_STR_INSERT: bench_str_insert(cfg, k, r); break;
+        case BENCH_STR_HIT:    bench_str_lookup(cfg, k, r, 0); break;
+        case BENCH_STR_MISS:   bench_str_lookup(cfg, k, r, 1); break;
+        case BENCH_STR_CHURN:  bench_str_churn(cfg, k, r); break;
+        default: break;
+    }
+}
@@ -1,3 +1,6 @@
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+    #define _DEFAULT_SOURCE // MAP_ANONYMOUS, madvise and clock_gettime are left out under a strict -std=c11
+#endif
 #include "dmap.h"
 #include <stdbool.h>
 #include <stdlib.h> 
@@ -36,6 +39,17 @@
     #include <intrin.h>  // MSVC intrinsics
 #endif
 
+// SIMD used to probe control byte groups; #define DMAP_NO_SIMD to force the portable fallback
+#ifndef DMAP_NO_SIMD
+    #if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+        #include <emmintrin.h>
+        #define DMAP_SSE2
+    #elif defined(__ARM_NEON) || defined(_M_ARM64)
+        #include <arm_neon.h>
+        #define DMAP_NEON
+    #endif
+#endif
+
 static inline size_t next_power_of_2(size_t x) {
     if (x <= 1) return 1;  // ensure minimum value of 1
 
@@ -50,6 +64,35 @@ static inline size_t next_power_of_2(size_t x) {
 
     return 1;
 }
+// count trailing zeros, x must be non-zero
+static inline unsigned int dmap_ctz32(unsigned int x) {
+    #if defined(_MSC_VER) || defined(_WIN32)
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return (unsigned int)index;
+    #else
+        return (unsigned int)__builtin_ctz(x);
+    #endif
+}
+static inline unsigned int dmap_ctz64(unsigned long long x) {
+    #if defined(_MSC_VER) || defined(_WIN32)
+        unsigned long index;
+        _BitScanForward64(&index, x);
+        return (unsigned int)index;
+    #else
+        return (unsigned int)__builtin_ctzll(x);
+    #endif
+}
+
+// read prefetch, a hint only
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #include <xmmintrin.h>
+    #define dmap_prefetch(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#elif defined(__GNUC__) || defined(__clang__)
+    #define dmap_prefetch(p) __builtin_prefetch((p), 0, 3)
+#else
+    #define dmap_prefetch(p) ((void)(p))
+#endif
 
 #include <time.h>
 #if defined(__linux__) || defined(__APPLE__)
@@ -58,6 +101,12 @@ static inline size_t next_power_of_2(size_t x) {
 #ifdef _WIN32
     #include <windows.h>
     #include <process.h>
+    #include <malloc.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
 #endif
 // todo: needed?
 // random hash seed 
@@ -87,6 +136,9 @@ uint64_t dmap_generate_seed() {
 #ifndef MAX
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 #endif
+#ifndef MIN
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
+#endif
 
 #define ALIGN_DOWN(n, a) ((n) & ~((a) - 1))
 #define ALIGN_UP(n, a) ALIGN_DOWN((n) + (a) - 1, (a))
@@ -118,26 +170,316 @@ static void (*dmap_error_handler)(char* err_msg) = dmap_default_error_handler;
 void dmap_set_error_handler(void (*handler)(char* err_msg)) {
     dmap_error_handler = handler ? handler : dmap_default_error_handler; // fallback to default
 }
+const char *dmap_error_str(int err) {
+    switch(err){
+        case DMAP_OK:           return "ok";
+        case DMAP_ERR_NOMEM:    return "Out of memory";
+        case DMAP_ERR_CAPACITY: return "Error: Max capacity exceeded.\n";
+        case DMAP_ERR_MAX_SIZE: return "Error: Max size exceeded. Raise DmapOptions.max_size, or #define DMAP_DEFAULT_MAX_SIZE to override the default.";
+        case DMAP_ERR_READONLY: return "Error: map was opened from a snapshot and is read-only";
+        default:                return "Error: unknown error";
+    }
+}
+// reports err from a try function through the error handler, for the functions that can't return it
+static void dmap_fail(int err) {
+    dmap_error_handler((char*)dmap_error_str(err));
+}
+
+// /////////////////////////////////////////////
+// MARK: ALLOCATOR
+// /////////////////////////////////////////////
+// Every allocation dmap makes goes through the map's DmapAllocator. The default one wraps the C runtime.
+
+static void *dmap_default_alloc(void *ctx, size_t size, size_t alignment) {
+    (void)ctx;
+    alignment = MAX(alignment, (size_t)DMAP_ALIGNMENT);
+    #ifdef _WIN32
+        return _aligned_malloc(size, alignment); // _aligned_free can't take plain malloc memory, so everything goes this way
+    #else
+        if(alignment <= 16){
+            return malloc(size);
+        }
+        void *p = NULL;
+        return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+    #endif
+}
+static void *dmap_default_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    (void)ctx; (void)old_size;
+    #ifdef _WIN32
+        return _aligned_realloc(ptr, new_size, DMAP_ALIGNMENT);
+    #else
+        return realloc(ptr, new_size);
+    #endif
+}
+static void dmap_default_free(void *ctx, void *ptr, size_t size) {
+    (void)ctx; (void)size;
+    #ifdef _WIN32
+        _aligned_free(ptr);
+    #else
+        free(ptr);
+    #endif
+}
+static const DmapAllocator dmap_default_allocator = {dmap_default_alloc, dmap_default_realloc, dmap_default_free, NULL};
+
+static inline void *dmap_mem_alloc(const DmapAllocator *a, size_t size, size_t alignment) {
+    return a->alloc_fn(a->ctx, size, alignment);
+}
+static void *dmap_mem_realloc(const DmapAllocator *a, void *ptr, size_t old_size, size_t new_size) {
+    if(a->realloc_fn){
+        return a->realloc_fn(a->ctx, ptr, old_size, new_size);
+    }
+    void *p = a->alloc_fn(a->ctx, new_size, DMAP_ALIGNMENT);
+    if(p && ptr){
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+        if(a->free_fn) a->free_fn(a->ctx, ptr, old_size);
+    }
+    return p;
+}
+static inline void dmap_mem_free(const DmapAllocator *a, void *ptr, size_t size) {
+    if(ptr && a->free_fn){
+        a->free_fn(a->ctx, ptr, size);
+    }
+}
+
+// Huge page backing for large tables, used with the default allocator. A custom allocator is asked for
+// DMAP_HUGE_PAGE_SIZE alignment instead and can back it however it likes.
+#if defined(__linux__)
+static void *dmap_huge_alloc(size_t size) {
+    size = ALIGN_UP(size, DMAP_HUGE_PAGE_SIZE);
+    #ifdef MAP_HUGETLB
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED){
+            return p;
+        }
+    #endif
+    // no reserved hugetlb pages - map a 2MB aligned range and ask for transparent huge pages instead
+    size_t span = size + DMAP_HUGE_PAGE_SIZE;
+    u8 *base = (u8*)mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if((void*)base == MAP_FAILED){
+        return NULL;
+    }
+    u8 *start = (u8*)ALIGN_UP_PTR(base, DMAP_HUGE_PAGE_SIZE);
+    if(start > base){
+        munmap(base, (size_t)(start - base));
+    }
+    if(base + span > start + size){
+        munmap(start + size, (size_t)(base + span - (start + size)));
+    }
+    #ifdef MADV_HUGEPAGE
+        madvise(start, size, MADV_HUGEPAGE);
+    #endif
+    return start;
+}
+static void dmap_huge_free(void *p, size_t size) {
+    munmap(p, ALIGN_UP(size, DMAP_HUGE_PAGE_SIZE));
+}
+#else
+static void *dmap_huge_alloc(size_t size) {
+    return dmap_default_alloc(NULL, size, DMAP_HUGE_PAGE_SIZE); // at least keep the table on a huge page boundary
+}
+static void dmap_huge_free(void *p, size_t size) {
+    dmap_default_free(NULL, p, size);
+}
+#endif
+// the header and data array use data_allocator_fn if one was given, otherwise the map's allocator
+static DmapHdr *dmap_hdr_realloc(DmapHdr *d, const DmapOptions *options, size_t old_size, size_t new_size) {
+    if(options->data_allocator_fn){
+        return (DmapHdr*)options->data_allocator_fn(d, new_size);
+    }
+    if(!new_size){
+        dmap_mem_free(&options->allocator, d, old_size);
+        return NULL;
+    }
+    if(!d){
+        return (DmapHdr*)dmap_mem_alloc(&options->allocator, new_size, DMAP_ALIGNMENT);
+    }
+    return (DmapHdr*)dmap_mem_realloc(&options->allocator, d, old_size, new_size);
+}
 
 // /////////////////////////////////////////////
 // MARK: DMAP
 // /////////////////////////////////////////////
 
+// Table slots come in several layouts, picked per map. Every layout starts with a DmapSlot, so probing,
+// rehashing and moving slots only need d->slot_size; only key handling looks at the layout itself.
+typedef struct DmapSlot {
+    s32 data_idx; // index into data[], or DMAP_EMPTY / DMAP_DELETED
+    u32 hash;     // low 32 bits of the key's hash - enough to place it in any table up to DMAP_MAX_CAPACITY
+} DmapSlot;
+
+// generic layout: user managed keys and non-string keys > 8 bytes
 struct DmapTable {
-    u64 hash;
+    s32 data_idx;
+    u32 hash;
     union {
         u64 key;
         void *ptr;
         char *kstr;
         char small_kstr[8];
     };
+    s32 kstr_len;
+};
+// string keys copied by dmap: keys up to DMAP_INLINE_KSTR bytes live in the slot itself. Longer keys keep
+// their first DMAP_KSTR_PREFIX bytes next to the pointer to the heap copy, so most mismatches are rejected
+// without dereferencing it
+#define DMAP_INLINE_KSTR 20
+#define DMAP_KSTR_PREFIX 12
+typedef struct DmapKstrSlot {
     s32 data_idx;
+    u32 hash;
     s32 kstr_len;
+    char kbytes[DMAP_INLINE_KSTR]; // the key, or a prefix followed by the (unaligned) heap pointer
+} DmapKstrSlot;
+
+enum {
+    DMAP_SLOT_WIDE, // struct DmapTable
+    DMAP_SLOT_INT,  // DmapIntSlot
+    DMAP_SLOT_KSTR, // DmapKstrSlot
 };
+// big enough for any slot layout, used when slots have to be swapped
+typedef union DmapAnySlot {
+    DmapSlot slot;
+    DmapTable wide;
+    DmapIntSlot int_slot;
+    DmapKstrSlot kstr_slot;
+} DmapAnySlot;
+
+#define DMAP_SLOT(d, table, i) ((DmapSlot*)((char*)(table) + (size_t)(i) * (size_t)(d)->slot_size))
 
-#define DMAP_EMPTY   INT32_MAX
-#define DMAP_DELETED (INT32_MAX - 1)
 #define DMAP_MAX_CAPACITY ((size_t)INT32_MAX - 2)
+#define DMAP_MAX_HASH_CAP ((size_t)1 << 30) // largest power of 2 table that hash_cap, an int, can hold
+#define DMAP_MAX_LOAD_FACTOR 0.95f
+
+// whether cap values of elem_size bytes in a table of hash_cap slots stay within the map's limits. The byte limit,
+// options.max_size or else DMAP_DEFAULT_MAX_SIZE, covers the header and data array
+static int dmap_check_limits(const DmapOptions *options, size_t hash_cap, size_t cap, size_t elem_size) {
+    if(hash_cap > DMAP_MAX_HASH_CAP || cap > DMAP_MAX_CAPACITY){
+        return DMAP_ERR_CAPACITY;
+    }
+    size_t max_size = options->max_size ? options->max_size : (size_t)DMAP_DEFAULT_MAX_SIZE;
+    if(max_size < offsetof(DmapHdr, data) || (elem_size && cap > (max_size - offsetof(DmapHdr, data)) / elem_size)){
+        return DMAP_ERR_MAX_SIZE;
+    }
+    return DMAP_OK;
+}
+
+// maps opened from a snapshot share their memory with the file, see MARK: SNAPSHOT
+static inline void dmap_check_writable(DmapHdr *d) {
+    if(d->snapshot){
+        dmap_fail(DMAP_ERR_READONLY);
+    }
+}
+
+// counters behind dmap_stats, compiled out unless DMAP_STATS is defined, see MARK: STATS
+#ifdef DMAP_STATS
+    #define DMAP_STAT_ADD(d, field, n) ((d)->stats.field += (n))
+    #define DMAP_STAT_PROBE(d) ((void)((d)->stats_off || (d)->stats_probes++))
+#else
+    #define DMAP_STAT_ADD(d, field, n) ((void)0)
+    #define DMAP_STAT_PROBE(d) ((void)0)
+#endif
+#ifdef DMAP_STATS
+static u64 dmap_now_ns(void) {
+    #ifdef _WIN32
+        LARGE_INTEGER t, f;
+        QueryPerformanceCounter(&t);
+        QueryPerformanceFrequency(&f);
+        return (u64)((double)t.QuadPart * 1e9 / (double)f.QuadPart);
+    #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (u64)ts.tv_sec * 1000000000ULL + (u64)ts.tv_nsec;
+    #endif
+}
+// records a lookup whose probes DMAP_STAT_PROBE counted since stats_probes was last reset
+static inline void dmap_stats_lookup(DmapHdr *d, bool hit) {
+    if(d->stats_off) return;
+    d->stats.lookups++;
+    d->stats.hits += hit;
+    d->stats.misses += !hit;
+    d->stats.probes += d->stats_probes;
+    d->stats.max_probe = MAX(d->stats.max_probe, (u64)d->stats_probes);
+}
+#else
+    #define dmap_stats_lookup(d, hit) ((void)0)
+#endif
+
+// /////////////////////////////////////////////
+// MARK: CTRL BYTES
+// /////////////////////////////////////////////
+// Optional swiss-table style metadata (DmapOptions.use_ctrl_bytes). One byte per table slot holds either
+// DMAP_CTRL_EMPTY, DMAP_CTRL_DELETED or a 7 bit tag of the hash. Slots are probed in aligned groups of 
+// DMAP_GROUP_WIDTH, so d->table is only touched on a tag match. The table slots mirror the ctrl state 
+// (data_idx is DMAP_EMPTY / DMAP_DELETED) so code that walks the table doesn't need to know about ctrl bytes.
+
+#define DMAP_GROUP_WIDTH  16
+#define DMAP_CTRL_EMPTY   0x80
+#define DMAP_CTRL_DELETED 0xFE
+// the top 7 bits, xored with bits 25-31 so that a hash_fn returning 32 bit values still gets a useful tag. The low
+// bits pick the home group. Given the low 32 bits, the tag and the top 7 bits determine each other (see dmap_set_slot_hash)
+#define DMAP_CTRL_H2(hash) ((u8)(((hash) >> 57) ^ ((u32)(hash) >> 25)))
+
+#if defined(DMAP_NEON)
+// collapses a lane-wise 0x00/0xFF comparison into a 16-bit mask
+static inline u32 dmap_neon_mask(uint8x16_t cmp) {
+    static const u8 bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t m = vandq_u8(cmp, vld1q_u8(bits));
+    return (u32)vaddv_u8(vget_low_u8(m)) | ((u32)vaddv_u8(vget_high_u8(m)) << 8);
+}
+#endif
+// returns a mask with bit i set if group[i] == tag
+static inline u32 dmap_group_match(const u8 *group, u8 tag) {
+#if defined(DMAP_SSE2)
+    __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#elif defined(DMAP_NEON)
+    return dmap_neon_mask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(tag)));
+#else
+    u32 mask = 0;
+    for(u32 i = 0; i < DMAP_GROUP_WIDTH; i++){
+        mask |= (u32)(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+// returns a mask with bit i set if group[i] is empty or deleted (both have the high bit set)
+static inline u32 dmap_group_match_free(const u8 *group) {
+#if defined(DMAP_SSE2)
+    return (u32)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#elif defined(DMAP_NEON)
+    return dmap_neon_mask(vtstq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+#else
+    u32 mask = 0;
+    for(u32 i = 0; i < DMAP_GROUP_WIDTH; i++){
+        mask |= (u32)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+// Groups are visited in triangular steps (0, 1, 3, 6, ...), which reaches every group exactly once
+// since the group count is a power of 2. A probe stops at the first group that still has an empty slot.
+static inline size_t dmap_group_start(u64 hash, size_t hash_cap) {
+    return (size_t)hash & (hash_cap - 1) & ~(size_t)(DMAP_GROUP_WIDTH - 1);
+}
+static inline size_t dmap_group_next(size_t group, size_t probe, size_t hash_cap) {
+    return (group + probe * DMAP_GROUP_WIDTH) & (hash_cap - 1);
+}
+// first empty or deleted slot along the probe sequence of hash
+static size_t dmap_ctrl_find_free(const u8 *ctrl, u64 hash, size_t hash_cap) {
+    size_t group = dmap_group_start(hash, hash_cap);
+    size_t num_groups = hash_cap / DMAP_GROUP_WIDTH;
+    for(size_t probe = 1; probe <= num_groups; probe++){
+        u32 free_mask = dmap_group_match_free(ctrl + group);
+        if(free_mask){
+            return group + dmap_ctz32(free_mask);
+        }
+        group = dmap_group_next(group, probe, hash_cap);
+    }
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(false); // unreachable - the load factor guarantees a free slot
+#endif
+    return 0;
+}
 
 
 // declare hash functions
@@ -166,29 +508,241 @@ static const u64 RAPIDHASH_SECRET[3] = {
 unsigned long long dmap_hash(void *key, size_t len){
     return rapidhash(key, len);
 }
-static unsigned long long dmap_generate_hash(void *key, size_t key_size, unsigned long long seed) {
+
+// /////////////////////////////////////////////
+// MARK: HASH ENGINES
+// /////////////////////////////////////////////
+// Built-in hashes for the keys that don't take the integer mixer (strings and keys over 8 bytes), picked per
+// map with DmapOptions.hash_engine. On x86 the hardware engines are compiled with per-function target
+// attributes and only called once the CPU has been checked, so no global -m flags are needed. On ARM they are
+// used when the compiler targets the CRC and AES extensions (always the case on Apple silicon). Both produce
+// the same values: the ARM AES round is built to match AESENC, and both CRC instructions compute CRC32C.
+// Unlike rapidhash, CRC32C is linear, so keys can be crafted to collide whatever the seed. Keep rapidhash for
+// keys from untrusted sources.
+
+#if !defined(DMAP_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+    #include <immintrin.h>
+    #define DMAP_HW_HASH
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #define DMAP_TARGET_CRC
+        #define DMAP_TARGET_AES
+    #else
+        #define DMAP_TARGET_CRC __attribute__((target("sse4.2")))
+        #define DMAP_TARGET_AES __attribute__((target("sse4.2,aes")))
+    #endif
+    typedef __m128i dmap_v128;
+    #define dmap_v_load(p) _mm_loadu_si128((const __m128i*)(p))
+    #define dmap_v_set(hi, lo) _mm_set_epi64x((long long)(hi), (long long)(lo))
+    #define dmap_v_xor(a, b) _mm_xor_si128((a), (b))
+    #define dmap_v_aes(s, k) _mm_aesenc_si128((s), (k)) // ShiftRows, SubBytes, MixColumns, then xor k
+    #define dmap_v_lo(v) ((u64)_mm_cvtsi128_si64(v))
+    #define dmap_v_hi(v) ((u64)_mm_extract_epi64((v), 1))
+    #define dmap_crc64(crc, v) ((u32)_mm_crc32_u64((crc), (v)))
+#elif !defined(DMAP_NO_SIMD) && defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+    #include <arm_acle.h>
+    #include <arm_neon.h>
+    #define DMAP_HW_HASH
+    #define DMAP_TARGET_CRC
+    #define DMAP_TARGET_AES
+    typedef uint8x16_t dmap_v128;
+    #define dmap_v_load(p) vld1q_u8((const uint8_t*)(p))
+    #define dmap_v_set(hi, lo) vreinterpretq_u8_u64(vcombine_u64(vcreate_u64((u64)(lo)), vcreate_u64((u64)(hi))))
+    #define dmap_v_xor(a, b) veorq_u8((a), (b))
+    #define dmap_v_aes(s, k) veorq_u8(vaesmcq_u8(vaeseq_u8((s), vdupq_n_u8(0))), (k)) // same as AESENC
+    #define dmap_v_lo(v) vgetq_lane_u64(vreinterpretq_u64_u8(v), 0)
+    #define dmap_v_hi(v) vgetq_lane_u64(vreinterpretq_u64_u8(v), 1)
+    #define dmap_crc64(crc, v) __crc32cd((crc), (v))
+#endif
+
+static bool dmap_cpu_has_crc32c(void) {
+    #if defined(DMAP_HW_HASH) && defined(__aarch64__)
+        return true; // checked at compile time
+    #elif defined(DMAP_HW_HASH) && defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] >> 20) & 1; // SSE4.2
+    #elif defined(DMAP_HW_HASH)
+        return __builtin_cpu_supports("sse4.2");
+    #else
+        return false;
+    #endif
+}
+static bool dmap_cpu_has_aes(void) {
+    #if defined(DMAP_HW_HASH) && defined(__aarch64__)
+        return true;
+    #elif defined(DMAP_HW_HASH) && defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        return ((info[2] >> 25) & 1) && ((info[2] >> 20) & 1); // AES-NI, plus SSE4.2 for the 64-bit extract
+    #elif defined(DMAP_HW_HASH)
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse4.2");
+    #else
+        return false;
+    #endif
+}
+// the engine a map actually uses: DMAP_HASH_AUTO picks one, and an engine the CPU lacks falls back to rapidhash
+static DmapHashEngine dmap_resolve_hash_engine(DmapHashEngine engine) {
+    bool crc = dmap_cpu_has_crc32c(), aes = dmap_cpu_has_aes();
+    switch(engine){
+        case DMAP_HASH_AUTO:     return crc && aes ? DMAP_HASH_HARDWARE : DMAP_HASH_RAPIDHASH;
+        case DMAP_HASH_CRC32C:   return crc ? DMAP_HASH_CRC32C : DMAP_HASH_RAPIDHASH;
+        case DMAP_HASH_AES:      return aes ? DMAP_HASH_AES : DMAP_HASH_RAPIDHASH;
+        case DMAP_HASH_HARDWARE: return crc && aes ? DMAP_HASH_HARDWARE : DMAP_HASH_RAPIDHASH;
+        default:                 return DMAP_HASH_RAPIDHASH;
+    }
+}
+
+#ifdef DMAP_HW_HASH
+// reads a key of up to 16 bytes as two words without a variable length copy; the word pairs only repeat for
+// keys of different lengths, which the callers mix in
+static inline void dmap_load_short(const u8 *p, size_t n, u64 *lo, u64 *hi) {
+    if(n >= 8){
+        memcpy(lo, p, 8);
+        memcpy(hi, p + n - 8, 8);
+    }
+    else if(n >= 4){
+        u32 a, b;
+        memcpy(&a, p, 4);
+        memcpy(&b, p + n - 4, 4);
+        *lo = a;
+        *hi = b;
+    }
+    else {
+        *lo = n ? (u64)p[0] | (u64)p[n >> 1] << 8 | (u64)p[n - 1] << 16 : 0;
+        *hi = 0;
+    }
+}
+// two CRC32C lanes over 16 bytes at a time; the second lane also takes the first word rotated, so that keys
+// of up to 8 bytes still fill all 64 bits. CRC mixes poorly on its own, so the result goes through the
+// integer mixer
+DMAP_TARGET_CRC static u64 dmap_crc32c_hash(const void *key, size_t len, u64 seed) {
+    const u8 *p = (const u8*)key;
+    u32 a = (u32)seed, b = (u32)(seed >> 32);
+    size_t n = len;
+    u64 w0 = 0, w1 = 0;
+    while(n > 16){
+        memcpy(&w0, p, 8);
+        memcpy(&w1, p + 8, 8);
+        a = dmap_crc64(a, w0);
+        b = dmap_crc64(b, w1);
+        p += 16;
+        n -= 16;
+    }
+    if(len > 16){ // the last 16 bytes of the key, overlapping what came before
+        memcpy(&w0, p + n - 16, 8);
+        memcpy(&w1, p + n - 8, 8);
+    }
+    else {
+        dmap_load_short(p, n, &w0, &w1);
+    }
+    a = dmap_crc64(a, w0);
+    b = dmap_crc64(b, w1 ^ (w0 >> 32 | w0 << 32));
+    return dmap__int_hash(((u64)a << 32 | b) ^ (u64)len * 0x9E3779B97F4A7C15ULL, seed);
+}
+// one AES round per 16 byte block, four lanes for long keys, then three rounds to finish
+DMAP_TARGET_AES static u64 dmap_aes_hash(const void *key, size_t len, u64 seed) {
+    const u8 *p = (const u8*)key;
+    const dmap_v128 c0 = dmap_v_set(0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL);
+    const dmap_v128 c1 = dmap_v_set(0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL);
+    const dmap_v128 c2 = dmap_v_set(0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL);
+    const dmap_v128 c3 = dmap_v_set(0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL);
+    dmap_v128 k = dmap_v_set(seed, seed ^ (u64)len);
+    dmap_v128 h0 = dmap_v_xor(k, c0), h1 = dmap_v_xor(k, c1);
+    size_t n = len;
+    if(n > 64){
+        dmap_v128 h2 = dmap_v_xor(k, c2), h3 = dmap_v_xor(k, c3);
+        do {
+            h0 = dmap_v_aes(dmap_v_xor(h0, dmap_v_load(p)), c0);
+            h1 = dmap_v_aes(dmap_v_xor(h1, dmap_v_load(p + 16)), c1);
+            h2 = dmap_v_aes(dmap_v_xor(h2, dmap_v_load(p + 32)), c2);
+            h3 = dmap_v_aes(dmap_v_xor(h3, dmap_v_load(p + 48)), c3);
+            p += 64;
+            n -= 64;
+        } while(n > 64);
+        h0 = dmap_v_aes(h0, h2);
+        h1 = dmap_v_aes(h1, h3);
+    }
+    while(n > 32){
+        h0 = dmap_v_aes(dmap_v_xor(h0, dmap_v_load(p)), c0);
+        h1 = dmap_v_aes(dmap_v_xor(h1, dmap_v_load(p + 16)), c1);
+        p += 32;
+        n -= 32;
+    }
+    if(n > 16){ // both lanes take one more block; the second overlaps the first unless n is 32
+        h0 = dmap_v_aes(dmap_v_xor(h0, dmap_v_load(p)), c0);
+        h1 = dmap_v_aes(dmap_v_xor(h1, dmap_v_load(p + n - 16)), c1);
+    }
+    else if(len >= 16){ // the last 16 bytes of the key, overlapping what came before
+        h0 = dmap_v_aes(dmap_v_xor(h0, dmap_v_load(p + n - 16)), c0);
+    }
+    else { // a short key; the length is already in k
+        u64 lo, hi;
+        dmap_load_short(p, n, &lo, &hi);
+        h0 = dmap_v_aes(dmap_v_xor(h0, dmap_v_set(hi, lo)), c0);
+    }
+    dmap_v128 r = dmap_v_aes(dmap_v_aes(dmap_v_aes(h0, h1), k), c2);
+    return dmap_v_lo(r) ^ dmap_v_hi(r);
+}
+#endif
+
+// keys of up to 8 bytes that aren't strings get the integer mixer the inline paths in dmap.h use
+static unsigned long long dmap_generate_hash(void *key, size_t key_size, bool is_string, DmapHashEngine engine, unsigned long long seed) {
+    if(!is_string && key_size <= 8){
+        return dmap__int_hash(dmap__int_key(key, key_size), seed);
+    }
+#ifdef DMAP_HW_HASH
+    switch(engine){ // only engines dmap_resolve_hash_engine returned get here
+        case DMAP_HASH_CRC32C:   return dmap_crc32c_hash(key, key_size, seed);
+        case DMAP_HASH_AES:      return dmap_aes_hash(key, key_size, seed);
+        case DMAP_HASH_HARDWARE: return key_size <= 16 ? dmap_crc32c_hash(key, key_size, seed) : dmap_aes_hash(key, key_size, seed);
+        default: break;
+    }
+#else
+    (void)engine;
+#endif
     return rapidhash_internal(key, key_size, seed, RAPIDHASH_SECRET);
 }
+static inline u64 dmap_key_hash(DmapHdr *d, void *key, size_t key_size) {
+    if(d->options.hash_fn){
+        return d->options.hash_fn(key, key_size);
+    }
+    if(d->options.seeded_hash_fn){
+        return d->options.seeded_hash_fn(key, key_size, d->hash_seed);
+    }
+    return dmap_generate_hash(key, key_size, d->is_string, d->options.hash_engine, d->hash_seed);
+}
 
-static void dmap_freelist_push(DmapHdr *dh, s32 index) {
+// makes room for one more free index; false if out of memory, leaving the list as it was
+static bool dmap_freelist_reserve(DmapHdr *dh) {
+    const DmapAllocator *a = &dh->options.allocator;
     if(!dh->free_list){
-        dh->free_list = (DmapFreeList*)malloc(sizeof(DmapFreeList));
-        if(!dh->free_list){
-            dmap_error_handler("malloc failed at freelist");
-        }
-        dh->free_list->cap = 16;
-        dh->free_list->len = 0;
-        dh->free_list->data = (s32*)malloc(dh->cap * sizeof(s32));
-        if(!dh->free_list->data){
-            dmap_error_handler("malloc failed at freelist");
+        DmapFreeList *fl = (DmapFreeList*)dmap_mem_alloc(a, sizeof(DmapFreeList), DMAP_ALIGNMENT);
+        s32 *data = fl ? (s32*)dmap_mem_alloc(a, 16 * sizeof(s32), DMAP_ALIGNMENT) : NULL;
+        if(!data){
+            dmap_mem_free(a, fl, sizeof(DmapFreeList));
+            return false;
         }
+        fl->data = data;
+        fl->cap = 16;
+        fl->len = 0;
+        dh->free_list = fl;
     }
     if (dh->free_list->len == dh->free_list->cap) {
-        dh->free_list->cap = (dh->free_list->cap * 3) / 2 + 1;  
-        dh->free_list->data = (s32*)realloc(dh->free_list->data, dh->free_list->cap * sizeof(s32));
-        if(!dh->free_list->data){
-            dmap_error_handler("realloc failed at freelist");
+        int old_cap = dh->free_list->cap;
+        int new_cap = (old_cap * 3) / 2 + 1;
+        s32 *data = (s32*)dmap_mem_realloc(a, dh->free_list->data, old_cap * sizeof(s32), new_cap * sizeof(s32));
+        if(!data){
+            return false;
         }
+        dh->free_list->data = data;
+        dh->free_list->cap = new_cap;
+    }
+    return true;
+}
+static void dmap_freelist_push(DmapHdr *dh, s32 index) {
+    if(!dmap_freelist_reserve(dh)){
+        dmap_error_handler("malloc failed at freelist");
+        return;
     }
     dh->free_list->data[dh->free_list->len++] = index;
 }
@@ -198,348 +752,3849 @@ static u32 dmap_freelist_pop(DmapHdr *dh) {
     }
     return DMAP_EMPTY;  // no free slots available
 }
-static bool keys_match(DmapHdr *d, size_t idx, void *key, size_t key_size) {
-    if (d->is_string && d->table[idx].kstr_len != (s32)key_size) {
+// occupancy bitmap: one bit per data[] index, set while it holds a live value
+static inline size_t dmap_occupied_bytes(size_t cap) {
+    return (cap + 63) / 64 * sizeof(u64);
+}
+static inline void dmap_occupied_set(DmapHdr *d, size_t idx) {
+    d->occupied[idx >> 6] |= 1ull << (idx & 63);
+}
+static inline void dmap_occupied_clear(DmapHdr *d, size_t idx) {
+    d->occupied[idx >> 6] &= ~(1ull << (idx & 63));
+}
+// the arrays kept per data index along with the data array: the occupancy bitmap, the index hashes (see MARK:
+// REVERSE INDEX) and the reference bits of cache maps
+typedef struct DmapIndexArrays {
+    u64 *occupied;
+    u32 *idx_hash;
+    u64 *referenced;
+} DmapIndexArrays;
+
+static void dmap_index_arrays_free(const DmapAllocator *a, DmapIndexArrays *arrays, size_t cap) {
+    dmap_mem_free(a, arrays->occupied, dmap_occupied_bytes(cap));
+    dmap_mem_free(a, arrays->idx_hash, MAX(cap, (size_t)1) * sizeof(u32));
+    dmap_mem_free(a, arrays->referenced, dmap_occupied_bytes(cap));
+}
+// allocates the arrays for new_cap indices, holding the contents of d's current ones up to new_cap. Bits for new
+// indices start cleared. d is left as is, so that a resize can still fail after this without changing the map
+static bool dmap_index_arrays_alloc(DmapHdr *d, size_t new_cap, DmapIndexArrays *out) {
+    const DmapAllocator *a = &d->options.allocator;
+    size_t bytes = dmap_occupied_bytes(new_cap);
+    out->occupied = (u64*)dmap_mem_alloc(a, bytes, DMAP_ALIGNMENT);
+    out->idx_hash = (u32*)dmap_mem_alloc(a, MAX(new_cap, (size_t)1) * sizeof(u32), DMAP_ALIGNMENT);
+    out->referenced = d->options.cache_max_entries > 0 ? (u64*)dmap_mem_alloc(a, bytes, DMAP_ALIGNMENT) : NULL;
+    if(!out->occupied || !out->idx_hash || (d->options.cache_max_entries > 0 && !out->referenced)){
+        dmap_index_arrays_free(a, out, new_cap);
         return false;
     }
-    void *stored = (!d->options.user_managed_keys && key_size <= 8)
-        ? (void*)&d->table[idx].key
-        : d->table[idx].ptr;
-    if (d->options.cmp_fn) {
-        return d->options.cmp_fn(stored, key, key_size);
+    memset(out->occupied, 0, bytes);
+    if(out->referenced){
+        memset(out->referenced, 0, bytes);
     }
-    return memcmp(stored, key, key_size) == 0;
+    if(d->occupied){
+        memcpy(out->occupied, d->occupied, MIN(dmap_occupied_bytes((size_t)d->cap), bytes));
+    }
+    if(d->idx_hash){
+        memcpy(out->idx_hash, d->idx_hash, MIN((size_t)d->cap, new_cap) * sizeof(u32));
+    }
+    return true;
 }
-
-// grows the entry array of the hashmap to accommodate more elements
-static void dmap_grow_table(DmapHdr *d, size_t new_hash_cap, size_t old_hash_cap) {
-    // size_t new_size_in_bytes = new_hash_cap * sizeof(DmapTable);
-    DmapTable *new_table = (DmapTable*)calloc(new_hash_cap, sizeof(DmapTable));
-    if (!new_table) {
-        dmap_error_handler("Out of memory 1");
+// replaces d's arrays, still sized for d->cap, with ones from dmap_index_arrays_alloc
+static void dmap_index_arrays_install(DmapHdr *d, const DmapIndexArrays *arrays) {
+    DmapIndexArrays old = {(u64*)d->occupied, d->idx_hash, (u64*)d->referenced};
+    dmap_index_arrays_free(&d->options.allocator, &old, (size_t)d->cap);
+    d->occupied = (unsigned long long*)arrays->occupied;
+    d->idx_hash = arrays->idx_hash;
+    d->referenced = (unsigned long long*)arrays->referenced;
+}
+// marks a cache entry as used since the clock hand last passed it (see MARK: CACHE)
+static inline void dmap_cache_touch(DmapHdr *d, s32 idx) {
+    if(d->referenced){
+        d->referenced[(size_t)idx >> 6] |= 1ull << ((size_t)idx & 63);
     }
-    for(size_t i = 0; i < new_hash_cap; i++){
-        new_table[i].data_idx = DMAP_EMPTY;
+}
+static inline char *dmap_kstr_slot_ptr(const DmapKstrSlot *entry) {
+    char *kstr;
+    memcpy(&kstr, entry->kbytes + DMAP_KSTR_PREFIX, sizeof(kstr));
+    return kstr;
+}
+static inline void dmap_kstr_slot_set_ptr(DmapKstrSlot *entry, char *kstr) {
+    memcpy(entry->kbytes + DMAP_KSTR_PREFIX, &kstr, sizeof(kstr));
+}
+// heap key pointers are stored relative to d->key_base, which is 0 except in maps opened from a snapshot
+static inline void *dmap_key_at_base(DmapHdr *d, void *stored) {
+    return (void*)((uintptr_t)stored + d->key_base);
+}
+// returns the stored key bytes of a live slot, and their length
+static inline void *dmap_slot_key(DmapHdr *d, DmapSlot *slot, size_t *key_size) {
+    if(d->slot_kind == DMAP_SLOT_INT){
+        *key_size = (size_t)d->key_size;
+        return &((DmapIntSlot*)slot)->key;
     }
-    // if the hashmap has existing table, rehash them into the new entry array
-    if (d->len) {
-        for (size_t i = 0; i < old_hash_cap; i++) {
-            if(d->table[i].data_idx == DMAP_EMPTY) continue;
-            size_t idx = d->table[i].hash & (new_hash_cap - 1);
-            // size_t j = new_hash_cap;
-            while(true){
-                // dmap_assert(j-- != 0); // unreachable, suggests no empty slot was found
-                if(new_table[idx].data_idx == DMAP_EMPTY){
-                    new_table[idx] = d->table[i];
-                    break;
-                }
-                idx = (idx + 1) & (new_hash_cap - 1);
-            }
-        }
+    if(d->slot_kind == DMAP_SLOT_KSTR){
+        DmapKstrSlot *entry = (DmapKstrSlot*)slot;
+        *key_size = (size_t)entry->kstr_len;
+        return entry->kstr_len <= DMAP_INLINE_KSTR ? entry->kbytes : dmap_key_at_base(d, dmap_kstr_slot_ptr(entry));
     }
-    // replace the old entry array with the new one
-    free(d->table);
-    d->table = new_table;
+    DmapTable *entry = (DmapTable*)slot;
+    *key_size = (size_t)entry->kstr_len;
+    return (!d->options.user_managed_keys && entry->kstr_len <= 8) ? (void*)&entry->key : dmap_key_at_base(d, entry->ptr);
 }
-static void *dmap__grow_internal(DmapHdr *d, size_t elem_size) {
-    DmapHdr *new_hdr = NULL;
-    size_t old_hash_cap = d->hash_cap;
-    size_t new_hash_cap = old_hash_cap * 2;
-    size_t new_cap = (size_t)((float)new_hash_cap * DMAP_LOAD_FACTOR);
-    size_t total_size_in_bytes = offsetof(DmapHdr, data) + (new_cap * elem_size);
-    if (new_cap > DMAP_MAX_CAPACITY) {
-        dmap_error_handler("Error: Max capacity exceeded.\n");
+static bool keys_match(DmapHdr *d, DmapSlot *slot, void *key, size_t key_size) {
+    if(d->slot_kind == DMAP_SLOT_INT && !d->options.cmp_fn){
+        return ((DmapIntSlot*)slot)->key == dmap__int_key(key, key_size);
     }
-    if(total_size_in_bytes > DMAP_DEFAULT_MAX_SIZE){
-        dmap_error_handler("Error: Max size exceeded. #define DMAP_DEFAULT_MAX_SIZE to overide default.");
+    if(d->slot_kind == DMAP_SLOT_KSTR && !d->options.cmp_fn){
+        DmapKstrSlot *entry = (DmapKstrSlot*)slot;
+        if(entry->kstr_len != (s32)key_size){
+            return false;
+        }
+        if(key_size <= DMAP_INLINE_KSTR){
+            return memcmp(entry->kbytes, key, key_size) == 0;
+        }
+        if(memcmp(entry->kbytes, key, DMAP_KSTR_PREFIX) != 0){ // reject on the prefix before touching the heap copy
+            return false;
+        }
+        return memcmp((char*)dmap_key_at_base(d, dmap_kstr_slot_ptr(entry)) + DMAP_KSTR_PREFIX, (char*)key + DMAP_KSTR_PREFIX, key_size - DMAP_KSTR_PREFIX) == 0;
+    }
+    size_t stored_size;
+    void *stored = dmap_slot_key(d, slot, &stored_size);
+    if (stored_size != key_size) {
+        return false;
+    }
+    if (d->options.cmp_fn) {
+        return d->options.cmp_fn(stored, key, key_size);
     }
+    return memcmp(stored, key, key_size) == 0;
+}
+static inline void dmap_copy_slot(DmapHdr *d, DmapSlot *dst, const DmapSlot *src) {
+    memcpy(dst, src, d->slot_size);
+}
+static inline void dmap_clear_slot(DmapHdr *d, DmapSlot *slot) {
+    memset(slot, 0, d->slot_size);
+    slot->data_idx = DMAP_EMPTY;
+}
 
-    new_hdr = (DmapHdr*)d->options.data_allocator_fn(d, total_size_in_bytes);
+// /////////////////////////////////////////////
+// MARK: KEY ARENA
+// /////////////////////////////////////////////
+// Optional bump allocator for the keys dmap copies to the heap (DmapOptions.use_key_arena). Keys are packed
+// into large chunks owned by the map. Deleting a key only counts its bytes as dead; they are reclaimed 
+// when the table is compacted or grown. Freeing the map frees the chunks instead of walking the table.
+// Chunks are reference counted so that clones can share them (see MARK: CLONE). A shared chunk is never
+// allocated from again, so the keys in it stay as they were for every owner.
 
-    if(!new_hdr) {
-        dmap_error_handler("Out of memory 2");
-    }
-    // grow the table to fit into the newly allocated space
-    dmap_grow_table(new_hdr, new_hash_cap, old_hash_cap); 
+#define DMAP_ARENA_MIN_CHUNK ((size_t)64 * 1024)
+#define DMAP_ARENA_MAX_CHUNK ((size_t)16 * 1024 * 1024)
 
-    new_hdr->cap = (u32)new_cap;
-    new_hdr->hash_cap = (u32)new_hash_cap;
+#if !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+typedef _Atomic size_t DmapChunkRefs; // a map and its clones may be freed from different threads
+#else
+typedef size_t DmapChunkRefs;
+#endif
 
-    dmap_assert(((uintptr_t)&new_hdr->data & (DMAP_ALIGNMENT - 1)) == 0); // ensure alignment
-    return new_hdr->data; // return the aligned data pointer
-}
+typedef struct DmapArenaChunk {
+    struct DmapArenaChunk *next;
+    size_t used;
+    size_t cap;
+    DmapChunkRefs refs; // maps whose chunk list holds this chunk
+    char data[]; // 8 byte aligned, follows four 8 byte fields
+} DmapArenaChunk;
 
-static void *dmap__init_internal(size_t elem_size, bool is_string, DmapOptions options){
-    DmapHdr *new_hdr = NULL;
+struct DmapKeyArena {
+    DmapArenaChunk *chunks; // newest first; only the newest one is allocated from
+    size_t live_bytes;
+    size_t dead_bytes;
+};
 
-    s32 capacity = options.initial_capacity;
-    size_t table_capacity = next_power_of_2(capacity);
-    while ((size_t)((float)table_capacity * DMAP_LOAD_FACTOR) < (size_t)capacity) {
-        if (table_capacity > SIZE_MAX / 2) {  // Prevent overflow
-            dmap_error_handler("Error: exceeded max capacity");
+static inline size_t dmap_arena_size(size_t key_size) {
+    return ALIGN_UP(key_size + 1, 8); // keep struct keys aligned; +1 so string keys stay nul terminated
+}
+static DmapArenaChunk *dmap_arena_new_chunk(const DmapAllocator *al, DmapKeyArena *a, size_t cap) {
+    DmapArenaChunk *chunk = (DmapArenaChunk*)dmap_mem_alloc(al, offsetof(DmapArenaChunk, data) + cap, DMAP_ALIGNMENT);
+    if(!chunk){
+        return NULL;
+    }
+    chunk->next = a->chunks;
+    chunk->used = 0;
+    chunk->cap = cap;
+    chunk->refs = 1;
+    a->chunks = chunk;
+    return chunk;
+}
+static void *dmap_arena_alloc(const DmapAllocator *al, DmapKeyArena *a, size_t size) {
+    DmapArenaChunk *chunk = a->chunks;
+    if(!chunk || chunk->cap - chunk->used < size || chunk->refs > 1){
+        size_t cap = chunk ? chunk->cap * 2 : DMAP_ARENA_MIN_CHUNK;
+        cap = cap > DMAP_ARENA_MAX_CHUNK ? DMAP_ARENA_MAX_CHUNK : cap;
+        chunk = dmap_arena_new_chunk(al, a, MAX(cap, size));
+        if(!chunk){
+            return NULL;
         }
-        table_capacity *= 2;
     }
-    capacity = (size_t)((float)table_capacity * DMAP_LOAD_FACTOR);
-    size_t size_in_bytes = offsetof(DmapHdr, data) + (capacity * elem_size);
-    if(capacity > DMAP_MAX_CAPACITY){
-        dmap_error_handler("Error: Max capacity exceeded.\n");
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    a->live_bytes += size;
+    return p;
+}
+// drops one owner's reference on each chunk of the list, freeing the chunks no other map holds
+static void dmap_arena_free_chunks(const DmapAllocator *al, DmapArenaChunk *chunk) {
+    while(chunk){
+        DmapArenaChunk *next = chunk->next; // read while the chunk is still referenced
+        if(--chunk->refs == 0){
+            dmap_mem_free(al, chunk, offsetof(DmapArenaChunk, data) + chunk->cap);
+        }
+        chunk = next;
     }
-    if(size_in_bytes > DMAP_DEFAULT_MAX_SIZE){
-        dmap_error_handler("Error: Max size exceeded. #define DMAP_DEFAULT_MAX_SIZE to overide default.");
+}
+static char *dmap_strdup(const DmapAllocator *a, char *src, size_t len) {
+    char *dst = (char*)dmap_mem_alloc(a, len + 1, DMAP_ALIGNMENT);
+    if (!dst) {
+        return NULL; 
     }
-    if(!options.data_allocator_fn){
-        options.data_allocator_fn = realloc;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst;
+}
+static void *dmap_dup_struct(const DmapAllocator *a, const void *src, size_t len) {
+    void *dst = dmap_mem_alloc(a, len, DMAP_ALIGNMENT);
+    if (!dst) {
+        return NULL;
     }
-    new_hdr = (DmapHdr*)options.data_allocator_fn(NULL, size_in_bytes);
-    if(!new_hdr){
-        dmap_error_handler("Out of memory 3");
+    memcpy(dst, src, len);
+    return dst;
+}
+// heap copy of a key, from the arena if the map has one. Returns NULL if out of memory
+static void *dmap_copy_key(DmapHdr *d, void *key, size_t key_size) {
+    DMAP_STAT_ADD(d, key_bytes, d->key_arena ? dmap_arena_size(key_size) : d->is_string ? key_size + 1 : key_size);
+    if(d->key_arena){
+        char *dst = (char*)dmap_arena_alloc(&d->options.allocator, d->key_arena, dmap_arena_size(key_size));
+        if(dst){
+            memcpy(dst, key, key_size);
+            dst[key_size] = '\0';
+        }
+        return dst;
     }
-    if(options.free_key_fn){
-        options.user_managed_keys = true;
+    return d->is_string ? dmap_strdup(&d->options.allocator, (char*)key, key_size) : dmap_dup_struct(&d->options.allocator, key, key_size);
+}
+static void dmap_release_key(DmapHdr *d, void *stored, size_t key_size) {
+    DMAP_STAT_ADD(d, key_bytes, 0 - (d->key_arena ? dmap_arena_size(key_size) : d->is_string ? key_size + 1 : key_size));
+    if(d->key_arena){
+        d->key_arena->live_bytes -= dmap_arena_size(key_size);
+        d->key_arena->dead_bytes += dmap_arena_size(key_size);
+        return;
     }
-    new_hdr->options = options;
-    new_hdr->len = 0;
-    new_hdr->cap = (u32)capacity;
-    new_hdr->hash_cap = (u32)table_capacity;
-    new_hdr->returned_idx = DMAP_EMPTY;
-    new_hdr->table = NULL;
-    new_hdr->free_list = NULL;
-    new_hdr->key_size = 0;
-    new_hdr->val_size = (u32)elem_size;
-    new_hdr->hash_seed = dmap_generate_seed();
-    new_hdr->is_string = is_string;
-
-    dmap_grow_table(new_hdr, new_hdr->hash_cap, 0);
-    dmap_assert(((uintptr_t)&new_hdr->data & (DMAP_ALIGNMENT - 1)) == 0); // ensure alignment
-    return new_hdr->data;
+    dmap_mem_free(&d->options.allocator, stored, d->is_string ? key_size + 1 : key_size);
 }
-void *dmap__init(size_t elem_size, DmapOptions options){
+// whether a live slot's key is a heap copy owned by the map (not inline or user managed)
+static inline bool dmap_slot_key_on_heap(DmapHdr *d, DmapSlot *slot, size_t *key_size) {
+    if(d->slot_kind == DMAP_SLOT_KSTR){
+        *key_size = (size_t)((DmapKstrSlot*)slot)->kstr_len;
+        return *key_size > DMAP_INLINE_KSTR;
+    }
+    if(d->slot_kind == DMAP_SLOT_WIDE && !d->options.user_managed_keys){
+        *key_size = (size_t)((DmapTable*)slot)->kstr_len;
+        return *key_size > 8;
+    }
+    return false;
+}
+// the heap copy owned by a live slot, or NULL if its key is inline or user managed
+static void *dmap_slot_heap_key(DmapHdr *d, DmapSlot *slot, size_t *key_size) {
+    if(!dmap_slot_key_on_heap(d, slot, key_size)){
+        return NULL;
+    }
+    return d->slot_kind == DMAP_SLOT_KSTR ? dmap_kstr_slot_ptr((DmapKstrSlot*)slot) : ((DmapTable*)slot)->ptr;
+}
+// repacks live keys into a single chunk, dropping the space of deleted ones. Left as is if out of memory
+static void dmap_arena_compact(DmapHdr *d) {
+    DmapKeyArena *a = d->key_arena;
+    DmapKeyArena packed = {0};
+    if(a->live_bytes && !dmap_arena_new_chunk(&d->options.allocator, &packed, a->live_bytes)){
+        return;
+    }
+    for(size_t i = 0; i < (size_t)d->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+        size_t key_size;
+        void *stored = dmap_slot_heap_key(d, slot, &key_size);
+        if(!stored) continue;
+        char *dst = (char*)dmap_arena_alloc(&d->options.allocator, &packed, dmap_arena_size(key_size)); // fits, sized from live_bytes
+        memcpy(dst, stored, key_size + 1);
+        if(d->slot_kind == DMAP_SLOT_KSTR){
+            dmap_kstr_slot_set_ptr((DmapKstrSlot*)slot, dst);
+        }
+        else {
+            ((DmapTable*)slot)->ptr = dst;
+        }
+    }
+    dmap_arena_free_chunks(&d->options.allocator, a->chunks);
+    *a = packed;
+}
+
+// /////////////////////////////////////////////
+// MARK: ROBIN HOOD
+// /////////////////////////////////////////////
+// Optional robin hood probing (DmapOptions.robin_hood). Entries are kept ordered so that an entry never 
+// sits further from its home slot than the one before it plus one; an insert takes the slot of any entry
+// that is closer to home than itself. A lookup can then stop as soon as it meets an entry closer to home
+// than the current probe length, and a delete shifts the rest of the cluster back instead of leaving a
+// tombstone. The probe distance is derived from the hash already stored in each slot.
+
+static inline size_t dmap_rh_dist(u64 hash, size_t idx, size_t mask) {
+    return (idx - ((size_t)hash & mask)) & mask;
+}
+// places entry starting at slot idx, where its probe distance is dist, displacing entries closer to home
+static void dmap_rh_place(DmapHdr *d, void *table, size_t mask, const DmapSlot *entry, size_t idx, size_t dist) {
+    DmapAnySlot carry, tmp;
+    dmap_copy_slot(d, &carry.slot, entry);
+    DmapSlot *slot = DMAP_SLOT(d, table, idx);
+    while(slot->data_idx != DMAP_EMPTY){
+        size_t slot_dist = dmap_rh_dist(slot->hash, idx, mask);
+        if(slot_dist < dist){
+            dmap_copy_slot(d, &tmp.slot, slot);
+            dmap_copy_slot(d, slot, &carry.slot);
+            dmap_copy_slot(d, &carry.slot, &tmp.slot);
+            dist = slot_dist;
+        }
+        idx = (idx + 1) & mask;
+        dist++;
+        slot = DMAP_SLOT(d, table, idx);
+    }
+    dmap_copy_slot(d, slot, &carry.slot);
+}
+static s32 dmap_rh_find(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+    size_t mask = d->hash_cap - 1;
+    size_t idx = hash & mask;
+    for(size_t dist = 0; ; dist++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+        DMAP_STAT_PROBE(d);
+        if(slot->data_idx == DMAP_EMPTY || dmap_rh_dist(slot->hash, idx, mask) < dist){
+            return DMAP_INVALID; // key would have displaced this entry
+        }
+        if(slot->hash == (u32)hash && keys_match(d, slot, key, key_size)){
+            return (s32)idx;
+        }
+        idx = (idx + 1) & mask;
+    }
+}
+// returns an empty slot for a new entry with this hash, moving the entries after it along if needed
+static size_t dmap_rh_make_room(DmapHdr *d, u64 hash) {
+    size_t mask = d->hash_cap - 1;
+    size_t idx = hash & mask;
+    size_t dist = 0;
+    DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+    while(slot->data_idx != DMAP_EMPTY && dmap_rh_dist(slot->hash, idx, mask) >= dist){
+        idx = (idx + 1) & mask;
+        dist++;
+        slot = DMAP_SLOT(d, d->table, idx);
+    }
+    if(slot->data_idx != DMAP_EMPTY){
+        size_t next = (idx + 1) & mask;
+        dmap_rh_place(d, d->table, mask, slot, next, dmap_rh_dist(slot->hash, next, mask));
+        dmap_clear_slot(d, slot);
+    }
+    return idx;
+}
+// backward-shift deletion: pulls every following entry that isn't at its home slot back by one
+static void dmap_rh_remove(DmapHdr *d, size_t idx) {
+    size_t mask = d->hash_cap - 1;
+    size_t next = (idx + 1) & mask;
+    DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+    DmapSlot *next_slot = DMAP_SLOT(d, d->table, next);
+    while(next_slot->data_idx != DMAP_EMPTY && dmap_rh_dist(next_slot->hash, next, mask) != 0){
+        dmap_copy_slot(d, slot, next_slot);
+        slot = next_slot;
+        next = (next + 1) & mask;
+        next_slot = DMAP_SLOT(d, d->table, next);
+    }
+    dmap_clear_slot(d, slot);
+}
+// ctrl bytes share the table's allocation, directly after the slots
+static inline size_t dmap_table_bytes(DmapHdr *d, size_t hash_cap) {
+    return hash_cap * d->slot_size + (d->options.use_ctrl_bytes ? hash_cap : 0);
+}
+static inline bool dmap_table_on_huge_pages(DmapHdr *d, size_t bytes) {
+    return d->options.table_huge_pages && bytes >= DMAP_HUGE_PAGE_SIZE; // smaller tables would waste most of a page
+}
+static void *dmap_table_alloc(DmapHdr *d, size_t bytes) {
+    bool huge = dmap_table_on_huge_pages(d, bytes);
+    void *table = NULL;
+    if(huge && d->options.allocator.alloc_fn == dmap_default_alloc){
+        table = dmap_huge_alloc(bytes);
+    }
+    else {
+        table = dmap_mem_alloc(&d->options.allocator, bytes, huge ? DMAP_HUGE_PAGE_SIZE : MAX(d->options.table_alignment, (size_t)DMAP_ALIGNMENT));
+    }
+    return table;
+}
+// empties slots [from, to) of a freshly allocated table
+static void dmap_table_clear(DmapHdr *d, void *table, size_t from, size_t to) {
+    memset(DMAP_SLOT(d, table, from), 0, (to - from) * d->slot_size);
+    for(size_t i = from; i < to; i++){
+        DMAP_SLOT(d, table, i)->data_idx = DMAP_EMPTY;
+    }
+}
+static void dmap_table_free(DmapHdr *d, void *table, size_t bytes) {
+    if(!table) return;
+    if(dmap_table_on_huge_pages(d, bytes) && d->options.allocator.alloc_fn == dmap_default_alloc){
+        dmap_huge_free(table, bytes);
+    }
+    else {
+        dmap_mem_free(&d->options.allocator, table, bytes);
+    }
+}
+// /////////////////////////////////////////////
+// MARK: BLOOM
+// /////////////////////////////////////////////
+// Optional pre-filter for lookups (DmapOptions.bloom_bits_per_key), a split block bloom filter. A key sets one bit
+// in each of the DMAP_BLOOM_WORDS words of a single 32-byte block, so checking it reads one cache line, and most
+// keys that were never inserted are turned away before the table is touched. Bits come from the 32 hash bits
+// table slots keep, so the filter is rebuilt from the table alone whenever the table is resized or compacted.
+// Deleting can't clear bits; once enough keys are gone the filter is rebuilt from the remaining ones.
+
+#define DMAP_BLOOM_WORDS 8
+#define DMAP_BLOOM_BLOCK_BITS (DMAP_BLOOM_WORDS * 32)
+
+struct DmapBloom {
+    u64 num_blocks;
+    u64 keys;  // keys added since the last rebuild
+    u64 stale; // of those, deleted since
+    u64 pad;   // keeps the blocks 32 byte aligned
+    u32 blocks[][DMAP_BLOOM_WORDS];
+};
+
+static const u32 dmap_bloom_salt[DMAP_BLOOM_WORDS] = {
+    0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
+static inline size_t dmap_bloom_bytes(u64 num_blocks) {
+    return offsetof(DmapBloom, blocks) + (size_t)num_blocks * sizeof(u32[DMAP_BLOOM_WORDS]);
+}
+// the block is picked by a remix of the bits, which the table also uses to pick slots
+static inline u32 *dmap_bloom_block(const DmapBloom *f, u32 h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return (u32*)f->blocks[((u64)h * f->num_blocks) >> 32];
+}
+static inline void dmap_bloom_add(DmapBloom *f, u32 h) {
+    u32 *block = dmap_bloom_block(f, h);
+    for(int i = 0; i < DMAP_BLOOM_WORDS; i++){
+        block[i] |= 1u << ((h * dmap_bloom_salt[i]) >> 27);
+    }
+    f->keys++;
+}
+// false if the key with these hash bits is certainly not in the map
+static inline bool dmap_bloom_maybe(const DmapBloom *f, u32 h) {
+    const u32 *block = dmap_bloom_block(f, h);
+    u32 missing = 0;
+    for(int i = 0; i < DMAP_BLOOM_WORDS; i++){
+        missing |= ~block[i] & (1u << ((h * dmap_bloom_salt[i]) >> 27));
+    }
+    return missing == 0;
+}
+static void dmap_bloom_free(DmapHdr *d) {
+    if(d->bloom){
+        dmap_mem_free(&d->options.allocator, d->bloom, dmap_bloom_bytes(d->bloom->num_blocks));
+        d->bloom = NULL;
+    }
+}
+// sizes the filter for d->cap entries and fills it from the live slots of the table. If there is no memory for
+// that, the current filter is refilled at its old size instead, and a map without one goes on without it
+static void dmap_bloom_rebuild(DmapHdr *d) {
+    if(d->options.bloom_bits_per_key <= 0){
+        return;
+    }
+    u64 num_blocks = MAX(((u64)d->cap * (u64)d->options.bloom_bits_per_key + DMAP_BLOOM_BLOCK_BITS - 1) / DMAP_BLOOM_BLOCK_BITS, (u64)1);
+    if(!d->bloom || d->bloom->num_blocks != num_blocks){
+        DmapBloom *bloom = (DmapBloom*)dmap_mem_alloc(&d->options.allocator, dmap_bloom_bytes(num_blocks), 64);
+        if(bloom){
+            dmap_bloom_free(d);
+            d->bloom = bloom;
+        }
+        else if(!d->bloom){
+            return; // lookups go straight to the table
+        }
+        else {
+            num_blocks = d->bloom->num_blocks;
+        }
+    }
+    memset(d->bloom, 0, dmap_bloom_bytes(num_blocks));
+    d->bloom->num_blocks = num_blocks;
+    for(size_t i = 0; d->table && i < (size_t)d->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED){
+            dmap_bloom_add(d->bloom, slot->hash);
+        }
+    }
+}
+// stale bits only cost false positives. They are dropped once half of the keys the filter has seen are gone,
+// and not before an eighth of its capacity is, so a nearly empty map isn't rescanned every few deletes
+static inline void dmap_bloom_deleted(DmapHdr *d) {
+    DmapBloom *f = d->bloom;
+    if(f && ++f->stale > MAX(f->keys / 2, (u64)d->cap / 8)){
+        dmap_bloom_rebuild(d);
+    }
+}
+// /////////////////////////////////////////////
+// MARK: PARALLEL
+// /////////////////////////////////////////////
+// Work split across DmapOptions.executor. A linear probing rebuild partitions the new table into contiguous
+// ranges of slots, one per task. A task empties its range, then copies in every entry whose new home falls in
+// it. Because tables are powers of 2, those entries all have their old home in one range of the old table and
+// sit between it and the next empty slot, so each task only scans that part of the old table. An entry whose
+// probe would run past the end of its range is left out and placed once all tasks are done. The tasks write
+// to disjoint slots, and linear probing gives a valid table regardless of insertion order.
+
+#define DMAP_PARALLEL_MIN_SLOTS ((size_t)1 << 16) // per task; smaller tables aren't worth the handoff
+#define DMAP_PARALLEL_MAX_TASKS 64
+
+// tasks to split work over slots items into, 1 if it should run on the calling thread
+static int dmap_parallel_tasks(DmapHdr *d, size_t slots) {
+    if(!d->options.executor.run_fn || slots < 2 * DMAP_PARALLEL_MIN_SLOTS){
+        return 1;
+    }
+    size_t tasks = slots / DMAP_PARALLEL_MIN_SLOTS;
+    return (int)(tasks < DMAP_PARALLEL_MAX_TASKS ? tasks : DMAP_PARALLEL_MAX_TASKS);
+}
+
+typedef struct DmapRehashJob {
+    DmapHdr *d;
+    void *old_table;
+    size_t old_hash_cap;
+    void *new_table;
+    size_t new_hash_cap;
+    size_t part_slots; // new table slots per task
+    size_t ready;      // new table slots below this are already empty
+    bool overflow[DMAP_PARALLEL_MAX_TASKS];
+} DmapRehashJob;
+
+// the old slots that can hold an entry whose new home is in partition p
+static void dmap_rehash_span(DmapRehashJob *job, int p, size_t *start, size_t *count) {
+    size_t old_mask = job->old_hash_cap - 1;
+    if(job->part_slots >= job->old_hash_cap){
+        *start = 0;
+        *count = job->old_hash_cap;
+        return;
+    }
+    size_t n = job->part_slots;
+    *start = ((size_t)p * job->part_slots) & old_mask;
+    while(n < job->old_hash_cap && DMAP_SLOT(job->d, job->old_table, (*start + n) & old_mask)->data_idx != DMAP_EMPTY){
+        n++; // the cluster running past the range may still hold entries that hash into it
+    }
+    *count = n;
+}
+static void dmap_rehash_task(void *arg, int p) {
+    DmapRehashJob *job = (DmapRehashJob*)arg;
+    DmapHdr *d = job->d;
+    size_t lo = (size_t)p * job->part_slots;
+    size_t hi = lo + job->part_slots;
+    if(hi > job->ready){
+        dmap_table_clear(d, job->new_table, MAX(lo, job->ready), hi);
+    }
+    size_t start, count;
+    dmap_rehash_span(job, p, &start, &count);
+    for(size_t n = 0; n < count; n++){
+        DmapSlot *slot = DMAP_SLOT(d, job->old_table, (start + n) & (job->old_hash_cap - 1));
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+        size_t idx = slot->hash & (job->new_hash_cap - 1);
+        if(idx < lo || idx >= hi) continue;
+        while(idx < hi && DMAP_SLOT(d, job->new_table, idx)->data_idx != DMAP_EMPTY){
+            idx++;
+        }
+        if(idx == hi){ // belongs to the next task's range
+            job->overflow[p] = true;
+            continue;
+        }
+        dmap_copy_slot(d, DMAP_SLOT(d, job->new_table, idx), slot);
+    }
+}
+// empties new_table and fills it with the live entries of d->table (old_hash_cap slots, 0 for none)
+static void dmap_parallel_rehash(DmapHdr *d, void *new_table, size_t new_hash_cap, size_t old_hash_cap, size_t ready, int tasks) {
+    DmapRehashJob job = {0};
+    job.d = d;
+    job.old_table = d->table;
+    job.old_hash_cap = old_hash_cap;
+    job.new_table = new_table;
+    job.new_hash_cap = new_hash_cap;
+    job.part_slots = new_hash_cap / (size_t)tasks;
+    job.ready = ready;
+    d->options.executor.run_fn(d->options.executor.ctx, tasks, dmap_rehash_task, &job);
+    size_t mask = new_hash_cap - 1;
+    for(int p = 0; p < tasks; p++){
+        if(!job.overflow[p]) continue;
+        size_t lo = (size_t)p * job.part_slots;
+        size_t start, count;
+        dmap_rehash_span(&job, p, &start, &count);
+        for(size_t n = 0; n < count; n++){
+            DmapSlot *slot = DMAP_SLOT(d, job.old_table, (start + n) & (old_hash_cap - 1));
+            if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+            size_t idx = slot->hash & mask;
+            if(idx < lo || idx >= lo + job.part_slots) continue;
+            DmapSlot *dst;
+            while((dst = DMAP_SLOT(d, new_table, idx))->data_idx != DMAP_EMPTY && dst->data_idx != slot->data_idx){
+                idx = (idx + 1) & mask;
+            }
+            if(dst->data_idx == DMAP_EMPTY){ // not placed by the task
+                dmap_copy_slot(d, dst, slot);
+            }
+        }
+    }
+}
+
+typedef struct DmapHashJob {
+    DmapHdr *d;
+    const char *keys; // fixed size keys, or NULL for key_ptrs/key_sizes
+    size_t key_size;
+    void *const *key_ptrs;
+    const size_t *key_sizes;
+    size_t n;
+    size_t per_task;
+    u64 *hashes;
+} DmapHashJob;
+
+static void dmap_hash_task(void *arg, int t) {
+    DmapHashJob *job = (DmapHashJob*)arg;
+    size_t end = MIN(job->n, ((size_t)t + 1) * job->per_task);
+    for(size_t i = (size_t)t * job->per_task; i < end; i++){
+        void *key = job->keys ? (void*)(job->keys + i * job->key_size) : job->key_ptrs[i];
+        job->hashes[i] = dmap_key_hash(job->d, key, job->keys ? job->key_size : job->key_sizes[i]);
+    }
+}
+
+// table of new_hash_cap slots for dmap_grow_table: the one an incremental resize set up ahead of time, or a new
+// one. NULL if out of memory
+static void *dmap_table_for(DmapHdr *d, size_t new_hash_cap) {
+    if(d->next_table && (size_t)d->next_hash_cap == new_hash_cap){
+        return d->next_table;
+    }
+    return dmap_table_alloc(d, dmap_table_bytes(d, new_hash_cap));
+}
+// gives back a table from dmap_table_for that wasn't used after all
+static void dmap_table_unused(DmapHdr *d, void *table, size_t hash_cap) {
+    if(table != d->next_table){
+        dmap_table_free(d, table, dmap_table_bytes(d, hash_cap));
+    }
+}
+// grows the entry array of the hashmap to accommodate more elements: rehashes the entries into new_table, from 
+// dmap_table_for, which then replaces the current table
+static void dmap_grow_table(DmapHdr *d, void *new_table, size_t new_hash_cap, size_t old_hash_cap) {
+    bool use_ctrl = d->options.use_ctrl_bytes;
+    size_t table_size = new_hash_cap * d->slot_size;
+    size_t ready = 0;
+    int tasks = use_ctrl || d->options.robin_hood ? 1 : dmap_parallel_tasks(d, new_hash_cap);
+    if(new_table == d->next_table){ // set up ahead of time by an incremental resize
+        ready = (size_t)d->next_ready;
+    }
+    else {
+        dmap_table_free(d, d->next_table, dmap_table_bytes(d, d->next_hash_cap));
+    }
+    if(tasks == 1){
+        dmap_table_clear(d, new_table, ready, new_hash_cap);
+    }
+    d->next_table = NULL;
+    d->next_hash_cap = 0;
+    d->next_ready = 0;
+    u8 *new_ctrl = NULL;
+    if(use_ctrl){
+        new_ctrl = (u8*)new_table + table_size;
+        memset(new_ctrl, DMAP_CTRL_EMPTY, new_hash_cap);
+    }
+    // if the hashmap has existing table, rehash them into the new entry array
+    if(tasks > 1){
+        dmap_parallel_rehash(d, new_table, new_hash_cap, d->len ? old_hash_cap : 0, ready, tasks);
+    }
+    else if (d->len) {
+        for (size_t i = 0; i < old_hash_cap; i++) {
+            DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+            if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue; // drop tombstones
+            if(d->options.robin_hood){
+                dmap_rh_place(d, new_table, new_hash_cap - 1, slot, slot->hash & (new_hash_cap - 1), 0);
+                continue;
+            }
+            if(use_ctrl){
+                size_t idx = dmap_ctrl_find_free(new_ctrl, slot->hash, new_hash_cap);
+                new_ctrl[idx] = d->ctrl[i]; // the tag comes from hash bits that the slot doesn't keep
+                dmap_copy_slot(d, DMAP_SLOT(d, new_table, idx), slot);
+                continue;
+            }
+            size_t idx = slot->hash & (new_hash_cap - 1);
+            // size_t j = new_hash_cap;
+            while(true){
+                // dmap_assert(j-- != 0); // unreachable, suggests no empty slot was found
+                if(DMAP_SLOT(d, new_table, idx)->data_idx == DMAP_EMPTY){
+                    dmap_copy_slot(d, DMAP_SLOT(d, new_table, idx), slot);
+                    break;
+                }
+                idx = (idx + 1) & (new_hash_cap - 1);
+            }
+        }
+    }
+    // replace the old entry array with the new one
+    dmap_table_free(d, d->table, dmap_table_bytes(d, old_hash_cap));
+    d->table = new_table;
+    d->ctrl = new_ctrl;
+    d->tombstones = 0;
+}
+// /////////////////////////////////////////////
+// MARK: INCREMENTAL RESIZE
+// /////////////////////////////////////////////
+// Optional for linear probing (DmapOptions.incremental_resize). A grow reallocates the data array and starts an
+// empty table twice the size, but leaves the entries in the old one. Every insert, lookup and delete after that
+// moves the next DMAP_MIGRATE_STEP old slots across, and anything not found in the new table is looked up in the
+// old one. Moved entries leave a tombstone behind so the old table's probe chains stay intact. Values don't move,
+// so data indices are unaffected. The old table is always drained before the next resize.
+// Emptying the new table is itself linear in its size, so once the map is half full the table for the next grow 
+// is allocated and emptied a few slots per operation as well.
+
+#define DMAP_MIGRATE_STEP 64
+#define DMAP_PREPARE_MIN_SLOTS 1024 // smaller tables grow quickly enough in one go
+
+static void dmap_prepare_next_table(DmapHdr *d, size_t count) {
+    if(!d->next_table){
+        if(d->len < d->cap / 2 || d->hash_cap < DMAP_PREPARE_MIN_SLOTS) return;
+        size_t next_hash_cap = (size_t)d->hash_cap * 2;
+        d->next_table = dmap_table_alloc(d, dmap_table_bytes(d, next_hash_cap));
+        if(!d->next_table) return; // tried again at the grow itself
+        d->next_hash_cap = (int)next_hash_cap;
+        d->next_ready = 0;
+    }
+    size_t ready = (size_t)d->next_ready;
+    size_t end = (size_t)d->next_hash_cap - ready > count * 4 ? ready + count * 4 : (size_t)d->next_hash_cap;
+    dmap_table_clear(d, d->next_table, ready, end);
+    d->next_ready = (int)end;
+}
+
+static DmapSlot *dmap_old_find(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+    size_t mask = d->old_hash_cap - 1;
+    for(size_t idx = hash & mask;; idx = (idx + 1) & mask){
+        DmapSlot *slot = DMAP_SLOT(d, d->old_table, idx);
+        DMAP_STAT_PROBE(d);
+        if(slot->data_idx == DMAP_EMPTY){
+            return NULL;
+        }
+        if(slot->data_idx != DMAP_DELETED && slot->hash == (u32)hash && keys_match(d, slot, key, key_size)){
+            return slot;
+        }
+    }
+}
+static inline void dmap_old_mark_deleted(DmapHdr *d, DmapSlot *slot) {
+    memset(slot, 0, d->slot_size); // the key now belongs to the new table, or was released
+    slot->data_idx = DMAP_DELETED;
+}
+// moves up to count slots of the old table into the new one, and frees it once drained
+static void dmap_migrate(DmapHdr *d, size_t count) {
+    if(!d->old_table){
+        if(d->options.incremental_resize && (!d->next_table || d->next_ready < d->next_hash_cap)){
+            dmap_prepare_next_table(d, count);
+        }
+        return;
+    }
+    size_t mask = d->hash_cap - 1;
+    size_t end = (size_t)d->old_hash_cap - d->migrate_pos > count ? d->migrate_pos + count : (size_t)d->old_hash_cap;
+    for(size_t i = d->migrate_pos; i < end; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->old_table, i);
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+        size_t idx = slot->hash & mask;
+        DmapSlot *dst;
+        while((dst = DMAP_SLOT(d, d->table, idx))->data_idx != DMAP_EMPTY && dst->data_idx != DMAP_DELETED){
+            idx = (idx + 1) & mask;
+        }
+        if(dst->data_idx == DMAP_DELETED){ // the key can't be in the new table, so the first free slot will do
+            d->tombstones -= 1;
+        }
+        dmap_copy_slot(d, dst, slot);
+        dmap_old_mark_deleted(d, slot);
+    }
+    d->migrate_pos = (int)end;
+    if(end == (size_t)d->old_hash_cap){
+        dmap_table_free(d, d->old_table, dmap_table_bytes(d, d->old_hash_cap));
+        d->old_table = NULL;
+        d->old_hash_cap = 0;
+        d->migrate_pos = 0;
+    }
+}
+static inline void dmap_finish_migration(DmapHdr *d) {
+    if(d->old_table){
+        dmap_migrate(d, SIZE_MAX);
+    }
+}
+
+// In-place rehash for linear probing. Tombstones become empty, then every live entry is moved to the 
+// first empty slot from its home. Walking forward from a slot that was already empty means each cluster 
+// is rebuilt front to back, so an entry can only move backwards into slots that have already been settled.
+static void dmap_compact_linear(DmapHdr *d) {
+    size_t mask = d->hash_cap - 1;
+    size_t start = 0;
+    while(DMAP_SLOT(d, d->table, start)->data_idx != DMAP_EMPTY){ // no probe chain crosses a slot that is empty now
+        start++;
+    }
+    for(size_t i = 0; i < (size_t)d->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx == DMAP_DELETED){
+            slot->data_idx = DMAP_EMPTY;
+        }
+    }
+    for(size_t n = 1; n <= (size_t)d->hash_cap; n++){
+        size_t i = (start + n) & mask;
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx == DMAP_EMPTY) continue;
+        size_t idx = slot->hash & mask;
+        while(idx != i && DMAP_SLOT(d, d->table, idx)->data_idx != DMAP_EMPTY){
+            idx = (idx + 1) & mask;
+        }
+        if(idx != i){
+            dmap_copy_slot(d, DMAP_SLOT(d, d->table, idx), slot);
+            dmap_clear_slot(d, slot);
+        }
+    }
+}
+// In-place rehash for ctrl bytes. Tombstones become empty and live entries are marked DMAP_CTRL_DELETED,
+// meaning "not placed yet". Each unplaced entry either stays (its group is the first one with room), 
+// moves to an empty slot, or swaps with another unplaced entry which is then placed in turn.
+// Slots only keep the low hash bits, so tags are recomputed from the keys.
+static void dmap_compact_ctrl(DmapHdr *d) {
+    size_t hash_cap = d->hash_cap;
+    for(size_t i = 0; i < hash_cap; i++){
+        if(d->ctrl[i] & 0x80){
+            d->ctrl[i] = DMAP_CTRL_EMPTY;
+            DMAP_SLOT(d, d->table, i)->data_idx = DMAP_EMPTY;
+        }
+        else {
+            d->ctrl[i] = DMAP_CTRL_DELETED;
+        }
+    }
+    for(size_t i = 0; i < hash_cap; ){
+        if(d->ctrl[i] != DMAP_CTRL_DELETED){
+            i++;
+            continue;
+        }
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        size_t key_size;
+        void *key = dmap_slot_key(d, slot, &key_size);
+        u8 h2 = DMAP_CTRL_H2(dmap_key_hash(d, key, key_size));
+        size_t target = dmap_ctrl_find_free(d->ctrl, slot->hash, hash_cap);
+        DmapSlot *target_slot = DMAP_SLOT(d, d->table, target);
+        if(target / DMAP_GROUP_WIDTH == i / DMAP_GROUP_WIDTH){
+            d->ctrl[i] = h2;
+            i++;
+        }
+        else if(d->ctrl[target] == DMAP_CTRL_EMPTY){
+            dmap_copy_slot(d, target_slot, slot);
+            d->ctrl[target] = h2;
+            dmap_clear_slot(d, slot);
+            d->ctrl[i] = DMAP_CTRL_EMPTY;
+            i++;
+        }
+        else { // target is still unplaced - swap, then place whatever landed in i
+            DmapAnySlot tmp;
+            dmap_copy_slot(d, &tmp.slot, target_slot);
+            dmap_copy_slot(d, target_slot, slot);
+            dmap_copy_slot(d, slot, &tmp.slot);
+            d->ctrl[target] = h2;
+        }
+    }
+}
+// drops the tombstones and the dead key space. When an insert runs out of room this stands in for a grow, and
+// with parallel set a map with an executor is rebuilt across tasks into a new table, as a grow would be.
+// dmap_compact stays in place
+static void dmap_compact_internal(DmapHdr *d, bool parallel) {
+    if(!d->table) return;
+    dmap_check_writable(d);
+    dmap_finish_migration(d);
+    if(d->tombstones){
+        void *table = parallel && !d->ctrl && !d->next_table && dmap_parallel_tasks(d, d->hash_cap) > 1 ? dmap_table_for(d, d->hash_cap) : NULL;
+        if(table){
+            dmap_grow_table(d, table, d->hash_cap, d->hash_cap); // rebuilt into a new table of the same size, see MARK: PARALLEL
+        }
+        else if(d->ctrl){
+            dmap_compact_ctrl(d);
+        }
+        else {
+            dmap_compact_linear(d);
+        }
+        d->tombstones = 0;
+    }
+    if(d->key_arena && d->key_arena->dead_bytes){
+        dmap_arena_compact(d);
+    }
+    dmap_bloom_rebuild(d); // drops the bits of deleted keys
+}
+void dmap__compact(DmapHdr *d) {
+    dmap_compact_internal(d, false);
+}
+// smallest table, no smaller than the current one, that holds min_cap entries at the map's load factor. 0 if
+// that takes more than DMAP_MAX_HASH_CAP slots
+static size_t dmap_hash_cap_for(DmapHdr *d, size_t min_cap) {
+    size_t hash_cap = d->hash_cap;
+    while((size_t)((float)hash_cap * d->options.load_factor) < min_cap){ // low load factors on tiny tables may need more than one doubling
+        if(hash_cap >= DMAP_MAX_HASH_CAP){
+            return 0;
+        }
+        hash_cap *= 2;
+    }
+    return hash_cap;
+}
+// Reallocates the data array and rebuilds the table with new_hash_cap slots, or only starts moving entries over
+// if incremental. Everything that can fail is allocated before the map is touched, so on an error the map and *dp
+// are left as they were. Otherwise *dp is the new header
+static int dmap_try_resize(DmapHdr **dp, size_t elem_size, size_t new_hash_cap, bool incremental) {
+    DmapHdr *d = *dp;
+    if(d->snapshot){
+        return DMAP_ERR_READONLY;
+    }
+    size_t new_cap = (size_t)((float)new_hash_cap * d->options.load_factor);
+    int err = new_hash_cap ? dmap_check_limits(&d->options, new_hash_cap, new_cap, elem_size) : DMAP_ERR_CAPACITY;
+    if(err){
+        return err;
+    }
+    dmap_finish_migration(d);
+    size_t old_hash_cap = d->hash_cap;
+    DmapIndexArrays arrays;
+    if(!dmap_index_arrays_alloc(d, new_cap, &arrays)){
+        return DMAP_ERR_NOMEM;
+    }
+    void *new_table = dmap_table_for(d, new_hash_cap);
+    DmapHdr *new_hdr = NULL;
+    if(new_table){
+        new_hdr = dmap_hdr_realloc(d, &d->options, offsetof(DmapHdr, data) + ((size_t)d->cap * elem_size), offsetof(DmapHdr, data) + new_cap * elem_size);
+    }
+    if(!new_hdr) { // a failed realloc leaves the old block alone
+        if(new_table){
+            dmap_table_unused(d, new_table, new_hash_cap);
+        }
+        dmap_index_arrays_free(&d->options.allocator, &arrays, new_cap);
+        return DMAP_ERR_NOMEM;
+    }
+    dmap_index_arrays_install(new_hdr, &arrays);
+    if(incremental && new_hdr->len){
+        // keep the old table to drain a little at a time, see MARK: INCREMENTAL RESIZE
+        new_hdr->old_table = new_hdr->table;
+        new_hdr->old_hash_cap = (int)old_hash_cap;
+        new_hdr->migrate_pos = 0;
+        new_hdr->table = NULL;
+        old_hash_cap = 0;
+    }
+    // grow the table to fit into the newly allocated space
+    dmap_grow_table(new_hdr, new_table, new_hash_cap, old_hash_cap); 
+    new_hdr->cap = (u32)new_cap;
+    new_hdr->hash_cap = (u32)new_hash_cap;
+    dmap_bloom_rebuild(new_hdr); // sized for the new capacity
+    if(new_hdr->key_arena && new_hdr->key_arena->dead_bytes > new_hdr->key_arena->live_bytes && !new_hdr->old_table){
+        dmap_arena_compact(new_hdr); // more than half of the key space is dead
+    }
+
+    dmap_assert(((uintptr_t)&new_hdr->data & (DMAP_ALIGNMENT - 1)) == 0); // ensure alignment
+    *dp = new_hdr;
+    return DMAP_OK;
+}
+// same as above, reporting errors through the error handler; returns the new header
+static DmapHdr *dmap_resize(DmapHdr *d, size_t elem_size, size_t new_hash_cap, bool incremental) {
+    int err = dmap_try_resize(&d, elem_size, new_hash_cap, incremental);
+    if(err){
+        dmap_fail(err);
+    }
+    return d;
+}
+
+static int dmap_try_make_room(DmapHdr **dp, size_t elem_size) {
+    DmapHdr *d = *dp;
+    if(d->options.cache_max_entries > 0){
+        // a full cache evicts on insert instead of growing; only the tombstones left by evictions and deletes go
+        if(d->tombstones > d->cap / 4){
+            dmap_compact_internal(d, true);
+        }
+        return DMAP_OK;
+    }
+    // same-size rehash when tombstones rather than live entries pushed the table past its load factor.
+    // if only a few slots are tombstones doubling is cheaper, since compacting again would come around soon
+    if(d->len < d->cap && d->tombstones >= d->cap / 4){
+        dmap_compact_internal(d, true);
+        return DMAP_OK;
+    }
+    return dmap_try_resize(dp, elem_size, dmap_hash_cap_for(d, (size_t)d->cap + 1), d->options.incremental_resize);
+}
+static int dmap_try_grow(DmapHdr **dp, size_t elem_size) {
+#ifdef DMAP_STATS
+    u64 start = dmap_now_ns();
+    int err = dmap_try_make_room(dp, elem_size);
+    if(!err){
+        (*dp)->stats.grows++;
+        (*dp)->stats.grow_ns += dmap_now_ns() - start;
+    }
+    return err;
+#else
+    return dmap_try_make_room(dp, elem_size);
+#endif
+}
+static void *dmap__grow_internal(DmapHdr *d, size_t elem_size) {
+    int err = dmap_try_grow(&d, elem_size);
+    if(err){
+        dmap_fail(err);
+    }
+    return d->data;
+}
+
+// creates a map in *out; on an error *out is left as it was and nothing is allocated
+static int dmap_try_init_internal(size_t elem_size, bool is_string, DmapOptions options, DmapHdr **out){
+    DmapHdr *new_hdr = NULL;
+
+    if(options.use_ctrl_bytes){
+        options.robin_hood = false; // ctrl bytes have their own probing scheme
+    }
+    if(options.use_ctrl_bytes || options.robin_hood){
+        options.incremental_resize = false; // only implemented for linear probing
+    }
+    if(options.incremental_resize){
+        options.bloom_bits_per_key = 0; // rebuilding the filter on a grow would undo the point of spreading it out
+    }
+    if(options.load_factor <= 0.0f){
+        options.load_factor = options.use_ctrl_bytes ? DMAP_CTRL_LOAD_FACTOR 
+                            : options.robin_hood ? DMAP_ROBIN_HOOD_LOAD_FACTOR 
+                            : DMAP_LOAD_FACTOR;
+    }
+    else if(options.load_factor > DMAP_MAX_LOAD_FACTOR){
+        options.load_factor = DMAP_MAX_LOAD_FACTOR; // linear probing needs empty slots to terminate
+    }
+    if(options.cache_max_bytes > 0 && elem_size > 0){
+        size_t entries = MAX(options.cache_max_bytes / elem_size, (size_t)1);
+        if(options.cache_max_entries <= 0 || entries < (size_t)options.cache_max_entries){
+            options.cache_max_entries = (int)MIN(entries, (size_t)DMAP_MAX_CAPACITY);
+        }
+    }
+    s32 capacity = options.initial_capacity;
+    if(options.cache_max_entries > 0){
+        options.incremental_resize = false; // the table is never resized
+        capacity = options.cache_max_entries + options.cache_max_entries / 4 + 1; // table room for a quarter in tombstones
+    }
+    size_t table_capacity = next_power_of_2(capacity);
+    if(options.use_ctrl_bytes && table_capacity < DMAP_GROUP_WIDTH){
+        table_capacity = DMAP_GROUP_WIDTH; // at least one full group
+    }
+    while ((size_t)((float)table_capacity * options.load_factor) < (size_t)capacity) {
+        if (table_capacity >= DMAP_MAX_HASH_CAP) {
+            return DMAP_ERR_CAPACITY;
+        }
+        table_capacity *= 2;
+    }
+    if(table_capacity > DMAP_MAX_HASH_CAP){
+        return DMAP_ERR_CAPACITY;
+    }
+    capacity = options.cache_max_entries > 0 ? options.cache_max_entries : (s32)((float)table_capacity * options.load_factor);
+    int err = dmap_check_limits(&options, table_capacity, (size_t)capacity, elem_size);
+    if(err){
+        return err;
+    }
+    size_t size_in_bytes = offsetof(DmapHdr, data) + ((size_t)capacity * elem_size);
+    if(!options.allocator.alloc_fn){
+        options.allocator = dmap_default_allocator;
+    }
+    options.table_alignment = next_power_of_2(options.table_alignment);
+    new_hdr = dmap_hdr_realloc(NULL, &options, 0, size_in_bytes);
+    if(!new_hdr){
+        return DMAP_ERR_NOMEM;
+    }
+    if(options.free_key_fn){
+        options.user_managed_keys = true;
+    }
+    if(options.user_managed_keys){
+        options.use_key_arena = false; // dmap doesn't allocate keys
+    }
+    options.hash_engine = dmap_resolve_hash_engine(options.hash_engine);
+    new_hdr->options = options;
+    new_hdr->len = 0;
+    new_hdr->cap = (u32)capacity;
+    new_hdr->hash_cap = (u32)table_capacity;
+    new_hdr->returned_idx = DMAP_EMPTY;
+    new_hdr->table = NULL;
+    new_hdr->ctrl = NULL;
+    new_hdr->old_table = NULL;
+    new_hdr->old_hash_cap = 0;
+    new_hdr->migrate_pos = 0;
+    new_hdr->next_table = NULL;
+    new_hdr->next_hash_cap = 0;
+    new_hdr->next_ready = 0;
+    new_hdr->free_list = NULL;
+    new_hdr->tombstones = 0;
+    new_hdr->key_arena = NULL;
+    new_hdr->bloom = NULL;
+    new_hdr->snapshot = NULL;
+    new_hdr->snapshot_size = 0;
+    new_hdr->key_base = 0;
+    new_hdr->occupied = NULL;
+    new_hdr->idx_hash = NULL;
+    new_hdr->referenced = NULL;
+    new_hdr->clock_hand = 0;
+    new_hdr->evicted_idx = DMAP_INVALID;
+#ifdef DMAP_STATS
+    memset(&new_hdr->stats, 0, sizeof(new_hdr->stats));
+    new_hdr->stats_probes = 0;
+    new_hdr->stats_off = false;
+#endif
+    new_hdr->key_size = 0;
+    new_hdr->int_fast = false;
+    new_hdr->returned_new = false;
+    if(is_string && !options.user_managed_keys){
+        new_hdr->slot_kind = DMAP_SLOT_KSTR;
+        new_hdr->slot_size = sizeof(DmapKstrSlot);
+    }
+    else {
+        new_hdr->slot_kind = DMAP_SLOT_WIDE; // may switch to a compact layout once the key type is known
+        new_hdr->slot_size = sizeof(DmapTable);
+    }
+    new_hdr->val_size = (u32)elem_size;
+    new_hdr->hash_seed = options.hash_seed ? options.hash_seed : dmap_generate_seed();
+    new_hdr->is_string = is_string;
+
+    // the header is complete, so dmap__free can release whatever was allocated before running out of memory
+    DmapIndexArrays arrays;
+    void *table = NULL;
+    bool ok = dmap_index_arrays_alloc(new_hdr, (size_t)capacity, &arrays);
+    if(ok){
+        dmap_index_arrays_install(new_hdr, &arrays);
+    }
+    if(ok && options.use_key_arena){
+        new_hdr->key_arena = (DmapKeyArena*)dmap_mem_alloc(&options.allocator, sizeof(DmapKeyArena), DMAP_ALIGNMENT);
+        ok = new_hdr->key_arena != NULL;
+        if(ok){
+            memset(new_hdr->key_arena, 0, sizeof(DmapKeyArena));
+        }
+    }
+    if(ok){
+        table = dmap_table_for(new_hdr, table_capacity);
+        ok = table != NULL;
+    }
+    if(!ok){
+        dmap__free(new_hdr);
+        return DMAP_ERR_NOMEM;
+    }
+    dmap_grow_table(new_hdr, table, table_capacity, 0);
+    dmap_bloom_rebuild(new_hdr);
+    dmap_assert(((uintptr_t)&new_hdr->data & (DMAP_ALIGNMENT - 1)) == 0); // ensure alignment
+    *out = new_hdr;
+    return DMAP_OK;
+}
+static void *dmap__init_internal(size_t elem_size, bool is_string, DmapOptions options){
+    DmapHdr *d = NULL;
+    int err = dmap_try_init_internal(elem_size, is_string, options, &d);
+    if(err){
+        dmap_fail(err);
+        return NULL;
+    }
+    return d->data;
+}
+void *dmap__init(size_t elem_size, DmapOptions options){
     return dmap__init_internal(elem_size, false, options);
 }
-void *dmap__kstr_init(size_t elem_size, DmapOptions options){
-    return dmap__init_internal(elem_size, true, options);
+void *dmap__kstr_init(size_t elem_size, DmapOptions options){
+    return dmap__init_internal(elem_size, true, options);
+}
+static inline DmapOptions dmap_default_options(void) {
+    return (DmapOptions){
+        .data_allocator_fn = NULL,
+        .free_key_fn = NULL,
+        .initial_capacity = DMAP_INITIAL_CAPACITY,
+        .user_managed_keys = false,
+    };
+}
+// grows the hashmap to a new capacity
+void *dmap__grow(DmapHdr *d, size_t elem_size) {
+    if (!d) {
+        // when this is the case we just want the defaults
+        return dmap__init(elem_size, dmap_default_options());
+    }
+    return dmap__grow_internal(d, elem_size);
+}
+void *dmap__kstr_grow(DmapHdr *d, size_t elem_size) {
+    if (!d) {
+        // when this is the case we just want the defaults
+        return dmap__kstr_init(elem_size, dmap_default_options());
+    }
+    return dmap__grow_internal(d, elem_size);
+}
+static int dmap_try_reserve_internal(DmapHdr **dp, size_t elem_size, size_t n, bool is_string) {
+    DmapHdr *d = *dp;
+    if(n > DMAP_MAX_CAPACITY){
+        return DMAP_ERR_CAPACITY;
+    }
+    if(!d){
+        DmapOptions options = dmap_default_options();
+        options.initial_capacity = (int)n;
+        return dmap_try_init_internal(elem_size, is_string, options, dp);
+    }
+    if(d->snapshot){
+        return DMAP_ERR_READONLY;
+    }
+    if(n <= (size_t)d->cap || d->options.cache_max_entries > 0){
+        return DMAP_OK; // never shrinks, and caches keep their size
+    }
+    return dmap_try_resize(dp, elem_size, dmap_hash_cap_for(d, n), false);
+}
+static void *dmap_reserve_internal(DmapHdr *d, size_t elem_size, size_t n, bool is_string) {
+    int err = dmap_try_reserve_internal(&d, elem_size, n, is_string);
+    if(err){
+        dmap_fail(err);
+    }
+    return d ? d->data : NULL;
+}
+void *dmap__reserve(DmapHdr *d, size_t elem_size, size_t n){
+    return dmap_reserve_internal(d, elem_size, n, false);
+}
+void *dmap__kstr_reserve(DmapHdr *d, size_t elem_size, size_t n){
+    return dmap_reserve_internal(d, elem_size, n, true);
+}
+// the try functions hand the map back through a pointer to the caller's variable, whatever its value type
+static void dmap_store_map(void *map, DmapHdr *d) {
+    void *data = d->data;
+    memcpy(map, &data, sizeof(data));
+}
+int dmap__try_init(size_t elem_size, bool is_string, DmapOptions options, void *map){
+    DmapHdr *d = NULL;
+    int err = dmap_try_init_internal(elem_size, is_string, options, &d);
+    if(!err){
+        dmap_store_map(map, d);
+    }
+    return err;
+}
+int dmap__try_reserve(DmapHdr *d, size_t elem_size, size_t n, bool is_string, void *map){
+    int err = dmap_try_reserve_internal(&d, elem_size, n, is_string);
+    if(!err){
+        dmap_store_map(map, d);
+    }
+    return err;
+}
+// Moves every value stored at or past index len into a free slot below len, so data[0, len) holds all of the 
+// values and the free list can go. Then the data array and the table are reallocated to the smallest size
+// that holds len entries at the map's load factor.
+void *dmap__shrink_to_fit(DmapHdr *d){
+    dmap_check_writable(d);
+    dmap_finish_migration(d);
+    if(d->options.cache_max_entries > 0){
+        dmap__compact(d); // caches keep their size
+        return d->data;
+    }
+    size_t len = (size_t)d->len;
+    size_t new_hash_cap = d->options.use_ctrl_bytes ? DMAP_GROUP_WIDTH : 1;
+    while((size_t)((float)new_hash_cap * d->options.load_factor) < MAX(len, (size_t)1)){
+        new_hash_cap *= 2;
+    }
+    if(d->free_list){
+        // every unused index below len + free_list->len is on the free list, so the holes below len are exactly
+        // as many as the values stored past it
+        DmapFreeList *fl = d->free_list;
+        int hole = 0;
+        for(size_t i = 0; i < (size_t)d->hash_cap; i++){
+            DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+            if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED || (size_t)slot->data_idx < len) continue;
+            while(fl->data[hole] >= (s32)len){
+                hole++;
+            }
+            memcpy(d->data + (size_t)fl->data[hole] * d->val_size, d->data + (size_t)slot->data_idx * d->val_size, d->val_size);
+            dmap_occupied_clear(d, (size_t)slot->data_idx);
+            dmap_occupied_set(d, (size_t)fl->data[hole]);
+            d->idx_hash[fl->data[hole]] = d->idx_hash[slot->data_idx];
+            slot->data_idx = fl->data[hole++];
+        }
+        const DmapAllocator *a = &d->options.allocator;
+        dmap_mem_free(a, fl->data, fl->cap * sizeof(s32));
+        dmap_mem_free(a, fl, sizeof(DmapFreeList));
+        d->free_list = NULL;
+    }
+    if(new_hash_cap >= (size_t)d->hash_cap){
+        dmap__compact(d); // already as small as it gets, but the tombstones can still go
+        return d->data;
+    }
+    d = dmap_resize(d, d->val_size, new_hash_cap, false);
+    if(d->key_arena && d->key_arena->dead_bytes){
+        dmap_arena_compact(d);
+    }
+    return d->data;
+}
+// releases the keys owned by the live slots of table
+static void dmap_free_table_keys(DmapHdr *d, void *table_mem, size_t hash_cap) {
+    if(d->key_arena){
+        return; // keys live in the arena chunks, no need to walk the table
+    }
+    if(d->slot_kind == DMAP_SLOT_KSTR){
+        for(size_t i = 0; i < hash_cap; i++){
+            DmapKstrSlot *entry = (DmapKstrSlot*)DMAP_SLOT(d, table_mem, i);
+            if(entry->data_idx != DMAP_EMPTY && entry->data_idx != DMAP_DELETED && entry->kstr_len > DMAP_INLINE_KSTR){
+                dmap_release_key(d, dmap_kstr_slot_ptr(entry), entry->kstr_len);
+            }
+        }
+    }
+    else if(d->slot_kind == DMAP_SLOT_WIDE){ // compact int slots never own heap keys
+        DmapTable *table = (DmapTable*)table_mem;
+        if(d->options.user_managed_keys && d->options.free_key_fn){ // user manages keys & provided a free function
+            for(size_t i = 0; i < hash_cap; i++){
+                if(table[i].ptr != NULL){
+                    d->options.free_key_fn(table[i].ptr);
+                }
+            }
+        }
+        else if(!d->options.user_managed_keys){
+            if(d->is_string){
+                for(size_t i = 0; i < hash_cap; i++){
+                    if(table[i].kstr_len > 8 && table[i].kstr != NULL){
+                        dmap_release_key(d, table[i].kstr, table[i].kstr_len);
+                    }
+                }
+            }
+            else {
+                for(size_t i = 0; i < hash_cap; i++){
+                    if(d->key_size > 8 && table[i].ptr != NULL){
+                        dmap_release_key(d, table[i].ptr, d->key_size);
+                    }
+                }
+            }
+        }
+    }
+}
+static void dmap_snapshot_close(DmapHdr *d);
+void dmap__free(DmapHdr *d){
+    if(d && d->snapshot){
+        dmap_snapshot_close(d);
+        return;
+    }
+    if(d){
+        if(d->table) {
+            dmap_free_table_keys(d, d->table, d->hash_cap);
+            dmap_table_free(d, d->table, dmap_table_bytes(d, d->hash_cap));
+        }
+        if(d->old_table) { // resize in progress
+            dmap_free_table_keys(d, d->old_table, d->old_hash_cap);
+            dmap_table_free(d, d->old_table, dmap_table_bytes(d, d->old_hash_cap));
+        }
+        dmap_table_free(d, d->next_table, dmap_table_bytes(d, d->next_hash_cap));
+        const DmapAllocator *a = &d->options.allocator;
+        if(d->key_arena){
+            dmap_arena_free_chunks(a, d->key_arena->chunks);
+            dmap_mem_free(a, d->key_arena, sizeof(DmapKeyArena));
+        }
+        dmap_bloom_free(d);
+        if(d->free_list){
+            if(d->free_list->data) {
+                dmap_mem_free(a, d->free_list->data, d->free_list->cap * sizeof(s32));
+            }
+            dmap_mem_free(a, d->free_list, sizeof(DmapFreeList));
+        }
+        dmap_mem_free(a, d->occupied, dmap_occupied_bytes((size_t)d->cap));
+        dmap_mem_free(a, d->idx_hash, MAX((size_t)d->cap, (size_t)1) * sizeof(u32));
+        dmap_mem_free(a, d->referenced, dmap_occupied_bytes((size_t)d->cap));
+        DmapOptions options = d->options; // the header is freed along with the data
+        dmap_hdr_realloc(d, &options, offsetof(DmapHdr, data) + ((size_t)d->cap * d->val_size), 0);
+    }
+}
+// probes the ctrl bytes group by group; returns the table index of key or DMAP_INVALID
+static s32 dmap_ctrl_find(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+    size_t group = dmap_group_start(hash, d->hash_cap);
+    size_t num_groups = d->hash_cap / DMAP_GROUP_WIDTH;
+    u8 h2 = DMAP_CTRL_H2(hash);
+    for(size_t probe = 1; probe <= num_groups; probe++){
+        const u8 *ctrl = d->ctrl + group;
+        u32 match = dmap_group_match(ctrl, h2);
+        DMAP_STAT_PROBE(d);
+        while(match){
+            size_t idx = group + dmap_ctz32(match);
+            DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+            if(slot->hash == (u32)hash && keys_match(d, slot, key, key_size)){
+                return (s32)idx;
+            }
+            match &= match - 1;
+        }
+        if(dmap_group_match(ctrl, DMAP_CTRL_EMPTY)){ // an empty slot ends the probe sequence
+            break;
+        }
+        group = dmap_group_next(group, probe, d->hash_cap);
+    }
+    return DMAP_INVALID;
+}
+// returns the table index of key, whose hash has already been computed, or DMAP_INVALID
+static s32 dmap_find_slot(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+    if(d->ctrl){
+        return dmap_ctrl_find(d, hash, key, key_size);
+    }
+    if(d->options.robin_hood){
+        return dmap_rh_find(d, hash, key, key_size);
+    }
+    s32 idx = hash & (d->hash_cap - 1);
+    // size_t j = d->hash_cap; // counter to ensure the loop doesn't iterate more than the capacity of the hashmap
+    while(true) { // loop to search for the key in the hashmap
+        // dmap_assert(j-- != 0); // unreachable -- suggests table is full
+        DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+        DMAP_STAT_PROBE(d);
+        if(slot->data_idx == DMAP_EMPTY){ // if the entry is empty, the key is not in the hashmap
+            break;
+        }
+        if(slot->data_idx != DMAP_DELETED && slot->hash == (u32)hash) {
+            if(keys_match(d, slot, key, key_size)){
+                return idx;
+            }
+        }
+        idx = (idx + 1) & (d->hash_cap - 1); // move to the next index, wrapping around to the start if necessary
+    }
+    return DMAP_INVALID;
+}
+// the slot holding key, which may be in the old table while a resize is in progress; NULL if not found
+static DmapSlot *dmap_find(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+#ifdef DMAP_STATS
+    if(!d->stats_off) d->stats_probes = 0;
+#endif
+    if(d->bloom && !dmap_bloom_maybe(d->bloom, (u32)hash)){
+        DMAP_STAT_ADD(d, filtered, !d->stats_off);
+        dmap_stats_lookup(d, false);
+        return NULL;
+    }
+    s32 idx = dmap_find_slot(d, hash, key, key_size);
+    DmapSlot *slot = idx != DMAP_INVALID ? DMAP_SLOT(d, d->table, idx) : d->old_table ? dmap_old_find(d, hash, key, key_size) : NULL;
+    dmap_stats_lookup(d, slot != NULL);
+    return slot;
+}
+static DmapSlot *dmap_lookup(DmapHdr *d, void *key, size_t key_size) {
+    if(d->cap == 0) {
+        return NULL;
+    }
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    u64 hash = dmap_key_hash(d, key, key_size); // generate a hash value for the given key
+    return dmap_find(d, hash, key, key_size);
+}
+// fetches the cache lines the probe for hash starts on
+static inline void dmap_prefetch_home(DmapHdr *d, u64 hash) {
+    if(d->bloom){
+        dmap_prefetch(dmap_bloom_block(d->bloom, (u32)hash));
+    }
+    if(d->ctrl){
+        size_t group = dmap_group_start(hash, d->hash_cap);
+        dmap_prefetch(d->ctrl + group);
+        dmap_prefetch(DMAP_SLOT(d, d->table, group));
+        return;
+    }
+    dmap_prefetch(DMAP_SLOT(d, d->table, hash & (d->hash_cap - 1)));
+}
+// Batched lookup. Keys are taken DMAP_BATCH at a time: all of them are hashed and their home slots prefetched 
+// before the first one is probed, so on tables much larger than cache the misses overlap instead of running 
+// back to back. Either keys is a packed array of n keys of key_size bytes, or key_ptrs/key_sizes hold n string keys.
+#define DMAP_BATCH 16
+static int dmap_get_many_internal(DmapHdr *d, const char *keys, size_t key_size, void *const *key_ptrs, const size_t *key_sizes, size_t n, int *out) {
+    if(!d || d->cap == 0 || d->len == 0){
+        for(size_t i = 0; i < n; i++){
+            out[i] = DMAP_INVALID;
+        }
+        return 0;
+    }
+    if(keys && d->key_size != (s32)key_size && d->key_size != -1){
+        dmap_error_handler("Error: key is not the correct size");
+    }
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    int found = 0;
+    // with an executor, large batches are hashed up front across its tasks; inserting stays on this thread
+    u64 *all_hashes = NULL;
+    int tasks = dmap_parallel_tasks(d, n);
+    if(tasks > 1){
+        all_hashes = (u64*)dmap_mem_alloc(&d->options.allocator, n * sizeof(u64), DMAP_ALIGNMENT);
+    }
+    if(all_hashes){
+        DmapHashJob job = {d, keys, key_size, key_ptrs, key_sizes, n, (n + (size_t)tasks - 1) / (size_t)tasks, all_hashes};
+        d->options.executor.run_fn(d->options.executor.ctx, tasks, dmap_hash_task, &job);
+    }
+    u64 hashes[DMAP_BATCH];
+    for(size_t base = 0; base < n; base += DMAP_BATCH){
+        size_t count = n - base < DMAP_BATCH ? n - base : DMAP_BATCH;
+        for(size_t i = 0; i < count; i++){
+            if(all_hashes){
+                hashes[i] = all_hashes[base + i];
+            }
+            else {
+                void *key = keys ? (void*)(keys + (base + i) * key_size) : key_ptrs[base + i];
+                hashes[i] = dmap_key_hash(d, key, keys ? key_size : key_sizes[base + i]);
+            }
+            dmap_prefetch_home(d, hashes[i]);
+        }
+        for(size_t i = 0; i < count; i++){
+            void *key = keys ? (void*)(keys + (base + i) * key_size) : key_ptrs[base + i];
+            DmapSlot *slot = dmap_find(d, hashes[i], key, keys ? key_size : key_sizes[base + i]);
+            out[base + i] = slot ? slot->data_idx : DMAP_INVALID;
+            found += slot != NULL;
+            if(slot){
+                dmap_cache_touch(d, slot->data_idx);
+            }
+        }
+    }
+    return found;
+}
+int dmap__get_many(DmapHdr *d, const void *keys, size_t key_size, size_t n, int *out){
+    return dmap_get_many_internal(d, (const char*)keys, key_size, NULL, NULL, n, out);
+}
+int dmap__kstr_get_many(DmapHdr *d, const void *keys, const size_t *key_sizes, size_t n, int *out){
+    return dmap_get_many_internal(d, NULL, 0, (void *const *)keys, key_sizes, n, out);
+}
+
+
+// checks the key size against the map's; the first insert records it and picks the table layout
+static void dmap_check_key_size(DmapHdr *d, size_t key_size) {
+    if(d->key_size == 0){  
+        if(d->is_string) 
+            d->key_size = -1; // strings
+        else 
+            d->key_size = (s32)key_size;
+        if(!d->is_string && !d->options.user_managed_keys && key_size <= 8){
+            // first insert, so the table is still empty - swap it for the compact layout. Without the memory
+            // for that, the generic layout holds these keys just as well
+            size_t wide_bytes = dmap_table_bytes(d, d->hash_cap);
+            d->slot_size = sizeof(DmapIntSlot);
+            void *table = dmap_table_alloc(d, dmap_table_bytes(d, d->hash_cap));
+            if(!table){
+                d->slot_size = sizeof(DmapTable);
+                return;
+            }
+            dmap_table_free(d, d->table, wide_bytes);
+            d->table = NULL;
+            d->slot_kind = DMAP_SLOT_INT;
+            d->int_fast = !d->options.hash_fn && !d->options.seeded_hash_fn && !d->options.cmp_fn && !d->options.use_ctrl_bytes && d->options.cache_max_entries <= 0 && d->options.bloom_bits_per_key <= 0;
+            dmap_grow_table(d, table, d->hash_cap, 0);
+        }
+    }
+    else if(d->key_size != (s32)key_size && d->key_size != -1){
+        dmap_error_handler("Error: key is not the correct size");
+    }
+}
+static void dmap_cache_evict(DmapHdr *d);
+// inserts key, or finds it if it is already there; the data index for its value is left in d->returned_idx.
+// stored, if not NULL, is a heap copy of the key made up front (see dmap__try_insert), released if it isn't needed
+static void dmap_insert_hashed(DmapHdr *d, u64 hash, void *key, size_t key_size, void *stored) {
+    d->returned_new = false;
+    if(d->len >= d->cap && d->options.cache_max_entries > 0 && dmap_find_slot(d, hash, key, key_size) == DMAP_INVALID){
+        dmap_cache_evict(d); // before any probing below reserves a slot for the key
+    }
+    if(d->old_table){
+        DmapSlot *old = dmap_old_find(d, hash, key, key_size);
+        if(old){ // not moved across yet, update it where it is
+            d->returned_idx = old->data_idx;
+            if(stored){
+                dmap_release_key(d, stored, key_size);
+            }
+            return;
+        }
+    }
+    u32 idx = hash & (d->hash_cap - 1);
+    if(d->ctrl){
+        s32 found = dmap_ctrl_find(d, hash, key, key_size);
+        if(found != DMAP_INVALID){ // modify existing entry
+            idx = (u32)found;
+        }
+        else {
+            idx = (u32)dmap_ctrl_find_free(d->ctrl, hash, d->hash_cap);
+            if(d->ctrl[idx] == DMAP_CTRL_DELETED){
+                d->tombstones -= 1;
+            }
+            d->ctrl[idx] = DMAP_CTRL_H2(hash);
+        }
+    }
+    else if(d->options.robin_hood){
+        s32 found = dmap_rh_find(d, hash, key, key_size);
+        idx = found != DMAP_INVALID ? (u32)found : (u32)dmap_rh_make_room(d, hash);
+    }
+    else {
+        u32 first_deleted = DMAP_EMPTY;
+        // size_t j = d->hash_cap;
+        while(true){
+            // dmap_assert(j-- != 0); // unreachable - suggests there were no empty slots
+            DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+            if(slot->data_idx == DMAP_EMPTY){ // key is not in the table; reuse the first tombstone on the way
+                if(first_deleted != DMAP_EMPTY){
+                    idx = first_deleted;
+                    d->tombstones -= 1;
+                }
+                break;
+            }
+            if(slot->data_idx == DMAP_DELETED){ // the key may still be further along the chain
+                if(first_deleted == DMAP_EMPTY){
+                    first_deleted = idx;
+                }
+            }
+            else if(slot->hash == (u32)hash){ 
+                if(keys_match(d, slot, key, key_size)){ // modify existing entry
+                    break;
+                }
+            }
+            idx = (idx + 1) & (d->hash_cap - 1);
+        }
+    }
+    DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+    if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED){
+        d->returned_idx = slot->data_idx;
+        dmap_cache_touch(d, d->returned_idx);
+        if(stored){
+            dmap_release_key(d, stored, key_size);
+        }
+    }
+    else {
+
+        d->returned_idx = d->free_list && d->free_list->len > 0 ? dmap_freelist_pop(d) : d->len;
+        d->returned_new = true;
+        d->len += 1;
+        dmap_occupied_set(d, (size_t)d->returned_idx);
+        d->idx_hash[d->returned_idx] = (u32)hash;
+        if(d->bloom){
+            dmap_bloom_add(d->bloom, (u32)hash);
+        }
+        if(d->referenced){
+            // new entries have to be used once to survive the next pass of the clock hand. In dense mode they
+            // always go at the end, where the hand may be about to arrive, so they get one pass for free
+            u64 bit = 1ull << ((size_t)d->returned_idx & 63);
+            d->referenced[(size_t)d->returned_idx >> 6] = d->options.dense ? d->referenced[(size_t)d->returned_idx >> 6] | bit
+                                                                           : d->referenced[(size_t)d->returned_idx >> 6] & ~bit;
+        }
+
+        slot->hash = (u32)hash;
+        slot->data_idx = d->returned_idx;
+        if(d->slot_kind == DMAP_SLOT_INT){
+            DmapIntSlot *entry = (DmapIntSlot*)slot;
+            entry->key = 0;  // zero-out first
+            memcpy(&entry->key, key, key_size);
+            return;
+        }
+        if(d->slot_kind == DMAP_SLOT_KSTR){
+            DmapKstrSlot *entry = (DmapKstrSlot*)slot;
+            entry->kstr_len = (s32)key_size;
+            if(key_size <= DMAP_INLINE_KSTR){ // short keys need no allocation
+                memcpy(entry->kbytes, key, key_size);
+                return;
+            }
+            memcpy(entry->kbytes, key, DMAP_KSTR_PREFIX);
+            char *kstr = stored ? (char*)stored : (char*)dmap_copy_key(d, key, key_size);
+            if(!kstr){
+                dmap_error_handler("Error: dmap_strdup - malloc failed");
+            }
+            dmap_kstr_slot_set_ptr(entry, kstr);
+            return;
+        }
+        DmapTable *entry = (DmapTable*)slot;
+        if(d->is_string) { 
+            entry->kstr_len = (s32)key_size;
+            if(d->options.user_managed_keys) { // user managed/allocated keys
+                entry->kstr = key;
+            }
+            else if(key_size <= 8) { // otherwise dmap copies string keys
+                memcpy(entry->small_kstr, key, key_size);
+            }
+            else {
+                entry->kstr = stored ? (char*)stored : (char*)dmap_copy_key(d, key, key_size);
+                if(!entry->kstr){
+                    dmap_error_handler("Error: dmap_strdup - malloc failed");
+                }
+            }
+        }
+        else {
+            dmap_assert(d->key_size == (s32)key_size);
+            entry->kstr_len = (s32)key_size;
+            if(d->options.user_managed_keys) { // user managed/allocated keys
+                entry->ptr = key;
+            }
+            else if(key_size <= 8){ // copy small keys directly to table
+                entry->key = 0;  // zero-out first
+                memcpy(&entry->key, key, key_size);
+            }
+            else {
+                entry->ptr = stored ? stored : dmap_copy_key(d, key, key_size); // allocate copies > 8 bytes
+                if(!entry->ptr){
+                    dmap_error_handler("Error: dmap_dup_struct - malloc failed");
+                }
+            }
+        }
+    }
+    return;
+}
+
+
+void dmap__insert_entry(DmapHdr *d, void *key, size_t key_size){ 
+    dmap__insert_entry_hashed(d, dmap_key_hash(d, key, key_size), key, key_size);
+}
+void dmap__insert_entry_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size){
+    dmap_check_writable(d);
+    d->evicted_idx = DMAP_INVALID;
+    dmap_check_key_size(d, key_size);
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(hash == dmap_key_hash(d, key, key_size)); // hashed for another map, or with another seed
+#endif
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    dmap_insert_hashed(d, hash, key, key_size, NULL);
+}
+// whether dmap_insert_hashed makes a heap copy of a new key of key_size
+static inline bool dmap_key_copied(DmapHdr *d, size_t key_size) {
+    if(d->slot_kind == DMAP_SLOT_KSTR){
+        return key_size > DMAP_INLINE_KSTR;
+    }
+    return d->slot_kind == DMAP_SLOT_WIDE && !d->options.user_managed_keys && key_size > 8;
+}
+// dmap_try_insert: any room the map needs and the copy of a new key are allocated before the key goes in, so an
+// error leaves the entries as they were. A grow that succeeded before the copy failed isn't undone; it doesn't
+// move any index. Returns DMAP_OK with the data index in returned_idx, or the error, also left there
+int dmap__try_insert(DmapHdr *d, void *key, size_t key_size, size_t elem_size, bool is_string, void *map){
+    if(!d){
+        int err = dmap_try_init_internal(elem_size, is_string, dmap_default_options(), &d);
+        if(err){
+            return err;
+        }
+        dmap_store_map(map, d);
+    }
+    if(d->snapshot){
+        d->returned_idx = DMAP_ERR_READONLY; // the header page is the process's own copy
+        return DMAP_ERR_READONLY;
+    }
+    d->evicted_idx = DMAP_INVALID;
+    dmap_check_key_size(d, key_size);
+    if((size_t)d->len + 1 + (size_t)d->tombstones > (size_t)d->cap){
+        int err = dmap_try_grow(&d, elem_size);
+        if(err){
+            d->returned_idx = err;
+            return err;
+        }
+        dmap_store_map(map, d);
+    }
+    if(d->options.cache_max_entries > 0 && !dmap_freelist_reserve(d)){ // evicting from a full cache frees an index first
+        d->returned_idx = DMAP_ERR_NOMEM;
+        return DMAP_ERR_NOMEM;
+    }
+    u64 hash = dmap_key_hash(d, key, key_size);
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    void *stored = NULL; // copied after the grow, which may repack the key arena, and only for a new key
+    if(dmap_key_copied(d, key_size) && dmap_find_slot(d, hash, key, key_size) == DMAP_INVALID
+       && !(d->old_table && dmap_old_find(d, hash, key, key_size))){
+        stored = dmap_copy_key(d, key, key_size);
+        if(!stored){
+            d->returned_idx = DMAP_ERR_NOMEM;
+            return DMAP_ERR_NOMEM;
+        }
+    }
+    dmap_insert_hashed(d, hash, key, key_size, stored);
+    return DMAP_OK;
+}
+// Bulk insert. The map is sized for all n keys up front, so it rehashes at most once, and keys are hashed and
+// their home slots prefetched DMAP_BATCH at a time as in dmap_get_many. Same result as n inserts in order:
+// existing keys are updated and the last of any duplicates wins. Keys are passed as for dmap_get_many_internal.
+static void *dmap_insert_many_internal(DmapHdr *d, bool is_string, const char *keys, size_t key_size, void *const *key_ptrs, const size_t *key_sizes, 
+                                       const char *vals, size_t val_size, size_t elem_size, size_t n) {
+    if(!d){
+        d = dmap_hdr(is_string ? dmap__kstr_init(elem_size, dmap_default_options()) : dmap__init(elem_size, dmap_default_options()));
+    }
+    if(n == 0){
+        return d->data;
+    }
+    if(val_size != (size_t)d->val_size){
+        dmap_error_handler("Error: value is not the correct size");
+    }
+    dmap_check_writable(d);
+    dmap_check_key_size(d, keys ? key_size : key_sizes[0]);
+    size_t needed = (size_t)d->len + n; // assumes every key is new
+    if(d->options.cache_max_entries > 0){
+        dmap__grow_internal(d, elem_size); // a cache isn't resized; once full, every new key evicts one
+    }
+    else if(needed + d->tombstones > (size_t)d->cap){
+        if(needed <= (size_t)d->cap){
+            dmap_compact_internal(d, true);
+        }
+        else {
+            d = dmap_resize(d, elem_size, dmap_hash_cap_for(d, needed), false);
+        }
+    }
+    // with an executor, large batches are hashed up front across its tasks; inserting stays on this thread
+    u64 *all_hashes = NULL;
+    int tasks = dmap_parallel_tasks(d, n);
+    if(tasks > 1){
+        all_hashes = (u64*)dmap_mem_alloc(&d->options.allocator, n * sizeof(u64), DMAP_ALIGNMENT);
+    }
+    if(all_hashes){
+        DmapHashJob job = {d, keys, key_size, key_ptrs, key_sizes, n, (n + (size_t)tasks - 1) / (size_t)tasks, all_hashes};
+        d->options.executor.run_fn(d->options.executor.ctx, tasks, dmap_hash_task, &job);
+    }
+    u64 hashes[DMAP_BATCH];
+    for(size_t base = 0; base < n; base += DMAP_BATCH){
+        size_t count = n - base < DMAP_BATCH ? n - base : DMAP_BATCH;
+        for(size_t i = 0; i < count; i++){
+            if(all_hashes){
+                hashes[i] = all_hashes[base + i];
+            }
+            else {
+                void *key = keys ? (void*)(keys + (base + i) * key_size) : key_ptrs[base + i];
+                hashes[i] = dmap_key_hash(d, key, keys ? key_size : key_sizes[base + i]);
+            }
+            dmap_prefetch_home(d, hashes[i]);
+        }
+        for(size_t i = 0; i < count; i++){
+            void *key = keys ? (void*)(keys + (base + i) * key_size) : key_ptrs[base + i];
+            size_t len = keys ? key_size : key_sizes[base + i];
+            dmap_insert_hashed(d, hashes[i], key, len, NULL);
+            memcpy(d->data + (size_t)d->returned_idx * elem_size, vals + (base + i) * elem_size, elem_size);
+        }
+    }
+    dmap_mem_free(&d->options.allocator, all_hashes, n * sizeof(u64));
+    return d->data;
+}
+void *dmap__insert_many(DmapHdr *d, const void *keys, size_t key_size, const void *vals, size_t val_size, size_t elem_size, size_t n){
+    return dmap_insert_many_internal(d, false, (const char*)keys, key_size, NULL, NULL, (const char*)vals, val_size, elem_size, n);
+}
+void *dmap__kstr_insert_many(DmapHdr *d, const void *keys, const size_t *key_sizes, const void *vals, size_t val_size, size_t elem_size, size_t n){
+    return dmap_insert_many_internal(d, true, NULL, 0, (void *const *)keys, key_sizes, (const char*)vals, val_size, elem_size, n);
+}
+void* dmap__getp(DmapHdr *d, void *key, size_t key_size){
+    if(d->key_size > 0 && d->key_size != (s32)key_size){  // -1 indicates a string key, 0 that nothing was inserted yet
+        dmap_error_handler("Error: key is not the correct size");
+    }
+    DmapSlot *slot = dmap_lookup(d, key, key_size);
+    if(!slot) { 
+        return NULL; // entry is not found
+    }
+    dmap_cache_touch(d, slot->data_idx);
+    return d->data + (size_t)slot->data_idx * (size_t)d->val_size;
+}
+// returns: int - The index of the data associated with the key, or DMAP_INVALID (-1) if the key is not found
+s32 dmap__get_idx(DmapHdr *d, void *key, size_t key_size){
+    DmapSlot *slot = dmap_lookup(d, key, key_size);
+    if(!slot) {
+        return DMAP_INVALID;
+    }
+    dmap_cache_touch(d, slot->data_idx);
+    return slot->data_idx;
+}
+unsigned long long dmap__hash_key(DmapHdr *d, void *key, size_t key_size){
+    return dmap_key_hash(d, key, key_size);
+}
+s32 dmap__get_idx_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size){
+    if(d->cap == 0){
+        return DMAP_INVALID;
+    }
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(hash == dmap_key_hash(d, key, key_size)); // hashed for another map, or with another seed
+#endif
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    DmapSlot *slot = dmap_find(d, hash, key, key_size);
+    if(!slot) {
+        return DMAP_INVALID;
+    }
+    dmap_cache_touch(d, slot->data_idx);
+    return slot->data_idx;
+}
+// single probe upsert: the value of a new key is zeroed. Returns true if the key was already there
+bool dmap__get_or_insert(DmapHdr *d, void *key, size_t key_size, int *idx){
+    dmap__insert_entry_hashed(d, dmap_key_hash(d, key, key_size), key, key_size);
+    if(d->returned_new){
+        memset(d->data + (size_t)d->returned_idx * d->val_size, 0, d->val_size);
+    }
+    if(idx){
+        *idx = d->returned_idx;
+    }
+    return !d->returned_new;
+}
+
+// /////////////////////////////////////////////
+// MARK: REVERSE INDEX
+// /////////////////////////////////////////////
+// d->idx_hash keeps the low hash bits of the entry at every data index. That is enough to get from a data index
+// back to its table slot, and so its key: probe from the home slot for that data index, comparing no keys. A hash
+// never changes, so unlike slot positions the array needs no updates when rehashing or robin hood shifts move
+// slots around; only inserts, deletes and moved values touch it.
+
+// the table slot (in table or old_table) currently pointing at data index idx, found from its stored hash
+static DmapSlot *dmap_slot_of_index(DmapHdr *d, s32 idx) {
+    u32 hash = d->idx_hash[idx];
+    if(d->ctrl){
+        size_t group = dmap_group_start(hash, d->hash_cap);
+        size_t num_groups = d->hash_cap / DMAP_GROUP_WIDTH;
+        for(size_t probe = 1; probe <= num_groups; probe++){
+            for(size_t i = 0; i < DMAP_GROUP_WIDTH; i++){
+                DmapSlot *slot = DMAP_SLOT(d, d->table, group + i);
+                if(slot->data_idx == idx){
+                    return slot;
+                }
+            }
+            if(dmap_group_match(d->ctrl + group, DMAP_CTRL_EMPTY)){
+                break;
+            }
+            group = dmap_group_next(group, probe, d->hash_cap);
+        }
+        return NULL;
+    }
+    size_t mask = d->hash_cap - 1;
+    for(size_t i = hash & mask;; i = (i + 1) & mask){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx == idx){
+            return slot;
+        }
+        if(slot->data_idx == DMAP_EMPTY){
+            break;
+        }
+    }
+    if(d->old_table){ // not moved by the incremental resize yet
+        mask = d->old_hash_cap - 1;
+        for(size_t i = hash & mask;; i = (i + 1) & mask){
+            DmapSlot *slot = DMAP_SLOT(d, d->old_table, i);
+            if(slot->data_idx == idx){
+                return slot;
+            }
+            if(slot->data_idx == DMAP_EMPTY){
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+const void *dmap__key_at(DmapHdr *d, int idx, size_t *key_size){
+    if(!d || idx < 0 || idx >= dmap__range(d) || !((d->occupied[(size_t)idx >> 6] >> ((size_t)idx & 63)) & 1)){
+        return NULL;
+    }
+    DmapSlot *slot = dmap_slot_of_index(d, idx);
+    size_t size = 0;
+    const void *key = slot ? dmap_slot_key(d, slot, &size) : NULL;
+    if(key_size){
+        *key_size = size;
+    }
+    return key;
+}
+
+// /////////////////////////////////////////////
+// MARK: DENSE
+// /////////////////////////////////////////////
+// Optional (DmapOptions.dense). A delete moves the last value into the freed index, so data[0, len) always holds
+// exactly the live values and there is no free list. The table slot of the moved value is found through the
+// reverse index and repointed.
+
+// fills the index freed by a delete (d->len already decremented) with the last value
+static void dmap_dense_fill(DmapHdr *d, s32 hole) {
+    s32 last = d->len;
+    dmap_occupied_clear(d, (size_t)last);
+    if(hole == last){
+        return;
+    }
+    DmapSlot *slot = dmap_slot_of_index(d, last);
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(slot != NULL);
+#endif
+    slot->data_idx = hole;
+    memcpy(d->data + (size_t)hole * d->val_size, d->data + (size_t)last * d->val_size, (size_t)d->val_size);
+    d->idx_hash[hole] = d->idx_hash[last];
+    if(d->referenced){
+        u64 bit = (d->referenced[(size_t)last >> 6] >> ((size_t)last & 63)) & 1;
+        d->referenced[(size_t)hole >> 6] = (d->referenced[(size_t)hole >> 6] & ~(1ull << ((size_t)hole & 63))) | (bit << ((size_t)hole & 63));
+    }
+}
+
+// frees up table slot idx, leaving a tombstone only if a probe chain may run through it
+static void dmap_mark_deleted(DmapHdr *d, size_t idx) {
+    if(d->options.robin_hood){
+        dmap_rh_remove(d, idx);
+        return;
+    }
+    DmapSlot *slot = DMAP_SLOT(d, d->table, idx);
+    if(d->ctrl){
+        // no probe sequence ever continued past a group that still has an empty slot
+        if(dmap_group_match(d->ctrl + (idx & ~(size_t)(DMAP_GROUP_WIDTH - 1)), DMAP_CTRL_EMPTY)){
+            d->ctrl[idx] = DMAP_CTRL_EMPTY;
+            slot->data_idx = DMAP_EMPTY;
+        }
+        else {
+            d->ctrl[idx] = DMAP_CTRL_DELETED;
+            slot->data_idx = DMAP_DELETED;
+            d->tombstones += 1;
+        }
+        return;
+    }
+    size_t mask = d->hash_cap - 1;
+    if(DMAP_SLOT(d, d->table, (idx + 1) & mask)->data_idx != DMAP_EMPTY){
+        slot->data_idx = DMAP_DELETED;
+        d->tombstones += 1;
+        return;
+    }
+    // the chain ends here, so this slot and any tombstones directly before it can simply be emptied
+    slot->data_idx = DMAP_EMPTY;
+    idx = (idx - 1) & mask;
+    while((slot = DMAP_SLOT(d, d->table, idx))->data_idx == DMAP_DELETED){
+        slot->data_idx = DMAP_EMPTY;
+        d->tombstones -= 1;
+        idx = (idx - 1) & mask;
+    }
+}
+// deletes key, whose hash has already been computed; returns the data index of the deleted entry or DMAP_INVALID
+static s32 dmap_delete_hashed(DmapHdr *d, u64 hash, void *key, size_t key_size) {
+    if(d->bloom && !dmap_bloom_maybe(d->bloom, (u32)hash)){
+        return DMAP_INVALID;
+    }
+    s32 idx = dmap_find_slot(d, hash, key, key_size);
+    DmapSlot *slot = NULL;
+    if(idx != DMAP_INVALID){
+        slot = DMAP_SLOT(d, d->table, idx);
+    }
+    else if(d->old_table){
+        slot = dmap_old_find(d, hash, key, key_size);
+    }
+    if(!slot) {
+        return DMAP_INVALID;
+    }
+    s32 data_index = slot->data_idx;
+    if(!d->options.dense){
+        dmap_freelist_push(d, data_index);
+        dmap_occupied_clear(d, (size_t)data_index);
+    }
+
+    if(d->slot_kind == DMAP_SLOT_KSTR){
+        DmapKstrSlot *entry = (DmapKstrSlot*)slot;
+        if(entry->kstr_len > DMAP_INLINE_KSTR){
+            dmap_release_key(d, dmap_kstr_slot_ptr(entry), key_size);
+        }
+        entry->kstr_len = 0;
+    }
+    else if(d->slot_kind == DMAP_SLOT_WIDE){
+        DmapTable *entry = (DmapTable*)slot;
+        if(!d->options.user_managed_keys && key_size > 8){ // dmap copies keys
+            dmap_release_key(d, entry->ptr, key_size);
+            entry->ptr = NULL;
+        }
+        else if(d->options.user_managed_keys && d->options.free_key_fn){ // user supplied free_key
+            d->options.free_key_fn(entry->ptr);
+            entry->ptr = NULL;
+        }
+        else { // user managed 
+            entry->kstr = NULL;
+        }
+    }
+    if(idx == DMAP_INVALID){
+        dmap_old_mark_deleted(d, slot);
+    }
+    else {
+        dmap_mark_deleted(d, idx); // after the key is released - robin hood shifts other entries into the slot
+    }
+    d->len -= 1; 
+    if(d->options.dense){
+        dmap_dense_fill(d, data_index);
+    }
+    dmap_bloom_deleted(d);
+    return data_index;
+}
+    // returns the data index of the deleted entry. Caller may wish to mark data as invalid
+s32 dmap__delete(DmapHdr *d, void *key, size_t key_size){
+    if(d->cap == 0) {
+        return DMAP_INVALID;
+    }
+    dmap_check_writable(d);
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    return dmap_delete_hashed(d, dmap_key_hash(d, key, key_size), key, key_size);
+}
+s32 dmap__delete_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size){
+    if(d->cap == 0) {
+        return DMAP_INVALID;
+    }
+    dmap_check_writable(d);
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(hash == dmap_key_hash(d, key, key_size)); // hashed for another map, or with another seed
+#endif
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    return dmap_delete_hashed(d, hash, key, key_size);
+}
+// /////////////////////////////////////////////
+// MARK: CACHE
+// /////////////////////////////////////////////
+// Optional (DmapOptions.cache_max_entries / cache_max_bytes). The map is allocated once for the maximum number
+// of entries and never resized. Lookups set a reference bit per data index. When an insert finds the map full,
+// a clock hand sweeps the data indices: referenced entries get their bit cleared and a second chance, and the
+// first unreferenced one is evicted, which comes close to LRU without a list to maintain on every lookup. The
+// table has room for a quarter of cap in tombstones on top of the entries, and is rebuilt in place past that.
+
+// evicts the entry under the clock hand that hasn't been used since the hand last passed it
+static void dmap_cache_evict(DmapHdr *d) {
+    size_t cap = (size_t)d->cap;
+    size_t pos = (size_t)d->clock_hand;
+    while(true){ // ends within two sweeps, since the first one clears every bit it passes
+        u64 bit = 1ull << (pos & 63);
+        if(d->occupied[pos >> 6] & bit){
+            if(!(d->referenced[pos >> 6] & bit)){
+                break;
+            }
+            d->referenced[pos >> 6] &= ~bit;
+        }
+        pos = pos + 1 == cap ? 0 : pos + 1;
+    }
+    d->clock_hand = pos + 1 == cap ? 0 : (int)pos + 1;
+    DmapSlot *slot = dmap_slot_of_index(d, (s32)pos);
+#ifdef DMAP_DEBUG // dmap_assert still evaluates its argument otherwise
+    dmap_assert(slot != NULL);
+#endif
+    size_t key_size = 0;
+    void *key = dmap_slot_key(d, slot, &key_size);
+    if(d->options.evict_fn){
+        d->options.evict_fn(d->options.evict_ctx, key, key_size, d->data + pos * d->val_size);
+    }
+    char small[32]; // keys stored in the table slot itself move when the slot is freed
+    if(key_size <= sizeof(small)){
+        memcpy(small, key, key_size);
+        key = small;
+    }
+    dmap_delete_hashed(d, dmap_key_hash(d, key, key_size), key, key_size);
+    d->evicted_idx = (int)pos;
+    if(d->tombstones > d->cap / 4){
+        dmap__compact(d);
+    }
+}
+
+// /////////////////////////////////////////////
+// MARK: STATS
+// /////////////////////////////////////////////
+// With DMAP_STATS defined, lookups count their probes through DMAP_STAT_PROBE in each probing loop and record
+// them in dmap_find; grows are timed in dmap__grow_internal, and key bytes follow dmap_copy_key/dmap_release_key.
+// Inserts and deletes probe too but aren't counted as lookups. The inline int fast path is turned off, since it
+// never calls into dmap.c on a hit.
+
+void dmap__stats(DmapHdr *d, DmapStats *out) {
+    memset(out, 0, sizeof(*out));
+    if(!d) return;
+#ifdef DMAP_STATS
+    *out = d->stats;
+#endif
+    out->len = d->len;
+    out->cap = d->cap;
+    out->hash_cap = d->hash_cap;
+    out->tombstones = d->tombstones;
+    out->free_list_len = d->free_list ? d->free_list->len : 0;
+}
+void dmap__stats_reset(DmapHdr *d) {
+#ifdef DMAP_STATS
+    u64 key_bytes = d->stats.key_bytes; // not a counter, the keys are still there
+    memset(&d->stats, 0, sizeof(d->stats));
+    d->stats.key_bytes = key_bytes;
+#else
+    (void)d;
+#endif
+}
+// how many probes past the first a lookup of the live entry in slot idx takes
+static size_t dmap_slot_probe_dist(u64 hash, size_t idx, size_t hash_cap, bool grouped) {
+    if(!grouped){
+        return (idx - ((size_t)hash & (hash_cap - 1))) & (hash_cap - 1);
+    }
+    size_t target = idx & ~(size_t)(DMAP_GROUP_WIDTH - 1);
+    size_t group = dmap_group_start(hash, hash_cap);
+    size_t probe = 0;
+    while(group != target && probe < hash_cap / DMAP_GROUP_WIDTH){
+        group = dmap_group_next(group, ++probe, hash_cap);
+    }
+    return probe;
+}
+static size_t dmap_table_histogram(DmapHdr *d, void *table, size_t hash_cap, bool grouped, size_t *hist, size_t n) {
+    size_t longest = 0;
+    for(size_t i = 0; i < hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, table, i);
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+        size_t dist = dmap_slot_probe_dist(slot->hash, i, hash_cap, grouped);
+        hist[MIN(dist, n - 1)]++;
+        longest = MAX(longest, dist);
+    }
+    return longest;
+}
+int dmap__probe_histogram(DmapHdr *d, size_t *hist, size_t n) {
+    if(n == 0) return 0;
+    memset(hist, 0, n * sizeof(size_t));
+    if(!d || !d->table) return 0;
+    size_t longest = dmap_table_histogram(d, d->table, (size_t)d->hash_cap, d->ctrl != NULL, hist, n);
+    if(d->old_table){ // entries not migrated yet are still found there, by linear probing
+        longest = MAX(longest, dmap_table_histogram(d, d->old_table, (size_t)d->old_hash_cap, false, hist, n));
+    }
+    return (int)longest;
+}
+
+// /////////////////////////////////////////////
+// MARK: CONCURRENT
+// /////////////////////////////////////////////
+// Read-mostly map shared between threads, using the left-right technique. There are two full copies of the
+// map. Readers go to whichever copy left_right points at, and only ever announce themselves on a striped
+// counter, so a lookup is wait-free. Writers are serialized by a spin lock. A write is applied to the copy no
+// reader can be on, left_right is flipped, the writer waits for the readers still on the old copy to leave,
+// and then applies the same write there. Since each copy is only changed while no reader is on it, grows and
+// frees inside a copy need no extra reclamation: waiting for the readers to drain is the grace period.
+// Both copies see the same operations in the same order, so data indices agree between them.
+#if !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#ifndef _WIN32
+    #include <sched.h>
+#endif
+
+#if defined(_MSC_VER)
+    #define DMAP_THREAD_LOCAL __declspec(thread)
+#else
+    #define DMAP_THREAD_LOCAL _Thread_local
+#endif
+
+#define DMAP_READER_STRIPES 16 // power of 2
+
+typedef struct DmapReaderStripe {
+    _Atomic int count;
+    char pad[64 - sizeof(int)]; // one cache line each, so readers on different stripes don't contend
+} DmapReaderStripe;
+
+struct DmapConcurrent {
+    DmapReaderStripe readers[2][DMAP_READER_STRIPES]; // read indicators, one set per version
+    _Atomic int version_index;
+    _Atomic int left_right; // the copy readers use
+    atomic_flag write_lock;
+    void *maps[2]; // data pointers of the two copies
+    void (*free_key_fn)(void*); // called once per key, after both copies have dropped it
+    DmapAllocator allocator;
+    size_t val_size;
+};
+
+static DMAP_THREAD_LOCAL char dmap_thread_anchor;
+static inline int dmap_reader_stripe(void) {
+    return (int)(((u64)(uintptr_t)&dmap_thread_anchor * 0x9E3779B97F4A7C15ull) >> 60) & (DMAP_READER_STRIPES - 1);
+}
+static inline void dmap_yield(void) {
+    #ifdef _WIN32
+        SwitchToThread();
+    #else
+        sched_yield();
+    #endif
+}
+static void dmap_wait_for_readers(DmapConcurrent *c, int version) {
+    for(int i = 0; i < DMAP_READER_STRIPES; i++){
+        while(atomic_load(&c->readers[version][i].count) != 0){
+            dmap_yield();
+        }
+    }
+}
+// sends new readers to the other copy and waits until no reader is left on the current one
+static void dmap_toggle_copies(DmapConcurrent *c) {
+    atomic_store(&c->left_right, !atomic_load(&c->left_right));
+    int prev = atomic_load(&c->version_index);
+    dmap_wait_for_readers(c, !prev);
+    atomic_store(&c->version_index, !prev);
+    dmap_wait_for_readers(c, prev);
+}
+static inline void dmap_write_lock(DmapConcurrent *c) {
+    while(atomic_flag_test_and_set_explicit(&c->write_lock, memory_order_acquire)){
+        dmap_yield();
+    }
+}
+static inline void dmap_write_unlock(DmapConcurrent *c) {
+    atomic_flag_clear_explicit(&c->write_lock, memory_order_release);
+}
+DmapConcurrent *dmap__concurrent_new(size_t val_size, bool is_string, DmapOptions options){
+    options.incremental_resize = false; // lookups must not write to the map
+    options.cache_max_entries = 0;
+    options.cache_max_bytes = 0;
+    const DmapAllocator *a = options.allocator.alloc_fn ? &options.allocator : &dmap_default_allocator;
+    DmapConcurrent *c = (DmapConcurrent*)dmap_mem_alloc(a, sizeof(DmapConcurrent), 64);
+    if(!c){
+        dmap_error_handler("Out of memory 5");
+    }
+    memset(c, 0, sizeof(DmapConcurrent));
+    c->allocator = *a;
+    c->val_size = val_size;
+    c->free_key_fn = options.free_key_fn;
+    if(options.free_key_fn){
+        options.user_managed_keys = true;
+        options.free_key_fn = NULL; // both copies point at the same user keys
+    }
+    atomic_flag_clear(&c->write_lock);
+    for(int i = 0; i < 2; i++){
+        c->maps[i] = dmap__init_internal(val_size, is_string, options);
+#ifdef DMAP_STATS
+        dmap_hdr(c->maps[i])->stats_off = true;
+#endif
+    }
+    return c;
+}
+void dmap_concurrent_free(DmapConcurrent *c){
+    if(!c) return;
+    if(c->free_key_fn){
+        dmap_hdr(c->maps[0])->options.free_key_fn = c->free_key_fn; // release the user's keys from one copy only
+    }
+    dmap__free(dmap_hdr(c->maps[0]));
+    dmap__free(dmap_hdr(c->maps[1]));
+    DmapAllocator a = c->allocator;
+    dmap_mem_free(&a, c, sizeof(DmapConcurrent));
+}
+static int dmap_concurrent_apply_insert(DmapConcurrent *c, int copy, void *key, size_t key_size, const void *val) {
+    DmapHdr *d = dmap_hdr(c->maps[copy]);
+    if(d->len + 1 + d->tombstones > d->cap){
+        d = dmap_hdr(dmap__grow_internal(d, c->val_size));
+        c->maps[copy] = d->data;
+    }
+    dmap__insert_entry(d, key, key_size);
+    memcpy(d->data + (size_t)d->returned_idx * c->val_size, val, c->val_size);
+    return d->returned_idx;
+}
+int dmap__concurrent_insert(DmapConcurrent *c, void *key, size_t key_size, const void *val, size_t val_size){
+    if(val_size != c->val_size){
+        dmap_error_handler("Error: value is not the correct size");
+    }
+    dmap_write_lock(c);
+    int lr = atomic_load(&c->left_right);
+    int idx = dmap_concurrent_apply_insert(c, !lr, key, key_size, val);
+    dmap_toggle_copies(c);
+    dmap_concurrent_apply_insert(c, lr, key, key_size, val);
+    dmap_write_unlock(c);
+    return idx;
+}
+int dmap__concurrent_delete(DmapConcurrent *c, void *key, size_t key_size){
+    dmap_write_lock(c);
+    int lr = atomic_load(&c->left_right);
+    void *user_key = NULL;
+    if(c->free_key_fn){
+        DmapSlot *slot = dmap_lookup(dmap_hdr(c->maps[!lr]), key, key_size);
+        user_key = slot ? ((DmapTable*)slot)->ptr : NULL;
+    }
+    int idx = dmap__delete(dmap_hdr(c->maps[!lr]), key, key_size);
+    if(idx != DMAP_INVALID){
+        dmap_toggle_copies(c);
+        dmap__delete(dmap_hdr(c->maps[lr]), key, key_size);
+        if(user_key){
+            c->free_key_fn(user_key); // no reader can reach it any more
+        }
+    }
+    dmap_write_unlock(c);
+    return idx;
+}
+bool dmap__concurrent_get(DmapConcurrent *c, void *key, size_t key_size, void *val_out){
+    int version = atomic_load(&c->version_index);
+    DmapReaderStripe *stripe = &c->readers[version][dmap_reader_stripe()];
+    atomic_fetch_add(&stripe->count, 1);
+    DmapHdr *d = dmap_hdr(c->maps[atomic_load(&c->left_right)]);
+    void *val = dmap__getp(d, key, key_size);
+    if(val && val_out){
+        memcpy(val_out, val, c->val_size);
+    }
+    atomic_fetch_sub(&stripe->count, 1);
+    return val != NULL;
+}
+int dmap_concurrent_count(DmapConcurrent *c){
+    int version = atomic_load(&c->version_index);
+    DmapReaderStripe *stripe = &c->readers[version][dmap_reader_stripe()];
+    atomic_fetch_add(&stripe->count, 1);
+    int len = dmap_hdr(c->maps[atomic_load(&c->left_right)])->len;
+    atomic_fetch_sub(&stripe->count, 1);
+    return len;
+}
+
+// /////////////////////////////////////////////
+// MARK: SHARDED
+// /////////////////////////////////////////////
+// Map split into independent shards with a lock each, for multiple writers. A key is hashed once. Bits 32 and
+// up of the hash pick the shard: slots only keep the low 32 bits and ctrl tags use the top 7, so neither loses
+// entropy inside a shard. The same hash is then handed to the shard, which shares the map's seed. Indices
+// carry the shard in their low bits, so they stay stable and unique across the whole map.
+
+typedef struct DmapShard {
+    atomic_flag lock;
+    void *map; // data pointer of the shard's dmap
+    char pad[64 - sizeof(atomic_flag) - sizeof(void*)];
+} DmapShard;
+
+struct DmapSharded {
+    DmapAllocator allocator;
+    unsigned long long (*hash_fn)(void *key, size_t len);
+    unsigned long long (*seeded_hash_fn)(const void *key, size_t len, unsigned long long seed);
+    DmapHashEngine hash_engine;
+    u64 hash_seed;
+    size_t val_size;
+    bool is_string;
+    int shard_bits;
+    int num_shards;
+    DmapShard shards[];
+};
+
+static inline void dmap_shard_lock(DmapShard *shard) {
+    while(atomic_flag_test_and_set_explicit(&shard->lock, memory_order_acquire)){
+        dmap_yield();
+    }
+}
+static inline void dmap_shard_unlock(DmapShard *shard) {
+    atomic_flag_clear_explicit(&shard->lock, memory_order_release);
+}
+static inline u64 dmap_sharded_hash(DmapSharded *s, void *key, size_t key_size) {
+    if(s->hash_fn){
+        return s->hash_fn(key, key_size);
+    }
+    if(s->seeded_hash_fn){
+        return s->seeded_hash_fn(key, key_size, s->hash_seed);
+    }
+    return dmap_generate_hash(key, key_size, s->is_string, s->hash_engine, s->hash_seed);
+}
+// both halves of the hash are folded in, so a hash_fn that only fills the low 32 bits still spreads over the shards
+static inline DmapShard *dmap_shard_for(DmapSharded *s, u64 hash) {
+    u64 h = (hash ^ (hash >> 32)) * 0x9E3779B97F4A7C15ull;
+    return &s->shards[s->shard_bits ? h >> (64 - s->shard_bits) : 0];
+}
+static inline int dmap_shard_index(DmapSharded *s, DmapShard *shard, s32 data_idx) {
+    return data_idx == DMAP_INVALID ? DMAP_INVALID : (int)(((u32)data_idx << s->shard_bits) | (u32)(shard - s->shards));
+}
+DmapSharded *dmap__sharded_new(size_t val_size, bool is_string, int num_shards, DmapOptions options){
+    num_shards = (int)next_power_of_2(num_shards > 0 ? (size_t)num_shards : 16);
+    if(num_shards > (1 << 16)){
+        dmap_error_handler("Error: too many shards");
+    }
+    const DmapAllocator *a = options.allocator.alloc_fn ? &options.allocator : &dmap_default_allocator;
+    size_t size = offsetof(DmapSharded, shards) + num_shards * sizeof(DmapShard);
+    DmapSharded *s = (DmapSharded*)dmap_mem_alloc(a, size, 64);
+    if(!s){
+        dmap_error_handler("Out of memory 6");
+    }
+    memset(s, 0, size);
+    s->allocator = *a;
+    s->hash_fn = options.hash_fn;
+    s->seeded_hash_fn = options.seeded_hash_fn;
+    s->hash_engine = options.hash_engine = dmap_resolve_hash_engine(options.hash_engine);
+    s->hash_seed = options.hash_seed ? options.hash_seed : dmap_generate_seed();
+    s->val_size = val_size;
+    s->is_string = is_string;
+    s->num_shards = num_shards;
+    while((1 << s->shard_bits) < num_shards){
+        s->shard_bits++;
+    }
+    options.initial_capacity = options.initial_capacity / num_shards;
+    options.dense = false; // would move values under the indices handed out
+    options.cache_max_entries = options.cache_max_entries > 0 ? (options.cache_max_entries + num_shards - 1) / num_shards : 0;
+    options.cache_max_bytes = (options.cache_max_bytes + num_shards - 1) / num_shards;
+    for(int i = 0; i < num_shards; i++){
+        atomic_flag_clear(&s->shards[i].lock);
+        s->shards[i].map = dmap__init_internal(val_size, is_string, options);
+        dmap_hdr(s->shards[i].map)->hash_seed = s->hash_seed;
+    }
+    return s;
+}
+void dmap_sharded_free(DmapSharded *s){
+    if(!s) return;
+    for(int i = 0; i < s->num_shards; i++){
+        dmap__free(dmap_hdr(s->shards[i].map));
+    }
+    DmapAllocator a = s->allocator;
+    dmap_mem_free(&a, s, offsetof(DmapSharded, shards) + s->num_shards * sizeof(DmapShard));
+}
+int dmap__sharded_insert(DmapSharded *s, void *key, size_t key_size, const void *val, size_t val_size){
+    if(val_size != s->val_size){
+        dmap_error_handler("Error: value is not the correct size");
+    }
+    u64 hash = dmap_sharded_hash(s, key, key_size);
+    DmapShard *shard = dmap_shard_for(s, hash);
+    dmap_shard_lock(shard);
+    DmapHdr *d = dmap_hdr(shard->map);
+    dmap_check_key_size(d, key_size);
+    // a new key without a free index to reuse takes index len + free_list len, which has to fit next to the shard bits
+    int free_len = d->free_list ? d->free_list->len : 0;
+    if(!free_len && (u32)d->len >= (1u << (31 - s->shard_bits))){
+        dmap_shard_unlock(shard);
+        dmap_error_handler("Error: Max shard capacity exceeded, use more shards.");
+        return DMAP_INVALID;
+    }
+    if(d->len + 1 + d->tombstones > d->cap){
+        d = dmap_hdr(dmap__grow_internal(d, s->val_size));
+        shard->map = d->data;
+    }
+    dmap_migrate(d, DMAP_MIGRATE_STEP);
+    dmap_insert_hashed(d, hash, key, key_size, NULL);
+    s32 data_idx = d->returned_idx;
+    memcpy(d->data + (size_t)data_idx * s->val_size, val, s->val_size);
+    dmap_shard_unlock(shard);
+    return dmap_shard_index(s, shard, data_idx);
+}
+int dmap__sharded_get(DmapSharded *s, void *key, size_t key_size, void *val_out){
+    u64 hash = dmap_sharded_hash(s, key, key_size);
+    DmapShard *shard = dmap_shard_for(s, hash);
+    dmap_shard_lock(shard);
+    DmapHdr *d = dmap_hdr(shard->map);
+    s32 data_idx = DMAP_INVALID;
+    if(d->cap != 0){
+        dmap_migrate(d, DMAP_MIGRATE_STEP);
+        DmapSlot *slot = dmap_find(d, hash, key, key_size);
+        if(slot){
+            data_idx = slot->data_idx;
+            if(val_out){
+                memcpy(val_out, d->data + (size_t)data_idx * s->val_size, s->val_size);
+            }
+        }
+    }
+    dmap_shard_unlock(shard);
+    return dmap_shard_index(s, shard, data_idx);
+}
+int dmap__sharded_delete(DmapSharded *s, void *key, size_t key_size){
+    u64 hash = dmap_sharded_hash(s, key, key_size);
+    DmapShard *shard = dmap_shard_for(s, hash);
+    dmap_shard_lock(shard);
+    DmapHdr *d = dmap_hdr(shard->map);
+    s32 data_idx = DMAP_INVALID;
+    if(d->cap != 0){
+        dmap_migrate(d, DMAP_MIGRATE_STEP);
+        data_idx = dmap_delete_hashed(d, hash, key, key_size);
+    }
+    dmap_shard_unlock(shard);
+    return dmap_shard_index(s, shard, data_idx);
+}
+bool dmap_sharded_read(DmapSharded *s, int idx, void *val_out){
+    if(idx < 0) return false;
+    DmapShard *shard = &s->shards[(u32)idx & (u32)(s->num_shards - 1)];
+    s32 data_idx = (s32)((u32)idx >> s->shard_bits);
+    dmap_shard_lock(shard);
+    DmapHdr *d = dmap_hdr(shard->map);
+    bool live = data_idx < d->len + (d->free_list ? d->free_list->len : 0) && (d->occupied[(size_t)data_idx >> 6] & (1ull << ((size_t)data_idx & 63)));
+    if(live){
+        memcpy(val_out, d->data + (size_t)data_idx * s->val_size, s->val_size);
+    }
+    dmap_shard_unlock(shard);
+    return live;
+}
+int dmap_sharded_count(DmapSharded *s){
+    int count = 0;
+    for(int i = 0; i < s->num_shards; i++){
+        dmap_shard_lock(&s->shards[i]);
+        count += dmap_hdr(s->shards[i].map)->len;
+        dmap_shard_unlock(&s->shards[i]);
+    }
+    return count;
+}
+#endif // !__STDC_NO_ATOMICS__
+
+// /////////////////////////////////////////////
+// MARK: SET
+// /////////////////////////////////////////////
+// Keys without values. A set is only a table: one ctrl byte per slot, probed in groups as in MARK: CTRL BYTES,
+// and slots holding nothing but the key. There is no data array, free list or reverse index. Fixed size keys
+// are stored as they are, key_size bytes per slot, and rehashed when the table is rebuilt. String slots keep
+// the low 32 bits of the hash, which together with the ctrl tag place the key in any table without rehashing;
+// keys of up to DMAP_SET_INLINE_KSTR bytes live in the slot. The set algebra works on the tables directly and
+// reuses those hashes when both sets hash alike.
+
+#define DMAP_SET_INLINE_KSTR 8
+#define DMAP_SET_MAX_HASH_CAP ((size_t)1 << 32) // string slots keep 32 bits of the hash
+#define DMAP_SET_NONE SIZE_MAX
+
+typedef struct DmapSetKstr {
+    u32 hash; // low 32 bits of the key's hash
+    u32 len;
+    union {
+        char *ptr; // heap or arena copy, nul terminated
+        char small[DMAP_SET_INLINE_KSTR];
+    };
+} DmapSetKstr;
+
+struct DmapSet {
+    u8 *ctrl;          // hash_cap ctrl bytes, followed by the slots in the same allocation (NULL until needed)
+    char *slots;
+    size_t len;
+    size_t cap;        // len + tombstones allowed before the table is rebuilt
+    size_t hash_cap;
+    size_t tombstones;
+    size_t min_cap;    // initial_capacity and dmap_set_reserve calls made before the table exists
+    size_t key_size;   // fixed size keys: set on the first insert
+    size_t slot_size;
+    bool is_string;
+    bool use_key_arena;
+    float load_factor;
+    DmapKeyArena key_arena;
+    DmapAllocator allocator;
+    unsigned long long (*hash_fn)(void *key, size_t len);
+    unsigned long long (*seeded_hash_fn)(const void *key, size_t len, unsigned long long seed);
+    bool (*cmp_fn)(void *a, void *b, size_t len);
+    DmapHashEngine hash_engine;
+    u64 hash_seed;
+};
+
+#define DMAP_SET_SLOT(s, i) ((s)->slots + (size_t)(i) * (s)->slot_size)
+
+static inline u64 dmap_set_hash(const DmapSet *s, const void *key, size_t key_size) {
+    if(s->hash_fn){
+        return s->hash_fn((void*)key, key_size);
+    }
+    if(s->seeded_hash_fn){
+        return s->seeded_hash_fn(key, key_size, s->hash_seed);
+    }
+    return dmap_generate_hash((void*)key, key_size, s->is_string, s->hash_engine, s->hash_seed);
+}
+static inline const void *dmap_set_slot_key(const DmapSet *s, const char *slot, size_t *key_size) {
+    if(!s->is_string){
+        *key_size = s->key_size;
+        return slot;
+    }
+    const DmapSetKstr *e = (const DmapSetKstr*)slot;
+    *key_size = e->len;
+    return e->len <= DMAP_SET_INLINE_KSTR ? e->small : e->ptr;
+}
+// hash of the key in full slot i, as far as placing it goes. For strings that is the stored low bits
+// and the tag, which give the same home group and tag as the full hash in any table up to 2^32 slots
+static inline u64 dmap_set_slot_hash(const DmapSet *s, size_t i) {
+    if(s->is_string){
+        u32 low = ((const DmapSetKstr*)DMAP_SET_SLOT(s, i))->hash;
+        return ((u64)(s->ctrl[i] ^ (low >> 25)) << 57) | low;
+    }
+    return dmap_set_hash(s, DMAP_SET_SLOT(s, i), s->key_size);
+}
+static inline bool dmap_set_keys_match(const DmapSet *s, const char *slot, u64 hash, const void *key, size_t key_size) {
+    if(s->is_string){
+        const DmapSetKstr *e = (const DmapSetKstr*)slot;
+        if(e->hash != (u32)hash || e->len != key_size){
+            return false;
+        }
+    }
+    size_t stored_size;
+    const void *stored = dmap_set_slot_key(s, slot, &stored_size);
+    return s->cmp_fn ? s->cmp_fn((void*)stored, (void*)key, key_size) : memcmp(stored, key, key_size) == 0;
+}
+// first full slot at or after i, or hash_cap; skips a group of free slots at a time
+static inline size_t dmap_set_next_full(const DmapSet *s, size_t i) {
+    while(i < s->hash_cap){
+        size_t group = i & ~(size_t)(DMAP_GROUP_WIDTH - 1);
+        u32 full = ~dmap_group_match_free(s->ctrl + group) & (0xFFFFu << (i - group)) & 0xFFFFu;
+        if(full){
+            return group + dmap_ctz32(full);
+        }
+        i = group + DMAP_GROUP_WIDTH;
+    }
+    return s->hash_cap;
+}
+// returns the slot holding key, or DMAP_SET_NONE
+static size_t dmap_set_find(const DmapSet *s, u64 hash, const void *key, size_t key_size) {
+    if(!s->ctrl){
+        return DMAP_SET_NONE;
+    }
+    size_t group = dmap_group_start(hash, s->hash_cap);
+    size_t num_groups = s->hash_cap / DMAP_GROUP_WIDTH;
+    u8 h2 = DMAP_CTRL_H2(hash);
+    for(size_t probe = 1; probe <= num_groups; probe++){
+        const u8 *ctrl = s->ctrl + group;
+        for(u32 match = dmap_group_match(ctrl, h2); match; match &= match - 1){
+            size_t i = group + dmap_ctz32(match);
+            if(dmap_set_keys_match(s, DMAP_SET_SLOT(s, i), hash, key, key_size)){
+                return i;
+            }
+        }
+        if(dmap_group_match(ctrl, DMAP_CTRL_EMPTY)){ // an empty slot ends the probe sequence
+            break;
+        }
+        group = dmap_group_next(group, probe, s->hash_cap);
+    }
+    return DMAP_SET_NONE;
+}
+static inline size_t dmap_set_table_bytes(const DmapSet *s, size_t hash_cap) {
+    return hash_cap + hash_cap * s->slot_size;
+}
+static inline size_t dmap_set_cap_for(const DmapSet *s, size_t hash_cap) {
+    return (size_t)((double)hash_cap * s->load_factor);
+}
+// smallest table, no smaller than the current one, that holds n keys at the set's load factor
+static size_t dmap_set_hash_cap_for(const DmapSet *s, size_t n) {
+    size_t hash_cap = MAX(s->hash_cap, (size_t)DMAP_GROUP_WIDTH);
+    while(dmap_set_cap_for(s, hash_cap) < n){
+        if(hash_cap >= DMAP_SET_MAX_HASH_CAP){
+            dmap_error_handler("Error: Max capacity exceeded.\n");
+        }
+        hash_cap *= 2;
+    }
+    return hash_cap;
+}
+static void dmap_set_alloc_table(DmapSet *s, size_t hash_cap) {
+    u8 *ctrl = (u8*)dmap_mem_alloc(&s->allocator, dmap_set_table_bytes(s, hash_cap), DMAP_ALIGNMENT);
+    if(!ctrl){
+        dmap_error_handler("Out of memory 8");
+    }
+    memset(ctrl, DMAP_CTRL_EMPTY, hash_cap);
+    s->ctrl = ctrl;
+    s->slots = (char*)ctrl + hash_cap; // hash_cap is a multiple of DMAP_GROUP_WIDTH, so slots stay aligned
+    s->hash_cap = hash_cap;
+    s->cap = dmap_set_cap_for(s, hash_cap);
+    s->tombstones = 0;
+}
+static void dmap_set_free_table(DmapSet *s) {
+    if(s->ctrl){
+        dmap_mem_free(&s->allocator, s->ctrl, dmap_set_table_bytes(s, s->hash_cap));
+    }
+    s->ctrl = NULL;
+    s->slots = NULL;
+    s->hash_cap = 0;
+    s->cap = 0;
+    s->tombstones = 0;
+}
+static inline bool dmap_set_key_on_heap(const DmapSet *s, const char *slot) {
+    return s->is_string && ((const DmapSetKstr*)slot)->len > DMAP_SET_INLINE_KSTR;
+}
+static char *dmap_set_copy_key(DmapSet *s, const void *key, size_t key_size) {
+    if(s->use_key_arena){
+        char *dst = (char*)dmap_arena_alloc(&s->allocator, &s->key_arena, dmap_arena_size(key_size));
+        if(dst){
+            memcpy(dst, key, key_size);
+            dst[key_size] = '\0';
+        }
+        return dst;
+    }
+    return dmap_strdup(&s->allocator, (char*)key, key_size);
+}
+static void dmap_set_release_key(DmapSet *s, char *slot) {
+    DmapSetKstr *e = (DmapSetKstr*)slot;
+    if(s->use_key_arena){
+        s->key_arena.live_bytes -= dmap_arena_size(e->len);
+        s->key_arena.dead_bytes += dmap_arena_size(e->len);
+        return;
+    }
+    dmap_mem_free(&s->allocator, e->ptr, (size_t)e->len + 1);
+}
+// frees every heap key; the slots are left as they are
+static void dmap_set_release_keys(DmapSet *s) {
+    if(s->use_key_arena){
+        dmap_arena_free_chunks(&s->allocator, s->key_arena.chunks);
+        memset(&s->key_arena, 0, sizeof(s->key_arena));
+        return;
+    }
+    if(!s->is_string) return;
+    for(size_t i = dmap_set_next_full(s, 0); i < s->hash_cap; i = dmap_set_next_full(s, i + 1)){
+        if(dmap_set_key_on_heap(s, DMAP_SET_SLOT(s, i))){
+            dmap_set_release_key(s, DMAP_SET_SLOT(s, i));
+        }
+    }
+}
+// repacks the live keys into a single chunk, as dmap_arena_compact does for maps
+static void dmap_set_arena_compact(DmapSet *s) {
+    DmapKeyArena packed = {0};
+    if(s->key_arena.live_bytes && !dmap_arena_new_chunk(&s->allocator, &packed, s->key_arena.live_bytes)){
+        return;
+    }
+    for(size_t i = dmap_set_next_full(s, 0); i < s->hash_cap; i = dmap_set_next_full(s, i + 1)){
+        DmapSetKstr *e = (DmapSetKstr*)DMAP_SET_SLOT(s, i);
+        if(e->len <= DMAP_SET_INLINE_KSTR) continue;
+        char *dst = (char*)dmap_arena_alloc(&s->allocator, &packed, dmap_arena_size(e->len)); // fits, sized from live_bytes
+        memcpy(dst, e->ptr, (size_t)e->len + 1);
+        e->ptr = dst;
+    }
+    dmap_arena_free_chunks(&s->allocator, s->key_arena.chunks);
+    s->key_arena = packed;
+}
+// moves every key into a new table of hash_cap slots, dropping the tombstones
+static void dmap_set_rebuild(DmapSet *s, size_t hash_cap) {
+    DmapSet old = *s;
+    dmap_set_alloc_table(s, hash_cap);
+    for(size_t i = dmap_set_next_full(&old, 0); i < old.hash_cap; i = dmap_set_next_full(&old, i + 1)){
+        size_t j = dmap_ctrl_find_free(s->ctrl, dmap_set_slot_hash(&old, i), hash_cap);
+        s->ctrl[j] = old.ctrl[i];
+        memcpy(DMAP_SET_SLOT(s, j), DMAP_SET_SLOT(&old, i), s->slot_size);
+    }
+    dmap_set_free_table(&old);
+    if(s->use_key_arena && s->key_arena.dead_bytes > s->key_arena.live_bytes){
+        dmap_set_arena_compact(s); // more than half of the key space is dead
+    }
+}
+// makes sure n more keys can be inserted without a rebuild; the key size must be known
+static void dmap_set_make_room(DmapSet *s, size_t n) {
+    if(!s->ctrl){
+        dmap_set_alloc_table(s, dmap_set_hash_cap_for(s, MAX(s->min_cap, n)));
+        return;
+    }
+    if(s->len + s->tombstones + n <= s->cap){
+        return;
+    }
+    // same-size rebuild when tombstones rather than keys fill the table, as dmap_make_room does for maps
+    if(s->len + n <= s->cap && s->tombstones >= s->cap / 4){
+        dmap_set_rebuild(s, s->hash_cap);
+        return;
+    }
+    dmap_set_rebuild(s, dmap_set_hash_cap_for(s, MAX(s->len + n, s->cap + 1)));
+}
+static void dmap_set_check_key_size(DmapSet *s, size_t key_size) {
+    if(s->is_string){
+        if(key_size > UINT32_MAX){
+            dmap_error_handler("Error: key is too long");
+        }
+        return;
+    }
+    if(s->key_size == 0){
+        if(key_size == 0){
+            dmap_error_handler("Error: key is not the correct size");
+        }
+        s->key_size = key_size;
+        s->slot_size = key_size;
+    }
+    else if(s->key_size != key_size){
+        dmap_error_handler("Error: key is not the correct size");
+    }
+}
+// stores key in free slot i, whose hash has already been computed
+static void dmap_set_store(DmapSet *s, size_t i, u64 hash, const void *key, size_t key_size) {
+    char *slot = DMAP_SET_SLOT(s, i);
+    if(s->is_string){
+        DmapSetKstr *e = (DmapSetKstr*)slot;
+        e->hash = (u32)hash;
+        e->len = (u32)key_size;
+        if(key_size <= DMAP_SET_INLINE_KSTR){
+            memcpy(e->small, key, key_size);
+        }
+        else if(!(e->ptr = dmap_set_copy_key(s, key, key_size))){
+            dmap_error_handler("Out of memory 9");
+        }
+    }
+    else {
+        memcpy(slot, key, key_size);
+    }
+    if(s->ctrl[i] == DMAP_CTRL_DELETED){
+        s->tombstones--;
+    }
+    s->ctrl[i] = DMAP_CTRL_H2(hash);
+    s->len++;
+}
+// inserts key unless it is already there; returns whether it was added
+static bool dmap_set_insert_hashed(DmapSet *s, u64 hash, const void *key, size_t key_size) {
+    if(dmap_set_find(s, hash, key, key_size) != DMAP_SET_NONE){
+        return false;
+    }
+    dmap_set_make_room(s, 1);
+    dmap_set_store(s, dmap_ctrl_find_free(s->ctrl, hash, s->hash_cap), hash, key, key_size);
+    return true;
+}
+static void dmap_set_remove(DmapSet *s, size_t i) {
+    if(dmap_set_key_on_heap(s, DMAP_SET_SLOT(s, i))){
+        dmap_set_release_key(s, DMAP_SET_SLOT(s, i));
+    }
+    // no probe sequence ever continued past a group that still has an empty slot
+    if(dmap_group_match(s->ctrl + (i & ~(size_t)(DMAP_GROUP_WIDTH - 1)), DMAP_CTRL_EMPTY)){
+        s->ctrl[i] = DMAP_CTRL_EMPTY;
+    }
+    else {
+        s->ctrl[i] = DMAP_CTRL_DELETED;
+        s->tombstones++;
+    }
+    s->len--;
+}
+DmapSet *dmap__set_new(bool is_string, DmapOptions options){
+    const DmapAllocator *a = options.allocator.alloc_fn ? &options.allocator : &dmap_default_allocator;
+    DmapSet *s = (DmapSet*)dmap_mem_alloc(a, sizeof(DmapSet), DMAP_ALIGNMENT);
+    if(!s){
+        dmap_error_handler("Out of memory 7");
+    }
+    memset(s, 0, sizeof(DmapSet));
+    s->allocator = *a;
+    s->is_string = is_string;
+    s->slot_size = is_string ? sizeof(DmapSetKstr) : 0;
+    s->use_key_arena = is_string && options.use_key_arena;
+    s->load_factor = options.load_factor <= 0.0f ? DMAP_CTRL_LOAD_FACTOR : MIN(options.load_factor, DMAP_MAX_LOAD_FACTOR);
+    s->min_cap = options.initial_capacity > 0 ? (size_t)options.initial_capacity : 0;
+    s->hash_fn = options.hash_fn;
+    s->seeded_hash_fn = options.seeded_hash_fn;
+    s->cmp_fn = options.cmp_fn;
+    s->hash_engine = dmap_resolve_hash_engine(options.hash_engine);
+    s->hash_seed = options.hash_seed ? options.hash_seed : dmap_generate_seed();
+    return s;
+}
+void dmap_set_free(DmapSet *s){
+    if(!s) return;
+    dmap_set_release_keys(s);
+    dmap_set_free_table(s);
+    DmapAllocator a = s->allocator;
+    dmap_mem_free(&a, s, sizeof(DmapSet));
+}
+bool dmap__set_insert(DmapSet *s, const void *key, size_t key_size){
+    dmap_set_check_key_size(s, key_size);
+    return dmap_set_insert_hashed(s, dmap_set_hash(s, key, key_size), key, key_size);
+}
+bool dmap__set_contains(const DmapSet *s, const void *key, size_t key_size){
+    if(s->len == 0 || (!s->is_string && key_size != s->key_size)){
+        return false;
+    }
+    return dmap_set_find(s, dmap_set_hash(s, key, key_size), key, key_size) != DMAP_SET_NONE;
+}
+bool dmap__set_delete(DmapSet *s, const void *key, size_t key_size){
+    if(s->len == 0 || (!s->is_string && key_size != s->key_size)){
+        return false;
+    }
+    size_t i = dmap_set_find(s, dmap_set_hash(s, key, key_size), key, key_size);
+    if(i == DMAP_SET_NONE){
+        return false;
+    }
+    dmap_set_remove(s, i);
+    return true;
+}
+size_t dmap_set_count(const DmapSet *s){
+    return s ? s->len : 0;
+}
+void dmap_set_reserve(DmapSet *s, size_t n){
+    if(!s->ctrl){
+        s->min_cap = MAX(s->min_cap, n); // allocated with the first insert, once the key size is known
+        return;
+    }
+    if(n > s->cap){
+        dmap_set_rebuild(s, dmap_set_hash_cap_for(s, n));
+    }
+}
+void dmap_set_clear(DmapSet *s){
+    if(!s->ctrl) return;
+    dmap_set_release_keys(s);
+    memset(s->ctrl, DMAP_CTRL_EMPTY, s->hash_cap);
+    s->len = 0;
+    s->tombstones = 0;
+}
+bool dmap_set_iter_next(const DmapSet *s, DmapSetIter *it){
+    size_t i = dmap_set_next_full(s, it->pos);
+    if(i >= s->hash_cap){
+        it->pos = s->hash_cap;
+        return false;
+    }
+    it->pos = i + 1;
+    it->key = dmap_set_slot_key(s, DMAP_SET_SLOT(s, i), &it->key_size);
+    return true;
+}
+static void dmap_set_check_compatible(const DmapSet *a, const DmapSet *b) {
+    if(a->is_string != b->is_string || (a->key_size && b->key_size && a->key_size != b->key_size)){
+        dmap_error_handler("Error: sets have different key types");
+    }
+}
+// whether a hash computed by a is also the key's hash in b
+static inline bool dmap_set_same_hash(const DmapSet *a, const DmapSet *b) {
+    return a->hash_fn == b->hash_fn && a->seeded_hash_fn == b->seeded_hash_fn && a->hash_engine == b->hash_engine && (a->hash_fn || a->hash_seed == b->hash_seed);
+}
+// hash in b of the key in a's full slot i
+static inline u64 dmap_set_hash_in(const DmapSet *a, size_t i, const DmapSet *b, bool same_hash) {
+    if(same_hash){
+        return dmap_set_slot_hash(a, i);
+    }
+    size_t key_size;
+    const void *key = dmap_set_slot_key(a, DMAP_SET_SLOT(a, i), &key_size);
+    return dmap_set_hash(b, key, key_size);
+}
+// union into an empty set that hashes like src: a copy of src's table, plus copies of its heap keys
+static void dmap_set_copy_table(DmapSet *dst, const DmapSet *src) {
+    dmap_set_free_table(dst);
+    dmap_set_alloc_table(dst, src->hash_cap);
+    memcpy(dst->ctrl, src->ctrl, dmap_set_table_bytes(src, src->hash_cap));
+    dst->len = src->len;
+    dst->tombstones = src->tombstones;
+    if(!dst->is_string) return;
+    for(size_t i = dmap_set_next_full(dst, 0); i < dst->hash_cap; i = dmap_set_next_full(dst, i + 1)){
+        DmapSetKstr *e = (DmapSetKstr*)DMAP_SET_SLOT(dst, i);
+        if(e->len > DMAP_SET_INLINE_KSTR && !(e->ptr = dmap_set_copy_key(dst, e->ptr, e->len))){
+            dmap_error_handler("Out of memory 9");
+        }
+    }
+}
+void dmap_set_union(DmapSet *dst, const DmapSet *src){
+    dmap_set_check_compatible(dst, src);
+    if(dst == src || src->len == 0) return;
+    dmap_set_check_key_size(dst, src->is_string ? 0 : src->key_size);
+    bool same_hash = dmap_set_same_hash(src, dst);
+    if(dst->len == 0 && same_hash && dst->cmp_fn == src->cmp_fn && src->len + src->tombstones <= dmap_set_cap_for(dst, src->hash_cap)
+        && src->hash_cap >= dmap_set_hash_cap_for(dst, dst->min_cap)){
+        dmap_set_copy_table(dst, src);
+        return;
+    }
+    dmap_set_reserve(dst, MAX(dst->len, src->len));
+    for(size_t i = dmap_set_next_full(src, 0); i < src->hash_cap; i = dmap_set_next_full(src, i + 1)){
+        size_t key_size;
+        const void *key = dmap_set_slot_key(src, DMAP_SET_SLOT(src, i), &key_size);
+        dmap_set_insert_hashed(dst, dmap_set_hash_in(src, i, dst, same_hash), key, key_size);
+    }
 }
-static inline DmapOptions dmap_default_options(void) {
-    return (DmapOptions){
-        .data_allocator_fn = NULL,
-        .free_key_fn = NULL,
-        .initial_capacity = DMAP_INITIAL_CAPACITY,
-        .user_managed_keys = false,
-    };
+void dmap_set_intersect(DmapSet *dst, const DmapSet *src){
+    dmap_set_check_compatible(dst, src);
+    if(dst == src || dst->len == 0) return;
+    if(src->len == 0){
+        dmap_set_clear(dst);
+        return;
+    }
+    bool same_hash = dmap_set_same_hash(dst, src);
+    for(size_t i = dmap_set_next_full(dst, 0); i < dst->hash_cap; i = dmap_set_next_full(dst, i + 1)){
+        size_t key_size;
+        const void *key = dmap_set_slot_key(dst, DMAP_SET_SLOT(dst, i), &key_size);
+        if(dmap_set_find(src, dmap_set_hash_in(dst, i, src, same_hash), key, key_size) == DMAP_SET_NONE){
+            dmap_set_remove(dst, i);
+        }
+    }
 }
-// grows the hashmap to a new capacity
-void *dmap__grow(DmapHdr *d, size_t elem_size) {
-    if (!d) {
-        // when this is the case we just want the defaults
-        return dmap__init(elem_size, dmap_default_options());
+void dmap_set_difference(DmapSet *dst, const DmapSet *src){
+    dmap_set_check_compatible(dst, src);
+    if(dst->len == 0 || src->len == 0) return;
+    if(dst == src){
+        dmap_set_clear(dst);
+        return;
+    }
+    bool same_hash = dmap_set_same_hash(dst, src);
+    if(src->len < dst->len){ // look up the smaller set's keys in the larger one
+        for(size_t i = dmap_set_next_full(src, 0); i < src->hash_cap; i = dmap_set_next_full(src, i + 1)){
+            size_t key_size;
+            const void *key = dmap_set_slot_key(src, DMAP_SET_SLOT(src, i), &key_size);
+            size_t j = dmap_set_find(dst, dmap_set_hash_in(src, i, dst, same_hash), key, key_size);
+            if(j != DMAP_SET_NONE){
+                dmap_set_remove(dst, j);
+            }
+        }
+        return;
+    }
+    for(size_t i = dmap_set_next_full(dst, 0); i < dst->hash_cap; i = dmap_set_next_full(dst, i + 1)){
+        size_t key_size;
+        const void *key = dmap_set_slot_key(dst, DMAP_SET_SLOT(dst, i), &key_size);
+        if(dmap_set_find(src, dmap_set_hash_in(dst, i, src, same_hash), key, key_size) != DMAP_SET_NONE){
+            dmap_set_remove(dst, i);
+        }
     }
-    return dmap__grow_internal(d, elem_size);
 }
-void *dmap__kstr_grow(DmapHdr *d, size_t elem_size) {
-    if (!d) {
-        // when this is the case we just want the defaults
-        return dmap__kstr_init(elem_size, dmap_default_options());
+
+// /////////////////////////////////////////////
+// MARK: CLONE
+// /////////////////////////////////////////////
+// dmap_clone copies a map with a handful of flat copies: the header and data array, the table (and the old one
+// while an incremental resize is draining it), the per index arrays, the free list and the bloom filter. Nothing
+// is rehashed, so data indices and the hash seed carry over. Keys in a key arena aren't copied at all: the clone
+// takes a reference on every chunk and both maps go on to allocate new keys from chunks of their own (see MARK:
+// KEY ARENA). Other heap keys, including those of a snapshot, are copied into a single arena chunk of the clone.
+
+// arena bytes taken by the heap keys of the live slots of table
+static size_t dmap_clone_key_bytes(DmapHdr *d, void *table, size_t hash_cap) {
+    size_t bytes = 0;
+    for(size_t i = 0; table && i < hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, table, i);
+        size_t key_size;
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+            bytes += dmap_arena_size(key_size);
+        }
     }
-    return dmap__grow_internal(d, elem_size);
+    return bytes;
 }
-void dmap__free(DmapHdr *d){
-    if(d){
-        if(d->table) {
-            if(d->options.user_managed_keys && d->options.free_key_fn){ // user manages keys & provided a free function
-                for(s32 i = 0; i < d->hash_cap; i++){
-                    if(d->table[i].ptr != NULL){
-                        d->options.free_key_fn(d->table[i].ptr);
-                    }
-                }
+// copies table, hash_cap slots of d, for clone. Heap keys are copied into clone's arena unless it shares d's chunks
+static void *dmap_clone_table(DmapHdr *d, DmapHdr *clone, void *table, size_t hash_cap) {
+    void *copy = dmap_table_alloc(clone, dmap_table_bytes(clone, hash_cap));
+    if(!copy){
+        return NULL;
+    }
+    memcpy(copy, table, dmap_table_bytes(clone, hash_cap));
+    if(d->key_arena){
+        return copy;
+    }
+    for(size_t i = 0; i < hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(clone, copy, i);
+        size_t key_size;
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED || !dmap_slot_key_on_heap(d, slot, &key_size)) continue;
+        char *dst = (char*)dmap_copy_key(clone, dmap_slot_key(d, slot, &key_size), key_size); // fits, the chunk was sized by dmap_clone_key_bytes
+        if(clone->slot_kind == DMAP_SLOT_KSTR){
+            dmap_kstr_slot_set_ptr((DmapKstrSlot*)slot, dst);
+        }
+        else {
+            ((DmapTable*)slot)->ptr = dst;
+        }
+    }
+    return copy;
+}
+void *dmap__clone(DmapHdr *d){
+    size_t bytes = offsetof(DmapHdr, data) + (size_t)d->cap * d->val_size;
+    DmapHdr *c = dmap_hdr_realloc(NULL, &d->options, 0, bytes);
+    if(!c){
+        return NULL;
+    }
+    memcpy(c, d, bytes);
+    // nothing is shared with d yet, so dmap__free only releases what has been copied when something fails
+    c->table = NULL;
+    c->ctrl = NULL;
+    c->old_table = NULL;
+    c->old_hash_cap = 0;
+    c->migrate_pos = 0;
+    c->next_table = NULL; // allocated again when needed
+    c->next_hash_cap = 0;
+    c->next_ready = 0;
+    c->free_list = NULL;
+    c->key_arena = NULL;
+    c->bloom = NULL;
+    c->snapshot = NULL;
+    c->snapshot_size = 0;
+    c->key_base = 0;
+    c->occupied = NULL;
+    c->idx_hash = NULL;
+    c->referenced = NULL;
+    c->options.free_key_fn = NULL; // user managed keys are shared, and still freed by d
+#ifdef DMAP_STATS
+    memset(&c->stats, 0, sizeof(c->stats));
+    c->stats_probes = 0;
+    c->stats_off = false;
+#endif
+    const DmapAllocator *a = &c->options.allocator;
+    bool ok = true;
+    if(d->key_arena){
+        c->key_arena = (DmapKeyArena*)dmap_mem_alloc(a, sizeof(DmapKeyArena), DMAP_ALIGNMENT);
+        ok = c->key_arena != NULL;
+        if(ok){
+            *c->key_arena = *d->key_arena;
+            for(DmapArenaChunk *chunk = c->key_arena->chunks; chunk; chunk = chunk->next){
+                chunk->refs++;
             }
-            else if(!d->options.user_managed_keys){
-                if(d->is_string){
-                    for(s32 i = 0; i < d->hash_cap; i++){
-                        if(d->table[i].kstr_len > 8 && d->table[i].kstr != NULL){
-                            free(d->table[i].kstr);
-                        }
-                    }
-                }
-                else {
-                    for(s32 i = 0; i < d->hash_cap; i++){
-                        if(d->key_size > 8 && d->table[i].ptr != NULL){
-                            free(d->table[i].ptr);
-                        }
-                    }
-                }
+            DMAP_STAT_ADD(c, key_bytes, d->key_arena->live_bytes);
+        }
+    }
+    else {
+        size_t key_bytes = dmap_clone_key_bytes(d, d->table, (size_t)d->hash_cap) + dmap_clone_key_bytes(d, d->old_table, (size_t)d->old_hash_cap);
+        if(key_bytes){
+            c->options.use_key_arena = true;
+            c->key_arena = (DmapKeyArena*)dmap_mem_alloc(a, sizeof(DmapKeyArena), DMAP_ALIGNMENT);
+            ok = c->key_arena != NULL;
+            if(ok){
+                memset(c->key_arena, 0, sizeof(DmapKeyArena));
+                ok = dmap_arena_new_chunk(a, c->key_arena, key_bytes) != NULL;
             }
-            free(d->table); 
         }
-        if(d->free_list){
-            if(d->free_list->data) {
-                free(d->free_list->data);
+    }
+    // from here on c has a key arena whenever its slots point at keys, so a failed clone never frees d's keys
+    if(ok && d->table){
+        c->table = dmap_clone_table(d, c, d->table, (size_t)d->hash_cap);
+        ok = c->table != NULL;
+        c->ctrl = ok && c->options.use_ctrl_bytes ? (u8*)c->table + (size_t)c->hash_cap * c->slot_size : NULL;
+    }
+    if(ok && d->old_table){
+        c->old_table = dmap_clone_table(d, c, d->old_table, (size_t)d->old_hash_cap);
+        ok = c->old_table != NULL;
+        if(ok){
+            c->old_hash_cap = d->old_hash_cap;
+            c->migrate_pos = d->migrate_pos;
+        }
+    }
+    DmapIndexArrays arrays;
+    if(ok && (ok = dmap_index_arrays_alloc(d, (size_t)d->cap, &arrays))){
+        if(arrays.referenced && d->referenced){
+            memcpy(arrays.referenced, d->referenced, dmap_occupied_bytes((size_t)d->cap));
+        }
+        c->occupied = (unsigned long long*)arrays.occupied;
+        c->idx_hash = arrays.idx_hash;
+        c->referenced = (unsigned long long*)arrays.referenced;
+    }
+    if(ok && d->free_list){
+        c->free_list = (DmapFreeList*)dmap_mem_alloc(a, sizeof(DmapFreeList), DMAP_ALIGNMENT);
+        ok = c->free_list != NULL;
+        if(ok){
+            c->free_list->len = d->free_list->len;
+            c->free_list->cap = MAX(d->free_list->len, 16); // a snapshot's list is only as long as it is
+            c->free_list->data = (s32*)dmap_mem_alloc(a, (size_t)c->free_list->cap * sizeof(s32), DMAP_ALIGNMENT);
+            ok = c->free_list->data != NULL;
+            if(ok){
+                memcpy(c->free_list->data, d->free_list->data, (size_t)d->free_list->len * sizeof(s32));
             }
-            free(d->free_list);
         }
-        d->options.data_allocator_fn(d, 0); 
     }
+    if(ok && d->bloom){
+        c->bloom = (DmapBloom*)dmap_mem_alloc(a, dmap_bloom_bytes(d->bloom->num_blocks), 64);
+        if(c->bloom){ // otherwise lookups go straight to the table, as after a failed rebuild
+            memcpy(c->bloom, d->bloom, dmap_bloom_bytes(d->bloom->num_blocks));
+        }
+    }
+    if(!ok){
+        dmap__free(c);
+        return NULL;
+    }
+    return c->data;
 }
-s32 dmap__get_entry_index(DmapHdr *d, void *key, size_t key_size){
-    s32 result = DMAP_INVALID;
-    if(d->cap != 0) {
-        u64 hash = d->options.hash_fn ? d->options.hash_fn(key, key_size) : dmap_generate_hash(key, key_size, d->hash_seed); // generate a hash value for the given key
-        s32 idx = hash & (d->hash_cap - 1);
-        // size_t j = d->hash_cap; // counter to ensure the loop doesn't iterate more than the capacity of the hashmap
-        while(true) { // loop to search for the key in the hashmap
-            // dmap_assert(j-- != 0); // unreachable -- suggests table is full
-            if(d->table[idx].data_idx == DMAP_EMPTY){ // if the entry is empty, the key is not in the hashmap
-                break;
+
+// len of the data array, including invalid table. For iterating
+// /////////////////////////////////////////////
+// MARK: SNAPSHOT
+// /////////////////////////////////////////////
+// On-disk image of a map that can be mapped straight back into memory. The file is a DmapSnapshotHeader, the
+// DmapHdr and its data array, the table with its ctrl bytes, the free list, a blob with the keys dmap had
+// copied to the heap and the bloom filter, if the map has one. Table slots hold offsets into the blob instead of pointers, which is what d->key_base is
+// for, so nothing in the file is touched when it's opened. Only the header page is patched (and so copied by the
+// kernel); the rest is shared in the page cache by every process that maps the same file. The image is only valid
+// for builds with the same DmapHdr layout, pointer size and byte order, all of which are checked on open.
+
+#define DMAP_SNAPSHOT_MAGIC "DMAPSNAP"
+#define DMAP_SNAPSHOT_VERSION 5
+#define DMAP_SNAPSHOT_HDR_OFFSET 128 // where the DmapHdr starts in the file
+#define DMAP_SNAPSHOT_HASH_FN (1u << 0)
+#define DMAP_SNAPSHOT_CMP_FN  (1u << 1)
+
+typedef struct DmapSnapshotHeader {
+    char magic[8];
+    u32 version;
+    u32 byte_order; // 0x01020304 as written
+    u32 hdr_size;   // sizeof(DmapHdr)
+    u32 pointer_size;
+    u32 flags;      // DMAP_SNAPSHOT_HASH_FN / DMAP_SNAPSHOT_CMP_FN: functions that have to be passed back on open
+    u32 reserved;
+    u64 file_size;
+    u64 table_offset; // from the start of the file
+    u64 free_list_offset;
+    u64 keys_offset;
+    u64 occupied_offset;
+    u64 idx_hash_offset;
+    u64 bloom_offset; // 0 without a filter
+    DmapFreeList free_list; // the map's free list header, pointed at its indices on open
+} DmapSnapshotHeader;
+
+typedef char dmap_snapshot_header_fits[sizeof(DmapSnapshotHeader) <= DMAP_SNAPSHOT_HDR_OFFSET ? 1 : -1];
+
+static bool dmap_write_zeros(FILE *f, size_t n) {
+    static const char zeros[64];
+    for(; n > sizeof(zeros); n -= sizeof(zeros)){
+        if(fwrite(zeros, 1, sizeof(zeros), f) != sizeof(zeros)) return false;
+    }
+    return fwrite(zeros, 1, n, f) == n;
+}
+// bytes a heap key takes in the blob: strings keep their terminator, like the heap copies
+static inline size_t dmap_snapshot_key_bytes(DmapHdr *d, size_t key_size) {
+    return ALIGN_UP(key_size + (d->is_string ? 1 : 0), 8);
+}
+int dmap__save(DmapHdr *d, const char *path){
+    if(!d || d->options.user_managed_keys){
+        return -1; // keys outside the map can't be written out
+    }
+    dmap_finish_migration(d);
+    size_t free_len = d->free_list ? (size_t)d->free_list->len : 0;
+    size_t range = (size_t)d->len + free_len;
+    size_t table_bytes = d->table ? dmap_table_bytes(d, d->hash_cap) : 0;
+    size_t slots = d->table ? (size_t)d->hash_cap : 0;
+
+    DmapSnapshotHeader sh = {0};
+    memcpy(sh.magic, DMAP_SNAPSHOT_MAGIC, sizeof(sh.magic));
+    sh.version = DMAP_SNAPSHOT_VERSION;
+    sh.byte_order = 0x01020304;
+    sh.hdr_size = sizeof(DmapHdr);
+    sh.pointer_size = sizeof(void*);
+    sh.flags = (d->options.hash_fn || d->options.seeded_hash_fn ? DMAP_SNAPSHOT_HASH_FN : 0) | (d->options.cmp_fn ? DMAP_SNAPSHOT_CMP_FN : 0);
+    size_t data_end = DMAP_SNAPSHOT_HDR_OFFSET + offsetof(DmapHdr, data) + range * (size_t)d->val_size;
+    sh.table_offset = ALIGN_UP(data_end, 64);
+    sh.free_list_offset = sh.table_offset + table_bytes;
+    sh.occupied_offset = ALIGN_UP(sh.free_list_offset + free_len * sizeof(s32), 8);
+    sh.idx_hash_offset = sh.occupied_offset + dmap_occupied_bytes(range);
+    sh.keys_offset = ALIGN_UP(sh.idx_hash_offset + range * sizeof(u32), 8);
+    size_t keys_bytes = 0;
+    for(size_t i = 0; i < slots; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        size_t key_size;
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+            keys_bytes += dmap_snapshot_key_bytes(d, key_size);
+        }
+    }
+    sh.file_size = sh.keys_offset + keys_bytes;
+    if(d->bloom){
+        sh.bloom_offset = ALIGN_UP(sh.file_size, 64);
+        sh.file_size = sh.bloom_offset + dmap_bloom_bytes(d->bloom->num_blocks);
+    }
+    sh.free_list.len = (int)free_len;
+    sh.free_list.cap = (int)free_len;
+
+    DmapHdr img = *d; // nothing that points into this process is written
+    memset(&img.options, 0, sizeof(img.options));
+    img.options.initial_capacity = d->options.initial_capacity;
+    img.options.load_factor = d->options.load_factor;
+    img.options.use_ctrl_bytes = d->options.use_ctrl_bytes;
+    img.options.robin_hood = d->options.robin_hood;
+    img.options.hash_engine = d->options.hash_engine;
+    img.options.bloom_bits_per_key = d->options.bloom_bits_per_key;
+    img.table = NULL;
+    img.ctrl = NULL;
+    img.old_table = NULL;
+    img.free_list = NULL;
+    img.key_arena = NULL;
+    img.bloom = NULL;
+    img.next_table = NULL;
+    img.next_hash_cap = 0;
+    img.next_ready = 0;
+    img.snapshot = NULL;
+    img.snapshot_size = 0;
+    img.key_base = 0;
+    img.occupied = NULL;
+    img.idx_hash = NULL;
+    img.referenced = NULL;
+    img.options.dense = d->options.dense;
+    img.cap = (int)range; // only the used part of the data array is stored
+
+    FILE *f = fopen(path, "wb");
+    if(!f){
+        return -1;
+    }
+    bool ok = fwrite(&sh, sizeof(sh), 1, f) == 1 && dmap_write_zeros(f, DMAP_SNAPSHOT_HDR_OFFSET - sizeof(sh));
+    ok = ok && fwrite(&img, offsetof(DmapHdr, data), 1, f) == 1;
+    ok = ok && (range == 0 || fwrite(d->data, (size_t)d->val_size, range, f) == range);
+    ok = ok && dmap_write_zeros(f, sh.table_offset - data_end);
+    size_t key_offset = 0;
+    for(size_t i = 0; ok && i < slots; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        DmapAnySlot tmp;
+        dmap_copy_slot(d, &tmp.slot, slot);
+        size_t key_size;
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+            if(d->slot_kind == DMAP_SLOT_KSTR){
+                dmap_kstr_slot_set_ptr(&tmp.kstr_slot, (char*)(uintptr_t)key_offset);
             }
-            if(d->table[idx].data_idx != DMAP_DELETED && d->table[idx].hash == hash) {
-                if(keys_match(d, idx, key, key_size)){
-                    result = idx;
-                    break;
-                }
+            else {
+                tmp.wide.ptr = (void*)(uintptr_t)key_offset;
             }
-            idx = (idx + 1) & (d->hash_cap - 1); // move to the next index, wrapping around to the start if necessary
+            key_offset += dmap_snapshot_key_bytes(d, key_size);
+        }
+        ok = fwrite(&tmp, (size_t)d->slot_size, 1, f) == 1;
+    }
+    ok = ok && (!d->ctrl || fwrite(d->ctrl, 1, slots, f) == slots);
+    ok = ok && (free_len == 0 || fwrite(d->free_list->data, sizeof(s32), free_len, f) == free_len);
+    ok = ok && dmap_write_zeros(f, sh.occupied_offset - (sh.free_list_offset + free_len * sizeof(s32)));
+    ok = ok && (range == 0 || fwrite(d->occupied, 1, dmap_occupied_bytes(range), f) == dmap_occupied_bytes(range));
+    ok = ok && (range == 0 || fwrite(d->idx_hash, sizeof(u32), range, f) == range);
+    ok = ok && dmap_write_zeros(f, sh.keys_offset - (sh.idx_hash_offset + range * sizeof(u32)));
+    for(size_t i = 0; ok && i < slots; i++){ // same order as the offsets above
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        size_t key_size;
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+            void *key = dmap_slot_key(d, slot, &key_size);
+            ok = fwrite(key, 1, key_size, f) == key_size && dmap_write_zeros(f, dmap_snapshot_key_bytes(d, key_size) - key_size);
         }
     }
-    return result;
+    if(ok && d->bloom){ // ships prebuilt, so opening the snapshot doesn't walk the table
+        ok = dmap_write_zeros(f, sh.bloom_offset - (sh.keys_offset + keys_bytes))
+          && fwrite(d->bloom, 1, dmap_bloom_bytes(d->bloom->num_blocks), f) == dmap_bloom_bytes(d->bloom->num_blocks);
+    }
+    ok = fclose(f) == 0 && ok;
+    return ok ? 0 : -1;
 }
-static char *dmap_strdup(char *src, size_t len) {
-    char *dst = (char*)malloc(len + 1);
-    if (!dst) {
-        return NULL; 
+static void dmap_snapshot_unmap(void *base, size_t size) {
+#if defined(__linux__) || defined(__APPLE__)
+    munmap(base, size);
+#else
+    dmap_default_free(NULL, base, size);
+#endif
+}
+// maps the whole file copy-on-write; without mmap it is read into memory instead
+static void *dmap_snapshot_map(const char *path, size_t *size) {
+#if defined(__linux__) || defined(__APPLE__)
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return NULL;
     }
-    memcpy(dst, src, len);
-    dst[len] = '\0';
-    return dst;
+    struct stat st;
+    void *base = NULL;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= DMAP_SNAPSHOT_HDR_OFFSET + sizeof(DmapHdr)){
+        *size = (size_t)st.st_size;
+        base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(base == MAP_FAILED){
+            base = NULL;
+        }
+    }
+    close(fd);
+    return base;
+#else
+    FILE *f = fopen(path, "rb");
+    if(!f){
+        return NULL;
+    }
+    void *base = NULL;
+    long len = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if(len >= (long)(DMAP_SNAPSHOT_HDR_OFFSET + sizeof(DmapHdr)) && fseek(f, 0, SEEK_SET) == 0){
+        *size = (size_t)len;
+        base = dmap_default_alloc(NULL, *size, 64);
+        if(base && fread(base, 1, *size, f) != *size){
+            dmap_default_free(NULL, base, *size);
+            base = NULL;
+        }
+    }
+    fclose(f);
+    return base;
+#endif
 }
-static void *dmap_dup_struct(const void *src, size_t len) {
-    void *dst = malloc(len);
-    if (!dst) {
+// the filter has to be the last thing in the file and fill it exactly
+static bool dmap_snapshot_bloom_ok(const DmapSnapshotHeader *sh, const u8 *base, size_t size) {
+    if(!sh->bloom_offset){
+        return true;
+    }
+    if(sh->bloom_offset < sh->keys_offset || (sh->bloom_offset & 63) || sh->bloom_offset > size || size - sh->bloom_offset < sizeof(DmapBloom)){
+        return false;
+    }
+    u64 num_blocks = ((const DmapBloom*)(base + sh->bloom_offset))->num_blocks;
+    return num_blocks > 0 && num_blocks <= size / sizeof(u32[DMAP_BLOOM_WORDS]) && dmap_bloom_bytes(num_blocks) == size - sh->bloom_offset;
+}
+void *dmap__open_mmap(const char *path, bool writable, DmapOptions options){
+    size_t size = 0;
+    u8 *base = (u8*)dmap_snapshot_map(path, &size);
+    if(!base){
         return NULL;
     }
-    memcpy(dst, src, len);
-    return dst;
+    DmapSnapshotHeader *sh = (DmapSnapshotHeader*)base;
+    DmapHdr *d = (DmapHdr*)(base + DMAP_SNAPSHOT_HDR_OFFSET);
+    u32 missing = ((sh->flags & DMAP_SNAPSHOT_HASH_FN) && !options.hash_fn && !options.seeded_hash_fn) || ((sh->flags & DMAP_SNAPSHOT_CMP_FN) && !options.cmp_fn)
+                || dmap_resolve_hash_engine(d->options.hash_engine) != d->options.hash_engine; // hashed with an engine this CPU lacks
+    size_t data_end = DMAP_SNAPSHOT_HDR_OFFSET + offsetof(DmapHdr, data) + (size_t)d->cap * (size_t)d->val_size;
+    size_t table_bytes = d->hash_cap ? (size_t)d->hash_cap * (size_t)d->slot_size + (d->options.use_ctrl_bytes ? (size_t)d->hash_cap : 0) : 0;
+    if(memcmp(sh->magic, DMAP_SNAPSHOT_MAGIC, sizeof(sh->magic)) != 0 || sh->version != DMAP_SNAPSHOT_VERSION
+        || sh->byte_order != 0x01020304 || sh->hdr_size != sizeof(DmapHdr) || sh->pointer_size != sizeof(void*)
+        || sh->file_size != size || missing || sh->table_offset < data_end || sh->table_offset + table_bytes != sh->free_list_offset
+        || sh->free_list_offset + (size_t)sh->free_list.len * sizeof(s32) > sh->occupied_offset
+        || sh->occupied_offset + dmap_occupied_bytes((size_t)d->cap) != sh->idx_hash_offset
+        || sh->idx_hash_offset + (size_t)d->cap * sizeof(u32) > sh->keys_offset || sh->keys_offset > size
+        || !dmap_snapshot_bloom_ok(sh, base, size)){
+        dmap_snapshot_unmap(base, size);
+        return NULL;
+    }
+    // everything patched here lives in the first page
+    d->table = d->hash_cap ? base + sh->table_offset : NULL;
+    d->ctrl = d->hash_cap && d->options.use_ctrl_bytes ? base + sh->table_offset + (size_t)d->hash_cap * d->slot_size : NULL;
+    sh->free_list.data = (int*)(base + sh->free_list_offset);
+    d->free_list = &sh->free_list;
+    d->occupied = (unsigned long long*)(base + sh->occupied_offset);
+    d->idx_hash = (unsigned int*)(base + sh->idx_hash_offset);
+    d->key_base = (size_t)(uintptr_t)(base + sh->keys_offset);
+    d->bloom = sh->bloom_offset ? (DmapBloom*)(base + sh->bloom_offset) : NULL;
+    d->options.hash_fn = options.hash_fn;
+    d->options.seeded_hash_fn = options.seeded_hash_fn;
+    d->options.cmp_fn = options.cmp_fn;
+    d->options.allocator = dmap_default_allocator;
+    d->snapshot = base;
+    d->snapshot_size = size;
+#ifdef DMAP_STATS
+    memset(&d->stats, 0, sizeof(d->stats)); // counters of the map that was saved
+    d->stats_off = false;
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if(!writable && size > page){
+        mprotect(base + page, size - page, PROT_READ);
+    }
+#else
+    (void)writable;
+#endif
+    return d->data;
+}
+static void dmap_snapshot_close(DmapHdr *d) {
+    dmap_snapshot_unmap(d->snapshot, d->snapshot_size);
 }
 
+// /////////////////////////////////////////////
+// MARK: STREAM
+// /////////////////////////////////////////////
+// Serialization through user callbacks, buffered DMAP_STREAM_BUFFER bytes at a time in either direction. A stream
+// is a DmapStreamHeader followed by either the live entries (key, then value) walked in table order, or with
+// ship_table the data array, free list, table and key blob much like a snapshot. Entries are rehashed by the
+// reader, which sizes the map once from the header and inserts them in batches. A shipped table is read
+// straight into place, keeping the sender's seed and data indices, so it needs the same build and hash function.
 
-void dmap__insert_entry(DmapHdr *d, void *key, size_t key_size){ 
-    if(d->key_size == 0){  
-        if(d->is_string) 
-            d->key_size = -1; // strings
-        else 
-            d->key_size = (s32)key_size;
-    }
-    else if(d->key_size != (s32)key_size && d->key_size != -1){
-        dmap_error_handler("Error: key is not the correct size");
+#define DMAP_STREAM_MAGIC "DMAPSTRM"
+#define DMAP_STREAM_VERSION 4
+#define DMAP_STREAM_BUFFER ((size_t)64 << 10)
+#define DMAP_STREAM_BATCH 256
+#define DMAP_STREAM_TABLE (1u << 2) // header flag: ship_table layout
+#define DMAP_STREAM_MAX_KEY ((size_t)16 << 20) // longest key a reader accepts; the stream may come from anywhere
+
+typedef struct DmapStreamHeader {
+    char magic[8];
+    u32 version;
+    u32 byte_order;
+    u32 flags;     // DMAP_SNAPSHOT_HASH_FN / DMAP_SNAPSHOT_CMP_FN / DMAP_STREAM_TABLE
+    s32 key_size;  // -1 for string keys, 0 if nothing was ever inserted
+    u32 val_size;
+    u32 len;
+    u32 range;     // ship_table: data array entries sent, live or free
+    u32 cap;
+    u32 hash_cap;
+    u32 tombstones;
+    u32 slot_size;
+    u32 slot_kind;
+    u64 hash_seed;
+    float load_factor;
+    u8 is_string;
+    u8 use_ctrl_bytes;
+    u8 robin_hood;
+    u8 dense;
+    u8 hash_engine;
+} DmapStreamHeader;
+
+typedef struct DmapStreamBuf {
+    size_t (*write_fn)(void *ctx, const void *buf, size_t len);
+    size_t (*read_fn)(void *ctx, void *buf, size_t len);
+    void *ctx;
+    char *buf;
+    size_t pos;
+    size_t len; // reader: bytes in buf
+    bool ok;
+} DmapStreamBuf;
+
+static bool dmap_stream_flush(DmapStreamBuf *w) {
+    if(w->ok && w->pos && w->write_fn(w->ctx, w->buf, w->pos) != w->pos){
+        w->ok = false;
     }
-    u64 hash =  d->options.hash_fn ? d->options.hash_fn(key, key_size) : dmap_generate_hash(key, key_size, d->hash_seed);
-    u32 idx = hash & (d->hash_cap - 1);
-    // size_t j = d->hash_cap;
-    while(true){
-        // dmap_assert(j-- != 0); // unreachable - suggests there were no empty slots
-        if(d->table[idx].data_idx == DMAP_EMPTY || d->table[idx].data_idx == DMAP_DELETED){ // insert in empty or deleted
-            break;
+    w->pos = 0;
+    return w->ok;
+}
+static bool dmap_stream_write(DmapStreamBuf *w, const void *src, size_t n) {
+    if(w->pos + n > DMAP_STREAM_BUFFER){
+        if(!dmap_stream_flush(w)) return false;
+        if(n >= DMAP_STREAM_BUFFER){ // large runs go straight through
+            w->ok = w->write_fn(w->ctx, src, n) == n;
+            return w->ok;
         }
-        if(d->table[idx].hash == hash){ 
-            if(keys_match(d, idx, key, key_size)){ // modify existing entry
-                break;
+    }
+    memcpy(w->buf + w->pos, src, n);
+    w->pos += n;
+    return w->ok;
+}
+static bool dmap_stream_read(DmapStreamBuf *r, void *dst, size_t n) {
+    char *out = (char*)dst;
+    while(n && r->ok){
+        if(r->pos == r->len){
+            if(n >= DMAP_STREAM_BUFFER){ // large runs go straight to their destination
+                size_t got = r->read_fn(r->ctx, out, n);
+                r->ok = got != 0;
+                out += got;
+                n -= got;
+                continue;
             }
+            r->pos = 0;
+            r->len = r->read_fn(r->ctx, r->buf, DMAP_STREAM_BUFFER);
+            r->ok = r->len != 0;
+            continue;
         }
-        idx = (idx + 1) & (d->hash_cap - 1);
+        size_t take = MIN(n, r->len - r->pos);
+        memcpy(out, r->buf + r->pos, take);
+        r->pos += take;
+        out += take;
+        n -= take;
     }
-    if(d->table[idx].data_idx != DMAP_EMPTY && d->table[idx].data_idx != DMAP_DELETED){
-        d->returned_idx = d->table[idx].data_idx;
+    return r->ok;
+}
+int dmap__write_stream(DmapHdr *d, size_t (*write_fn)(void *ctx, const void *buf, size_t len), void *ctx, bool ship_table){
+    if(!d || (ship_table && d->options.user_managed_keys)){
+        return -1;
     }
-    else {
-
-        d->returned_idx = d->free_list && d->free_list->len > 0 ? dmap_freelist_pop(d) : d->len;
-        d->len += 1;
+    dmap_finish_migration(d);
+    size_t free_len = d->free_list ? (size_t)d->free_list->len : 0;
+    size_t slots = d->table ? (size_t)d->hash_cap : 0;
+    DmapStreamHeader sh = {0};
+    memcpy(sh.magic, DMAP_STREAM_MAGIC, sizeof(sh.magic));
+    sh.version = DMAP_STREAM_VERSION;
+    sh.byte_order = 0x01020304;
+    sh.flags = (d->options.hash_fn || d->options.seeded_hash_fn ? DMAP_SNAPSHOT_HASH_FN : 0) | (d->options.cmp_fn ? DMAP_SNAPSHOT_CMP_FN : 0) | (ship_table ? DMAP_STREAM_TABLE : 0);
+    sh.key_size = d->key_size;
+    sh.val_size = (u32)d->val_size;
+    sh.len = (u32)d->len;
+    sh.range = (u32)(d->len + free_len);
+    sh.cap = (u32)d->cap;
+    sh.hash_cap = (u32)slots;
+    sh.tombstones = (u32)d->tombstones;
+    sh.slot_size = (u32)d->slot_size;
+    sh.slot_kind = d->slot_kind;
+    sh.hash_seed = d->hash_seed;
+    sh.load_factor = d->options.load_factor;
+    sh.is_string = d->is_string;
+    sh.use_ctrl_bytes = d->options.use_ctrl_bytes;
+    sh.robin_hood = d->options.robin_hood;
+    sh.dense = d->options.dense;
+    sh.hash_engine = (u8)d->options.hash_engine;
 
-        DmapTable *entry = &d->table[idx];
-        entry->hash = hash;
-        entry->data_idx = d->returned_idx;
-        if(d->is_string) { 
-            entry->kstr_len = (s32)key_size;
-            if(d->options.user_managed_keys) { // user managed/allocated keys
-                entry->kstr = key;
-            }
-            else if(key_size <= 8) { // otherwise dmap copies string keys
-                memcpy(entry->small_kstr, key, key_size);
+    DmapStreamBuf w = {write_fn, NULL, ctx, NULL, 0, 0, true};
+    w.buf = (char*)dmap_mem_alloc(&d->options.allocator, DMAP_STREAM_BUFFER, DMAP_ALIGNMENT);
+    if(!w.buf){
+        return -1;
+    }
+    dmap_stream_write(&w, &sh, sizeof(sh));
+    if(!ship_table){
+        for(size_t i = 0; w.ok && i < slots; i++){
+            DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+            if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+            size_t key_size;
+            void *key = dmap_slot_key(d, slot, &key_size);
+            if(d->is_string){
+                u32 len = (u32)key_size;
+                dmap_stream_write(&w, &len, sizeof(len));
             }
-            else {
-                entry->kstr = dmap_strdup(key, key_size);
-                if(!entry->kstr){
-                    dmap_error_handler("Error: dmap_strdup - malloc failed");
+            dmap_stream_write(&w, key, key_size);
+            dmap_stream_write(&w, d->data + (size_t)slot->data_idx * d->val_size, (size_t)d->val_size);
+        }
+    }
+    else {
+        dmap_stream_write(&w, d->data, (size_t)sh.range * d->val_size);
+        if(free_len){
+            dmap_stream_write(&w, d->free_list->data, free_len * sizeof(s32));
+        }
+        size_t key_offset = 0;
+        for(size_t i = 0; w.ok && i < slots; i++){ // heap key pointers become offsets into the key blob
+            DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+            DmapAnySlot tmp;
+            dmap_copy_slot(d, &tmp.slot, slot);
+            size_t key_size;
+            if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+                if(d->slot_kind == DMAP_SLOT_KSTR){
+                    dmap_kstr_slot_set_ptr(&tmp.kstr_slot, (char*)(uintptr_t)key_offset);
                 }
+                else {
+                    tmp.wide.ptr = (void*)(uintptr_t)key_offset;
+                }
+                key_offset += key_size;
             }
+            dmap_stream_write(&w, &tmp, (size_t)d->slot_size);
         }
-        else {
-            dmap_assert(d->key_size == (s32)key_size);
-            entry->kstr_len = (s32)key_size;
-            if(d->options.user_managed_keys) { // user managed/allocated keys
-                entry->ptr = key;
+        if(d->ctrl){
+            dmap_stream_write(&w, d->ctrl, slots);
+        }
+        for(size_t i = 0; w.ok && i < slots; i++){
+            DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+            size_t key_size;
+            if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED && dmap_slot_key_on_heap(d, slot, &key_size)){
+                dmap_stream_write(&w, dmap_slot_key(d, slot, &key_size), key_size);
             }
-            else if(key_size <= 8){ // copy small keys directly to table
-                entry->key = 0;  // zero-out first
-                memcpy(&entry->key, key, key_size);
+        }
+    }
+    bool ok = dmap_stream_flush(&w);
+    dmap_mem_free(&d->options.allocator, w.buf, DMAP_STREAM_BUFFER);
+    return ok ? 0 : -1;
+}
+// reads n entries of the entry layout and inserts them DMAP_STREAM_BATCH at a time
+static DmapHdr *dmap_read_stream_entries(DmapHdr *d, DmapStreamBuf *r, const DmapStreamHeader *sh, size_t elem_size) {
+    const DmapAllocator *a = &d->options.allocator;
+    size_t key_size = sh->key_size > 0 ? (size_t)sh->key_size : 0;
+    size_t vals_bytes = DMAP_STREAM_BATCH * elem_size;
+    size_t keys_cap = DMAP_STREAM_BATCH * (d->is_string ? 64 : key_size); // string keys grow it as needed
+    char *vals = (char*)dmap_mem_alloc(a, vals_bytes, DMAP_ALIGNMENT);
+    char *keys = (char*)dmap_mem_alloc(a, MAX(keys_cap, (size_t)1), DMAP_ALIGNMENT);
+    size_t *key_offsets = (size_t*)dmap_mem_alloc(a, DMAP_STREAM_BATCH * sizeof(size_t) * 2, DMAP_ALIGNMENT);
+    void **key_ptrs = (void**)dmap_mem_alloc(a, DMAP_STREAM_BATCH * sizeof(void*), DMAP_ALIGNMENT);
+    r->ok = r->ok && vals && keys && key_offsets && key_ptrs;
+    size_t *key_sizes = key_offsets ? key_offsets + DMAP_STREAM_BATCH : NULL;
+    for(size_t base = 0; r->ok && base < sh->len; base += DMAP_STREAM_BATCH){
+        size_t count = MIN((size_t)DMAP_STREAM_BATCH, sh->len - base);
+        size_t used = 0;
+        for(size_t i = 0; r->ok && i < count; i++){
+            size_t len = key_size;
+            u32 len32 = 0;
+            if(d->is_string && dmap_stream_read(r, &len32, sizeof(len32))){
+                len = len32;
             }
-            else {
-                entry->ptr = dmap_dup_struct(key, key_size); // allocate copies > 8 bytes
-                if(!entry->ptr){
-                    dmap_error_handler("Error: dmap_dup_struct - malloc failed");
+            if(len > DMAP_STREAM_MAX_KEY){
+                r->ok = false;
+                break;
+            }
+            if(used + len > keys_cap){
+                size_t new_cap = MAX(keys_cap * 2, used + len);
+                char *grown = (char*)dmap_mem_realloc(a, keys, MAX(keys_cap, (size_t)1), new_cap);
+                if(!grown){
+                    r->ok = false;
+                    break;
                 }
+                keys = grown;
+                keys_cap = new_cap;
             }
+            dmap_stream_read(r, keys + used, len);
+            dmap_stream_read(r, vals + i * elem_size, elem_size);
+            key_offsets[i] = used;
+            key_sizes[i] = len;
+            used += len;
+        }
+        if(!r->ok) break;
+        if(d->is_string){
+            for(size_t i = 0; i < count; i++){ // pointers are only taken once the buffer has stopped moving
+                key_ptrs[i] = keys + key_offsets[i];
+            }
+            d = dmap_hdr(dmap_insert_many_internal(d, true, NULL, 0, key_ptrs, key_sizes, vals, elem_size, elem_size, count));
+        }
+        else {
+            d = dmap_hdr(dmap_insert_many_internal(d, false, keys, key_size, NULL, NULL, vals, elem_size, elem_size, count));
         }
     }
-    return;
+    dmap_mem_free(a, vals, vals_bytes);
+    dmap_mem_free(a, keys, MAX(keys_cap, (size_t)1));
+    dmap_mem_free(a, key_offsets, DMAP_STREAM_BATCH * sizeof(size_t) * 2);
+    dmap_mem_free(a, key_ptrs, DMAP_STREAM_BATCH * sizeof(void*));
+    return d;
 }
-
-void* dmap__getp(DmapHdr *d, void *key, size_t key_size){
-    if(d->key_size != (s32)key_size && d->key_size != -1){  // -1 indicates a string key
-        dmap_error_handler("Error: key is not the correct size");
+// the shipped table is checked before anything indexes with it: every live slot has to agree with its ctrl byte,
+// point at a distinct live data index and hold a key length that fits its layout, and the counts have to match the
+// header. Empty and deleted slots are cleared, so no garbage that came with them is ever read as a key
+static bool dmap_stream_table_ok(DmapHdr *d, const DmapStreamHeader *sh) {
+    u64 *seen = (u64*)dmap_mem_alloc(&d->options.allocator, dmap_occupied_bytes(sh->range), DMAP_ALIGNMENT);
+    if(!seen){
+        return false;
     }
-    size_t idx = dmap__get_entry_index(d, key, key_size);
-    if(idx == DMAP_INVALID) { 
-        return NULL; // entry is not found
+    memset(seen, 0, dmap_occupied_bytes(sh->range));
+    size_t live = 0, deleted = 0;
+    bool ok = true;
+    for(size_t i = 0; ok && i < sh->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        s32 idx = slot->data_idx;
+        if(idx == DMAP_EMPTY || idx == DMAP_DELETED){
+            ok = !d->ctrl || d->ctrl[i] == (idx == DMAP_EMPTY ? DMAP_CTRL_EMPTY : DMAP_CTRL_DELETED);
+            deleted += idx == DMAP_DELETED;
+            memset(slot, 0, d->slot_size);
+            slot->data_idx = idx;
+            continue;
+        }
+        size_t bit = (size_t)(u32)idx;
+        ok = bit < sh->range && (d->occupied[bit >> 6] & (1ull << (bit & 63))) && !(seen[bit >> 6] & (1ull << (bit & 63)))
+            && (!d->ctrl || !(d->ctrl[i] & 0x80));
+        if(ok && d->slot_kind == DMAP_SLOT_KSTR){
+            s32 kstr_len = ((DmapKstrSlot*)slot)->kstr_len;
+            ok = kstr_len >= 0 && (size_t)kstr_len <= DMAP_STREAM_MAX_KEY;
+        }
+        else if(ok && d->slot_kind == DMAP_SLOT_WIDE){
+            ok = ((DmapTable*)slot)->kstr_len == d->key_size;
+        }
+        if(ok){
+            seen[bit >> 6] |= 1ull << (bit & 63);
+            live++;
+        }
     }
-    return d->data + d->table[idx].data_idx * d->val_size;
+    dmap_mem_free(&d->options.allocator, seen, dmap_occupied_bytes(sh->range));
+    return ok && live == sh->len && deleted == sh->tombstones;
 }
-// returns: int - The index of the data associated with the key, or DMAP_INVALID (-1) if the key is not found
-s32 dmap__get_idx(DmapHdr *d, void *key, size_t key_size){
-    s32 idx = dmap__get_entry_index(d, key, key_size);
-    if(idx == DMAP_INVALID) {
-        return DMAP_INVALID;
+// reads a shipped table straight into a map laid out like the sender's
+static DmapHdr *dmap_read_stream_table(DmapHdr *d, DmapStreamBuf *r, const DmapStreamHeader *sh, size_t elem_size) {
+    if(sh->key_size > 0){
+        dmap_check_key_size(d, (size_t)sh->key_size); // picks the same slot layout
+    }
+    if(d->slot_kind != sh->slot_kind || (u32)d->slot_size != sh->slot_size || !sh->hash_cap || (sh->hash_cap & (sh->hash_cap - 1))
+        || sh->hash_cap > DMAP_MAX_HASH_CAP || sh->len > sh->range || sh->range > sh->cap || sh->tombstones >= sh->hash_cap
+        || (size_t)sh->len + sh->tombstones >= sh->hash_cap){ // linear probes need an empty slot to stop at
+        r->ok = false;
+        return d;
+    }
+    d->key_size = sh->key_size;
+    if(dmap_try_resize(&d, elem_size, sh->hash_cap, false) != DMAP_OK || (u32)d->cap != sh->cap){
+        r->ok = false;
+        return d;
+    }
+    dmap_stream_read(r, d->data, (size_t)sh->range * elem_size);
+    for(u32 i = 0; i < sh->range; i++){
+        dmap_occupied_set(d, i);
+    }
+    for(u32 i = sh->len; r->ok && i < sh->range; i++){
+        s32 idx;
+        if(dmap_stream_read(r, &idx, sizeof(idx))){
+            size_t bit = (size_t)(u32)idx;
+            r->ok = bit < sh->range && (d->occupied[bit >> 6] & (1ull << (bit & 63))); // in range and not freed twice
+        }
+        if(r->ok){
+            dmap_freelist_push(d, idx);
+            dmap_occupied_clear(d, (size_t)idx);
+        }
+    }
+    dmap_stream_read(r, d->table, (size_t)sh->hash_cap * d->slot_size);
+    if(d->ctrl){
+        dmap_stream_read(r, d->ctrl, sh->hash_cap);
+    }
+    r->ok = r->ok && dmap_stream_table_ok(d, sh);
+    if(!r->ok){ // drop whatever made it in, so freeing the map doesn't follow stale key pointers
+        dmap_table_clear(d, d->table, 0, d->hash_cap);
+        if(d->ctrl){
+            memset(d->ctrl, DMAP_CTRL_EMPTY, d->hash_cap);
+        }
+        return d;
+    }
+    d->len = (int)sh->len;
+    d->tombstones = (int)sh->tombstones;
+    d->hash_seed = sh->hash_seed;
+    for(size_t i = 0; i < sh->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        if(slot->data_idx != DMAP_EMPTY && slot->data_idx != DMAP_DELETED){
+            d->idx_hash[slot->data_idx] = slot->hash;
+        }
+    }
+    dmap_bloom_rebuild(d);
+    char small[256];
+    for(size_t i = 0; i < sh->hash_cap; i++){
+        DmapSlot *slot = DMAP_SLOT(d, d->table, i);
+        size_t key_size;
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED || !dmap_slot_key_on_heap(d, slot, &key_size)) continue;
+        char *kstr = NULL;
+        if(r->ok){ // key_size was bounded by dmap_stream_table_ok
+            char *tmp = key_size <= sizeof(small) ? small : (char*)dmap_mem_alloc(&d->options.allocator, key_size, DMAP_ALIGNMENT);
+            if(tmp && dmap_stream_read(r, tmp, key_size)){
+                kstr = (char*)dmap_copy_key(d, tmp, key_size);
+            }
+            if(tmp != small){
+                dmap_mem_free(&d->options.allocator, tmp, key_size);
+            }
+            r->ok = kstr != NULL;
+        }
+        if(!r->ok){ // leave the map freeable: this slot and every one after it has no heap copy
+            dmap_clear_slot(d, slot);
+            if(d->ctrl){
+                d->ctrl[i] = DMAP_CTRL_EMPTY;
+            }
+            continue;
+        }
+        if(d->slot_kind == DMAP_SLOT_KSTR){
+            dmap_kstr_slot_set_ptr((DmapKstrSlot*)slot, kstr);
+        }
+        else {
+            ((DmapTable*)slot)->ptr = kstr;
+        }
     }
-    return d->table[idx].data_idx;
+    return d;
 }
-
-    // returns the data index of the deleted entry. Caller may wish to mark data as invalid
-s32 dmap__delete(DmapHdr *d, void *key, size_t key_size){
-    s32 idx = dmap__get_entry_index(d, key, key_size);
-    if(idx == DMAP_INVALID) {
-        return DMAP_INVALID;
+void *dmap__read_stream(size_t elem_size, bool is_string, size_t (*read_fn)(void *ctx, void *buf, size_t len), void *ctx, DmapOptions options){
+    const DmapAllocator *a = options.allocator.alloc_fn ? &options.allocator : &dmap_default_allocator;
+    DmapStreamBuf r = {NULL, read_fn, ctx, NULL, 0, 0, true};
+    r.buf = (char*)dmap_mem_alloc(a, DMAP_STREAM_BUFFER, DMAP_ALIGNMENT);
+    if(!r.buf){
+        return NULL;
     }
-    s32 data_index = d->table[idx].data_idx;
-    dmap_freelist_push(d, data_index);
-    d->table[idx].data_idx = DMAP_DELETED;
-
-    if(!d->options.user_managed_keys && key_size > 8){ // dmap copies keys
-        free(d->table[idx].ptr);
-        d->table[idx].ptr = NULL;
+    DmapStreamHeader sh;
+    bool table = false;
+    bool ok = dmap_stream_read(&r, &sh, sizeof(sh));
+    if(ok){
+        table = (sh.flags & DMAP_STREAM_TABLE) != 0;
+        bool has_fn = options.hash_fn || options.seeded_hash_fn;
+        bool missing_fn = table && ((bool)(sh.flags & DMAP_SNAPSHOT_HASH_FN) != has_fn
+                                    || dmap_resolve_hash_engine((DmapHashEngine)sh.hash_engine) != (DmapHashEngine)sh.hash_engine);
+        ok = memcmp(sh.magic, DMAP_STREAM_MAGIC, sizeof(sh.magic)) == 0 && sh.version == DMAP_STREAM_VERSION
+            && sh.byte_order == 0x01020304 && sh.val_size == elem_size && (bool)sh.is_string == is_string
+            && !missing_fn && !options.user_managed_keys && !options.free_key_fn
+            && !(table && (options.cache_max_entries > 0 || options.cache_max_bytes > 0)) // a cache is sized by its options
+            && sh.len <= DMAP_MAX_CAPACITY && !(table && !(sh.load_factor > 0.0f && sh.load_factor <= DMAP_MAX_LOAD_FACTOR));
     }
-    else if(d->options.user_managed_keys && d->options.free_key_fn){ // user supplied free_key
-        d->options.free_key_fn(d->table[idx].ptr);
-        d->table[idx].ptr = NULL;
+    DmapHdr *d = NULL;
+    if(ok){
+        if(table){ // the sender's table layout wins
+            options.use_ctrl_bytes = sh.use_ctrl_bytes;
+            options.robin_hood = sh.robin_hood;
+            options.dense = sh.dense; // the data array may have holes otherwise
+            options.hash_engine = (DmapHashEngine)sh.hash_engine;
+            options.load_factor = sh.load_factor;
+            options.incremental_resize = options.incremental_resize && !sh.use_ctrl_bytes && !sh.robin_hood;
+            options.initial_capacity = 1;
+        }
+        else {
+            options.initial_capacity = MAX(options.initial_capacity, (int)sh.len);
+        }
+        ok = dmap_try_init_internal(elem_size, is_string, options, &d) == DMAP_OK; // sized from the header, which may lie
     }
-    else { // user managed 
-        d->table[idx].kstr = NULL;
+    if(ok){
+        d = table ? dmap_read_stream_table(d, &r, &sh, elem_size) : dmap_read_stream_entries(d, &r, &sh, elem_size);
+        ok = r.ok;
     }
-    d->len -= 1; 
-    return data_index;
+    dmap_mem_free(a, r.buf, DMAP_STREAM_BUFFER);
+    if(!ok){
+        dmap__free(d);
+        return NULL;
+    }
+    return d->data;
 }
-// len of the data array, including invalid table. For iterating
+
 s32 dmap__range(DmapHdr *d){ 
-    return d ? d->len + d->free_list->len : 0; 
+    return d ? d->len + (d->free_list ? d->free_list->len : 0) : 0; 
 } 
+int dmap__next_idx(DmapHdr *d, int idx){
+    size_t start = (size_t)(idx + 1);
+    size_t range = (size_t)dmap__range(d);
+    if(start >= range){
+        return DMAP_INVALID;
+    }
+    size_t word = start >> 6;
+    u64 bits = d->occupied[word] & (~0ull << (start & 63));
+    size_t last = (range - 1) >> 6;
+    while(!bits){ // 64 dead indices at a time
+        if(++word > last){
+            return DMAP_INVALID;
+        }
+        bits = d->occupied[word];
+    }
+    size_t next = (word << 6) + dmap_ctz64(bits);
+    return next < range ? (int)next : DMAP_INVALID;
+}
+bool dmap__iter_next(DmapHdr *d, DmapIter *it){
+    while(true){
+        size_t pos = (size_t)it->pos;
+        DmapSlot *slot = NULL;
+        if(pos < (size_t)d->hash_cap){
+            slot = DMAP_SLOT(d, d->table, pos);
+        }
+        else if(d->old_table && pos - d->hash_cap < (size_t)d->old_hash_cap){ // entries not moved by an incremental resize yet
+            slot = DMAP_SLOT(d, d->old_table, pos - d->hash_cap);
+        }
+        else {
+            return false;
+        }
+        it->pos++;
+        if(slot->data_idx == DMAP_EMPTY || slot->data_idx == DMAP_DELETED) continue;
+        it->idx = slot->data_idx;
+        it->key = dmap_slot_key(d, slot, &it->key_size);
+        return true;
+    }
+}
 
 // MARK: hash function:
 // - rapidhash source repository: https://github.com/Nicoshev/rapidhash
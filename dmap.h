@@ -2,6 +2,7 @@
 #define DMAP_H
 #include <stddef.h>
 #include <stdbool.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,12 +17,28 @@ extern "C" {
 #endif
 
 #ifndef DMAP_DEFAULT_MAX_SIZE
-    // 2GB for testing
+    // limit on the bytes of a map's header and data array, unless DmapOptions.max_size sets its own
     #define DMAP_DEFAULT_MAX_SIZE (1ULL << 31) 
 #endif // DMAP_DEFAULT_MAX_SIZE
 
+#ifdef __cplusplus
+    #define DMAP_ALIGNAS(n) alignas(n)
+#else
+    #define DMAP_ALIGNAS(n) _Alignas(n)
+#endif
+
 #define DMAP_INITIAL_CAPACITY 16
-#define DMAP_LOAD_FACTOR 0.5f
+#ifndef DMAP_LOAD_FACTOR
+    #define DMAP_LOAD_FACTOR 0.5f
+#endif
+#ifndef DMAP_CTRL_LOAD_FACTOR
+    // default load factor when control bytes are enabled; group probing stays short at much higher loads
+    #define DMAP_CTRL_LOAD_FACTOR 0.875f
+#endif
+#ifndef DMAP_ROBIN_HOOD_LOAD_FACTOR
+    // default load factor for robin hood maps; probe lengths stay bounded well past 0.5
+    #define DMAP_ROBIN_HOOD_LOAD_FACTOR 0.85f
+#endif
 
 typedef struct DmapFreeList {
     int *data;
@@ -29,34 +46,139 @@ typedef struct DmapFreeList {
     int cap;
 } DmapFreeList;
 
+// Allocator for everything dmap allocates itself: the header/data array, the table, the free list and key copies.
+// Sizes handed back to realloc_fn and free_fn are the sizes originally requested, so sized or arena allocators work.
+// Memory must be aligned to at least DMAP_ALIGNMENT; alloc_fn gets a larger alignment for the table if asked for.
+// realloc_fn may be NULL (alloc + copy + free). free_fn may be NULL for allocators that release everything at once.
+typedef struct DmapAllocator {
+    void *(*alloc_fn)(void *ctx, size_t size, size_t alignment);
+    void *(*realloc_fn)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free_fn)(void *ctx, void *ptr, size_t size);
+    void *ctx; // passed through to the functions above
+} DmapAllocator;
+
+#define DMAP_HUGE_PAGE_SIZE ((size_t)2 << 20) // tables at least this big go on huge pages with options.table_huge_pages
+
+// Hook for running dmap's internal work on several threads, e.g. a thread pool. run_fn must call task(arg, i) once
+// for every i in [0, num_tasks), in any order and on any threads, and return only once all of them have finished.
+// Used to rebuild large linear probing tables and to hash keys for large bulk inserts. Tasks don't allocate and
+// don't call back into the map, but they do call options.hash_fn, which then has to be thread safe.
+typedef struct DmapExecutor {
+    void (*run_fn)(void *ctx, int num_tasks, void (*task)(void *arg, int task_idx), void *arg);
+    void *ctx; // passed through to run_fn
+} DmapExecutor;
+
+// Built-in hash for keys that are strings or over 8 bytes (smaller keys always use the integer mixer below)
+typedef enum DmapHashEngine {
+    DMAP_HASH_AUTO = 0,  // DMAP_HASH_HARDWARE if the CPU supports it, rapidhash otherwise
+    DMAP_HASH_RAPIDHASH,
+    DMAP_HASH_CRC32C,    // CRC32C instructions (SSE4.2 / ARMv8 CRC), best for short keys
+    DMAP_HASH_AES,       // AES rounds (AES-NI / ARMv8 crypto), best for long keys
+    DMAP_HASH_HARDWARE,  // CRC32C for keys up to 16 bytes, AES above
+} DmapHashEngine;
+
 typedef struct DmapTable DmapTable;
+typedef struct DmapKeyArena DmapKeyArena;
+typedef struct DmapBloom DmapBloom;
+
+// filled by dmap_stats. The counters are only kept when built with DMAP_STATS defined, for dmap.c and every file
+// including dmap.h alike since it adds them to DmapHdr; they read zero otherwise. The rest is always filled in.
+typedef struct DmapStats {
+    unsigned long long lookups;     // dmap_get, dmap_getp, dmap_get_many and the like, one per key
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long probes;      // slots compared by those lookups (16-slot groups with ctrl bytes)
+    unsigned long long max_probe;   // longest single lookup
+    unsigned long long grows;       // times the map grew, or was rebuilt in place, because it was full
+    unsigned long long grow_ns;     // time spent doing so
+    unsigned long long key_bytes;   // bytes currently allocated for the keys dmap copies
+    unsigned long long filtered;    // misses the bloom filter answered without probing the table
+    int len;
+    int cap;
+    int hash_cap;
+    int tombstones;
+    int free_list_len;              // deleted data indices waiting to be reused
+} DmapStats;
 
 typedef struct DmapOptions {
-    void *(*data_allocator_fn)(void *hdr, size_t size); // custom allocator for the data array (default: realloc)
+    void *(*data_allocator_fn)(void *hdr, size_t size); // custom allocator for the data array (default: allocator below)
+    DmapAllocator allocator; // used for the map's own allocations (default: malloc/realloc/free)
+    size_t table_alignment;  // alignment of the table allocation, e.g. 64 to start it on a cache line (default: DMAP_ALIGNMENT)
     void (*free_key_fn)(void*);  // custom free function for keys
     unsigned long long (*hash_fn)(void *key, size_t len);
+    unsigned long long (*seeded_hash_fn)(const void *key, size_t len, unsigned long long seed); // like hash_fn, also passed the map's hash_seed
+    DmapHashEngine hash_engine; // built-in hash when neither function is set; an engine the CPU lacks falls back to rapidhash
     bool (*cmp_fn)(void *a, void *b, size_t len);
     int initial_capacity;  
+    float load_factor;       // fraction of table slots that may be used before growing (default: DMAP_LOAD_FACTOR, or the ctrl bytes / robin hood defaults)
     bool user_managed_keys;  // if true, the user manages string keys; otherwise, dmap copies and frees them on delete
+    bool use_ctrl_bytes;     // if true, keeps a separate 1-byte tag per table slot (swiss-table style) and probes 16 slots at a time
+    bool robin_hood;         // if true, uses robin hood insertion and backward-shift deletion - no tombstones (ignored with use_ctrl_bytes)
+    bool use_key_arena;      // if true, keys dmap copies to the heap are bump-allocated in large chunks owned by the map instead of one malloc each
+    bool incremental_resize; // if true, a grow moves entries to the new table a few at a time over the following operations instead of all at once (linear probing only)
+    bool table_huge_pages;   // if true, tables of DMAP_HUGE_PAGE_SIZE or more are backed by huge pages where the OS allows (linux: hugetlb or madvise)
+    bool dense;              // if true, deletes move the last value into the freed index so data[0, len) is exactly the live values. Indices are not stable
+    unsigned long long hash_seed; // seed for the default hash (default: random per map). Maps sharing a seed can share dmap_hash_key results
+    DmapExecutor executor;   // if set, rehashing (also when an insert clears tombstones at the same size) and bulk inserts of large maps are split into tasks run by executor.run_fn
+    int cache_max_entries;   // if > 0, a bounded cache: allocated once for this many entries, inserts into a full map evict one (CLOCK)
+    size_t cache_max_bytes;  // same as above, with the limit given as bytes of values (cache_max_bytes / sizeof value entries)
+    void (*evict_fn)(void *ctx, const void *key, size_t key_size, void *val); // called for each evicted entry, before it is removed
+    void *evict_ctx;         // passed through to evict_fn
+    int bloom_bits_per_key;  // if > 0, lookups check a blocked bloom filter with this many bits per entry of capacity first, so most misses read one cache line (10 rejects ~99%). Ignored with incremental_resize
+    size_t max_size;         // limit on the bytes of the header and data array, checked on every grow (default: DMAP_DEFAULT_MAX_SIZE). Either way the table is limited to 2^30 slots
 } DmapOptions;
 
 typedef struct DmapHdr {
-    DmapTable *table; // the actual hashtable - contains the hash and an index to data[] where the values are stored
+    void *table; // the actual hashtable - contains the hash and an index to data[] where the values are stored. Slot layout depends on the key type
+    unsigned char *ctrl; // control bytes, one per table slot - 7 bits of the hash or empty/deleted (NULL unless options.use_ctrl_bytes)
+    void *old_table; // table still being drained by an incremental resize (NULL unless options.incremental_resize and a resize is in progress)
     unsigned long long hash_seed;
     DmapFreeList *free_list; // array of indices to values stored in data[] that have been marked as deleted. 
+    DmapKeyArena *key_arena; // chunked storage for copied keys (NULL unless options.use_key_arena)
+    DmapBloom *bloom; // pre-filter checked before the table on lookups (NULL unless options.bloom_bits_per_key)
     DmapOptions options;
     int len; 
     int cap;
     int hash_cap;
+    int old_hash_cap; // slots in old_table
+    int migrate_pos; // old_table slots below this have been moved to table
+    void *next_table; // table for the next incremental resize, emptied ahead of time
+    int next_hash_cap;
+    int next_ready; // next_table slots below this are already empty
     int returned_idx; // stores an index, used internally by macros
+    bool returned_new; // whether the last insert added returned_idx rather than finding it
+    int tombstones; // table slots marked DMAP_DELETED; they count against the load factor until the table is rebuilt
     int key_size; // make sure key sizes are consistent
+    int slot_size; // bytes per table slot
+    unsigned char slot_kind; // table slot layout, picked on the first insert once the key size is known
+    bool int_fast; // DmapIntSlot layout with the default hash and compare, probed linearly: dmap_get/dmap_insert take the inline path
     int val_size;
     bool is_string;
-    _Alignas(DMAP_ALIGNMENT) char data[];  // aligned data array - where values are stored
+    void *snapshot; // file mapping behind a map opened with dmap_open_mmap (NULL otherwise); such maps are read-only
+    size_t snapshot_size;
+    unsigned long long *occupied; // one bit per data[] index, set while it holds a live value
+    unsigned int *idx_hash; // low hash bits of the entry at each data[] index, used to find its table slot (reverse index)
+    unsigned long long *referenced; // cache maps: one bit per data[] index, set by lookups (NULL otherwise)
+    int clock_hand; // cache maps: next data[] index the eviction sweep looks at
+    int evicted_idx; // data index of the entry evicted by the last dmap_insert, or DMAP_INVALID
+#ifdef DMAP_STATS
+    DmapStats stats; // counters only, see dmap_stats
+    unsigned int stats_probes; // probes of the lookup in progress
+    bool stats_off; // lookups aren't counted: concurrent maps are read from several threads at once
+#endif
+    size_t key_base; // added to the heap key pointers stored in the table; in a snapshot they are offsets into its key blob
+    DMAP_ALIGNAS(DMAP_ALIGNMENT) char data[];  // aligned data array - where values are stored
 } DmapHdr;
 
 #define DMAP_INVALID -1
 
+// returned by the try functions (dmap_try_insert, dmap_try_reserve); errors are negative
+#define DMAP_OK            0
+#define DMAP_ERR_NOMEM    -2 // an allocation failed
+#define DMAP_ERR_CAPACITY -3 // more entries than a table can index
+#define DMAP_ERR_MAX_SIZE -4 // the data array would be larger than options.max_size
+#define DMAP_ERR_READONLY -5 // the map was opened from a snapshot
+
 #if defined(__cplusplus)
     #define DMAP_TYPEOF(d) (decltype((d) + 0))
 #elif defined(__clang__) || defined(__GNUC__)  
@@ -70,14 +192,121 @@ typedef struct DmapHdr {
 int dmap__get_idx(DmapHdr *d, void *key, size_t key_size);
 int dmap__delete(DmapHdr *d, void *key, size_t key_size);
 void dmap__insert_entry(DmapHdr *d, void *key, size_t key_size);
+void dmap__insert_entry_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size);
+unsigned long long dmap__hash_key(DmapHdr *d, void *key, size_t key_size);
+int dmap__get_idx_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size);
+int dmap__delete_hashed(DmapHdr *d, unsigned long long hash, void *key, size_t key_size);
+bool dmap__get_or_insert(DmapHdr *d, void *key, size_t key_size, int *idx);
+void *dmap__insert_many(DmapHdr *d, const void *keys, size_t key_size, const void *vals, size_t val_size, size_t elem_size, size_t n);
+void *dmap__kstr_insert_many(DmapHdr *d, const void *keys, const size_t *key_sizes, const void *vals, size_t val_size, size_t elem_size, size_t n);
 void *dmap__getp(DmapHdr *d, void *key, size_t key_size);
+int dmap__get_many(DmapHdr *d, const void *keys, size_t key_size, size_t n, int *out);
+int dmap__kstr_get_many(DmapHdr *d, const void *keys, const size_t *key_sizes, size_t n, int *out);
 void *dmap__grow(DmapHdr *d, size_t elem_size) ;
 void *dmap__kstr_grow(DmapHdr *d, size_t elem_size);
 void *dmap__init(size_t elem_size, DmapOptions options);
 void *dmap__kstr_init(size_t elem_size, DmapOptions options);
 
+void *dmap__reserve(DmapHdr *d, size_t elem_size, size_t n);
+void *dmap__kstr_reserve(DmapHdr *d, size_t elem_size, size_t n);
+int dmap__try_init(size_t elem_size, bool is_string, DmapOptions options, void *map);
+int dmap__try_reserve(DmapHdr *d, size_t elem_size, size_t n, bool is_string, void *map);
+int dmap__try_insert(DmapHdr *d, void *key, size_t key_size, size_t elem_size, bool is_string, void *map);
+void *dmap__shrink_to_fit(DmapHdr *d);
+void dmap__compact(DmapHdr *d);
 void dmap__free(DmapHdr *d);
 
+///////////////////////
+// Inline paths for keys of up to 8 bytes, picked by dmap_get/dmap_getp/dmap_insert on sizeof(*(k)), which is a
+// constant, so everything else folds away. When the map qualifies (int_fast) the key is loaded as one 64-bit
+// integer, hashed with a fixed mixer and compared directly against the slots, with no call into dmap.c on a hit.
+// Anything else - another layout, a resize in progress, a snapshot for inserts - goes through the generic path.
+///////////////////////
+
+// compact table slot: non-string keys <= 8 bytes copied into the table. 16 bytes instead of 24
+typedef struct DmapIntSlot {
+    int data_idx;
+    unsigned int hash;
+    unsigned long long key;
+} DmapIntSlot;
+
+// table slot states, stored in data_idx
+#define DMAP_EMPTY   0x7fffffff
+#define DMAP_DELETED 0x7ffffffe
+
+// zero-extends a key of up to 8 bytes to the integer it is compared and hashed as
+static inline unsigned long long dmap__int_key(const void *k, size_t key_size) {
+    unsigned long long key = 0;
+    memcpy(&key, k, key_size);
+    return key;
+}
+// hash for keys of up to 8 bytes: the splitmix64 finalizer over the seeded key
+static inline unsigned long long dmap__int_hash(unsigned long long key, unsigned long long seed) {
+    key += seed;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+// data index of key in an int_fast map, or DMAP_INVALID. Linear scan up to an empty slot, which also finds
+// keys in robin hood tables
+static inline int dmap__int_find(const DmapHdr *d, unsigned long long key, unsigned long long hash) {
+    const DmapIntSlot *table = (const DmapIntSlot*)d->table;
+    size_t mask = (size_t)d->hash_cap - 1;
+    for(size_t i = (size_t)hash & mask;; i = (i + 1) & mask){
+        int data_idx = table[i].data_idx;
+        if(data_idx == DMAP_EMPTY){
+            return DMAP_INVALID;
+        }
+        if(table[i].key == key && data_idx != DMAP_DELETED){
+            return data_idx;
+        }
+    }
+}
+static inline bool dmap__int_fast(const DmapHdr *d, size_t key_size) {
+#ifdef DMAP_STATS
+    (void)d; (void)key_size;
+    return false; // lookups have to be counted
+#else
+    return key_size <= 8 && d->int_fast && !d->old_table && d->key_size == (int)key_size;
+#endif
+}
+static inline int dmap__fast_get_idx(DmapHdr *d, const void *k, size_t key_size) {
+    if(!dmap__int_fast(d, key_size)){
+        return dmap__get_idx(d, (void*)k, key_size);
+    }
+    unsigned long long key = dmap__int_key(k, key_size);
+    return dmap__int_find(d, key, dmap__int_hash(key, d->hash_seed));
+}
+static inline void *dmap__fast_getp(DmapHdr *d, const void *k, size_t key_size) {
+    if(!dmap__int_fast(d, key_size)){
+        return dmap__getp(d, (void*)k, key_size);
+    }
+    int idx = dmap__fast_get_idx(d, k, key_size);
+    return idx == DMAP_INVALID ? NULL : d->data + (size_t)idx * (size_t)d->val_size;
+}
+static inline int dmap__fast_get_idx_hashed(DmapHdr *d, unsigned long long hash, const void *k, size_t key_size) {
+    if(!dmap__int_fast(d, key_size)){
+        return dmap__get_idx_hashed(d, hash, (void*)k, key_size);
+    }
+    return dmap__int_find(d, dmap__int_key(k, key_size), hash);
+}
+// updates stay inline; new keys go to dmap.c with the hash already computed
+static inline void dmap__fast_insert(DmapHdr *d, const void *k, size_t key_size) {
+    if(!dmap__int_fast(d, key_size) || d->snapshot){
+        dmap__insert_entry(d, (void*)k, key_size);
+        return;
+    }
+    unsigned long long key = dmap__int_key(k, key_size);
+    unsigned long long hash = dmap__int_hash(key, d->hash_seed);
+    int idx = dmap__int_find(d, key, hash);
+    if(idx == DMAP_INVALID){
+        dmap__insert_entry_hashed(d, hash, (void*)k, key_size);
+        return;
+    }
+    d->returned_idx = idx;
+    d->returned_new = false;
+}
+
 ///////////////////////
 #define dmap_hdr(d) ((DmapHdr *)((char *)(d) - offsetof(DmapHdr, data)))
 #define dmap_count(d) ((d) ? dmap_hdr(d)->len : 0) // how many valid entries in the dicctionary; not for iterating directly over the data 
@@ -89,9 +318,10 @@ unsigned long long dmap_hash(void *key, size_t key_size);
 ////////////////////////////////////////////
 // allows macros to pass a value
 #define dmap__ret_idx(d) (dmap_hdr(d)->returned_idx) // DMAP_EMPTY by default
-// resize if n <= capacity
-#define dmap__fit(d, n) ((n) <= dmap_cap(d) ? 0 : ((d) = DMAP_TYPEOF(d) dmap__grow((d) ? dmap_hdr(d) : NULL, sizeof(*(d)))))
-#define dmap__kstr_fit(d, n) ((n) <= dmap_cap(d) ? 0 : ((d) = DMAP_TYPEOF(d) dmap__kstr_grow((d) ? dmap_hdr(d) : NULL, sizeof(*(d)))))
+#define dmap__tombstones(d) ((d) ? dmap_hdr(d)->tombstones : 0)
+// resize if n <= capacity; tombstones take up table slots too, dmap__grow rebuilds in place when they are the cause
+#define dmap__fit(d, n) ((n) + dmap__tombstones(d) <= dmap_cap(d) ? 0 : ((d) = DMAP_TYPEOF(d) dmap__grow((d) ? dmap_hdr(d) : NULL, sizeof(*(d)))))
+#define dmap__kstr_fit(d, n) ((n) + dmap__tombstones(d) <= dmap_cap(d) ? 0 : ((d) = DMAP_TYPEOF(d) dmap__kstr_grow((d) ? dmap_hdr(d) : NULL, sizeof(*(d)))))
 ////////////////////////////////////////////
 
 // dmap_init(d, DmapOptions opts)
@@ -105,34 +335,271 @@ unsigned long long dmap_hash(void *key, size_t key_size);
 // - 'd' is the hashmap from which to retrieve the value, effectively an array of v's.
 // - 'k' key for the value. Keys can be any type 1,2,4,8 bytes; use dmap_kstr_insert for strings and non-builtin types
 // - 'v' value -> VAR_ARGS to allow for direct struct initialization: dmap_kstr_insert(d, k, key_size, (MyType){2,33});
-#define dmap_insert(d, k, ...) (dmap__fit((d), dmap_count(d) + 1), dmap__insert_entry(dmap_hdr(d), (k), sizeof(*(k))), ((d)[dmap__ret_idx(d)] = (__VA_ARGS__)), dmap__ret_idx(d)) 
+#define dmap_insert(d, k, ...) (dmap__fit((d), dmap_count(d) + 1), dmap__fast_insert(dmap_hdr(d), (k), sizeof(*(k))), ((d)[dmap__ret_idx(d)] = (__VA_ARGS__)), dmap__ret_idx(d)) 
 // same as above but uses a string as key values
 #define dmap_kstr_insert(d, k, key_size, ...) (dmap__kstr_fit((d), dmap_count(d) + 1), dmap__insert_entry(dmap_hdr(d), (k), (key_size)), ((d)[dmap__ret_idx(d)] = (__VA_ARGS__)), dmap__ret_idx(d)) 
 
+// inserts or updates n keys at once, keys[i] -> vals[i]; vals is an array of n values of the map's type.
+// The map is sized for all of them up front, so it rehashes at most once. Same result as n calls to dmap_insert.
+#define dmap_insert_many(d, keys, vals, n) ((d) = DMAP_TYPEOF(d) dmap__insert_many((d) ? dmap_hdr(d) : NULL, (keys), sizeof(*(keys)), (vals), sizeof(*(vals)), sizeof(*(d)), (n)))
+// same as above for string keys; keys is an array of n pointers to the keys, key_sizes their lengths
+#define dmap_kstr_insert_many(d, keys, key_sizes, vals, n) ((d) = DMAP_TYPEOF(d) dmap__kstr_insert_many((d) ? dmap_hdr(d) : NULL, (keys), (key_sizes), (vals), sizeof(*(vals)), sizeof(*(d)), (n)))
+
 // returns index to data or -1 / DMAP_INVALID; indices are always stable
 // index can then be used to retrieve the value: d[idx]
-#define dmap_get(d,k) ((d) ? dmap__get_idx(dmap_hdr(d), (k), sizeof(*(k))) : -1) 
+#define dmap_get(d,k) ((d) ? dmap__fast_get_idx(dmap_hdr(d), (k), sizeof(*(k))) : -1) 
 // same as dmap_get but for keys that are strings. 
 #define dmap_kstr_get(d, k, key_size)((d) ? dmap__get_idx(dmap_hdr(d), (k), (key_size)) : -1)
 
+// looks up n keys at once, writing the data index of each (or DMAP_INVALID) to out[i]; returns how many were found.
+// keys is an array of n keys. Keys are hashed and prefetched in batches, so cache misses overlap on large maps.
+#define dmap_get_many(d, keys, n, out) dmap__get_many((d) ? dmap_hdr(d) : NULL, (keys), sizeof(*(keys)), (n), (out))
+// same as dmap_get_many for string keys; keys is an array of n pointers to the keys, key_sizes their lengths
+#define dmap_kstr_get_many(d, keys, key_sizes, n, out) dmap__kstr_get_many((d) ? dmap_hdr(d) : NULL, (keys), (key_sizes), (n), (out))
+
 // Returns: A pointer to the value corresponding to 'k' in 'd', or NULL if the key is not found. 
-#define dmap_getp(d, k) ((d) ? DMAP_TYPEOF(d) dmap__getp(dmap_hdr(d), (k), sizeof(*(k))) : NULL)
+#define dmap_getp(d, k) ((d) ? DMAP_TYPEOF(d) dmap__fast_getp(dmap_hdr(d), (k), sizeof(*(k))) : NULL)
 // Returns: A pointer to the value corresponding to 'k' in 'd', or NULL if the key is not found.
 #define dmap_kstr_getp(d, k, key_size) ((d) ? DMAP_TYPEOF(d) dmap__getp(dmap_hdr(d), (k), (key_size)) : NULL)
 
 // returns the data index of the deleted item or -1 / DMAP_INVALID (SIZE_MAX). 
-// The user should mark deleted data as invalid if the user intends to iterate over the data array.
+// Deleted indices are skipped by dmap_foreach and dmap_is_live, so iterating needs no sentinel values.
 #define dmap_kstr_delete(d, k, len)((d) ? dmap__delete(dmap_hdr(d), (k), (len)) : -1)
 
 #define dmap_delete(d,k) ((d) ? dmap__delete(dmap_hdr(d), (k), sizeof(*(k))) : -1) 
 // returns index to deleted data or -1 / DMAP_INVALID
 
+// Hash once: dmap_hash_key hashes a key for d (its hash_fn or seed), and the _h variants take that hash instead
+// of hashing again. A hash is only valid for maps sharing the seed (DmapOptions.hash_seed) and hash_fn; d has
+// to be initialized first. With DMAP_DEBUG, a hash that doesn't match the key asserts.
+#define dmap_hash_key(d, k) dmap__hash_key(dmap_hdr(d), (k), sizeof(*(k)))
+#define dmap_kstr_hash_key(d, k, key_size) dmap__hash_key(dmap_hdr(d), (k), (key_size))
+#define dmap_get_h(d, k, h) ((d) ? dmap__fast_get_idx_hashed(dmap_hdr(d), (h), (k), sizeof(*(k))) : -1)
+#define dmap_kstr_get_h(d, k, key_size, h) ((d) ? dmap__get_idx_hashed(dmap_hdr(d), (h), (k), (key_size)) : -1)
+#define dmap_insert_h(d, k, h, ...) (dmap__fit((d), dmap_count(d) + 1), dmap__insert_entry_hashed(dmap_hdr(d), (h), (k), sizeof(*(k))), ((d)[dmap__ret_idx(d)] = (__VA_ARGS__)), dmap__ret_idx(d))
+#define dmap_kstr_insert_h(d, k, key_size, h, ...) (dmap__kstr_fit((d), dmap_count(d) + 1), dmap__insert_entry_hashed(dmap_hdr(d), (h), (k), (key_size)), ((d)[dmap__ret_idx(d)] = (__VA_ARGS__)), dmap__ret_idx(d))
+#define dmap_delete_h(d, k, h) ((d) ? dmap__delete_hashed(dmap_hdr(d), (h), (k), sizeof(*(k))) : -1)
+#define dmap_kstr_delete_h(d, k, key_size, h) ((d) ? dmap__delete_hashed(dmap_hdr(d), (h), (k), (key_size)) : -1)
+
+// finds k, inserting it with a zeroed value if it isn't there, in a single probe. Returns true if k was already
+// in the map; either way *idx_out (if not NULL) is its data index.
+// ex: int i; if(!dmap_get_or_insert(d, &k, &i)) { d[i] = make_value(); } d[i].hits++;
+#define dmap_get_or_insert(d, k, idx_out) (dmap__fit((d), dmap_count(d) + 1), dmap__get_or_insert(dmap_hdr(d), (k), sizeof(*(k)), (idx_out)))
+#define dmap_kstr_get_or_insert(d, k, key_size, idx_out) (dmap__kstr_fit((d), dmap_count(d) + 1), dmap__get_or_insert(dmap_hdr(d), (k), (key_size), (idx_out)))
+
+// cache maps: data index of the entry the last dmap_insert evicted to make room, or -1 / DMAP_INVALID. The new
+// value is stored there (in dense mode, the value that was last is), so release resources through evict_fn
+#define dmap_evicted(d) ((d) ? dmap_hdr(d)->evicted_idx : -1)
 
 #define dmap_free(d) ((d) ? (dmap__free(dmap_hdr(d)), (d) = NULL, 1) : 0)
 
+// rebuilds the table in place, dropping the tombstones left behind by deletes. The table is never reallocated, even
+// with an executor; only maps with a key arena allocate, one chunk that their live keys are repacked into. Indices are unchanged.
+#define dmap_compact(d) ((d) ? dmap__compact(dmap_hdr(d)) : (void)0)
+
+// makes room for at least n entries with a single reallocation and rehash. Never shrinks; indices are unchanged.
+#define dmap_reserve(d, n) ((d) = DMAP_TYPEOF(d) dmap__reserve((d) ? dmap_hdr(d) : NULL, sizeof(*(d)), (n)))
+#define dmap_kstr_reserve(d, n) ((d) = DMAP_TYPEOF(d) dmap__kstr_reserve((d) ? dmap_hdr(d) : NULL, sizeof(*(d)), (n)))
+
+// Errors: the functions above report running out of memory or past a limit through the error handler (see
+// dmap_set_error_handler), which exits by default. If a handler returns, the call that failed isn't safe to 
+// continue. The try variants return the error instead and leave the map's entries as they were, so the caller 
+// can recover: dmap_try_insert returns the data index like dmap_insert or a DMAP_ERR_ code (< 0), and 
+// dmap_try_init / dmap_try_reserve return DMAP_OK or an error. d may be NULL as usual.
+// ex: int idx = dmap_try_insert(d, &k, v); if(idx < 0) { log(dmap_error_str(idx)); /* shed load */ }
+#define dmap__try_err(d) ((d) ? dmap__ret_idx(d) : DMAP_ERR_NOMEM) // a NULL map is only left NULL if it couldn't be allocated
+#define dmap_try_insert(d, k, ...) (dmap__try_insert((d) ? dmap_hdr(d) : NULL, (k), sizeof(*(k)), sizeof(*(d)), false, &(d)) ? dmap__try_err(d) : ((d)[dmap__ret_idx(d)] = (__VA_ARGS__), dmap__ret_idx(d)))
+#define dmap_kstr_try_insert(d, k, key_size, ...) (dmap__try_insert((d) ? dmap_hdr(d) : NULL, (k), (key_size), sizeof(*(d)), true, &(d)) ? dmap__try_err(d) : ((d)[dmap__ret_idx(d)] = (__VA_ARGS__), dmap__ret_idx(d)))
+#define dmap_try_init(d, ...) dmap__try_init(sizeof(*(d)), false, __VA_ARGS__, &(d))
+#define dmap_kstr_try_init(d, ...) dmap__try_init(sizeof(*(d)), true, __VA_ARGS__, &(d))
+#define dmap_try_reserve(d, n) dmap__try_reserve((d) ? dmap_hdr(d) : NULL, sizeof(*(d)), (n), false, &(d))
+#define dmap_kstr_try_reserve(d, n) dmap__try_reserve((d) ? dmap_hdr(d) : NULL, sizeof(*(d)), (n), true, &(d))
+
+void dmap_set_error_handler(void (*handler)(char* err_msg)); // NULL restores the default, which prints err_msg and exits
+const char *dmap_error_str(int err); // message for a DMAP_ERR_ code
+
+// reallocates the data array and table down to the smallest size that holds the current entries.
+// Values stored at index dmap_count(d) or higher are moved down into free slots, so indices obtained before may change.
+// Afterwards data[0, dmap_count(d)) holds exactly the live values.
+#define dmap_shrink_to_fit(d) ((d) ? ((d) = DMAP_TYPEOF(d) dmap__shrink_to_fit(dmap_hdr(d))) : NULL)
+
+// returns a copy of d, or NULL if out of memory. Indices, iteration order and options carry over, and the two
+// maps are independent afterwards. Key arena chunks are shared rather than copied, which makes cloning maps with
+// use_key_arena a few flat copies; other heap keys are copied into an arena the clone gets. User managed keys
+// are shared, so they must outlive the clone, and only d calls free_key_fn. A clone of a snapshot is writable.
+// ex: MyType *view = dmap_clone(d); /* go on modifying d while view stays as it was */
+void *dmap__clone(DmapHdr *d);
+#define dmap_clone(d) ((d) ? DMAP_TYPEOF(d) dmap__clone(dmap_hdr(d)) : NULL)
+
+// Snapshots: dmap_save writes the map to a file that dmap_open_mmap maps back in without rehashing or copying.
+// An opened map is read-only: lookups and iteration work as usual, anything that would insert, delete or resize
+// reports an error. dmap_open_mmap_cow also lets values be modified in place; changes are private to the process.
+// Maps with a custom hash_fn or cmp_fn need them passed back in the options. dmap_free unmaps the file.
+int dmap__save(DmapHdr *d, const char *path); // returns 0, or -1 if the file couldn't be written or keys are user managed
+void *dmap__open_mmap(const char *path, bool writable, DmapOptions options); // NULL if the file can't be opened or doesn't match this build
+
+#define dmap_save(d, path) ((d) ? dmap__save(dmap_hdr(d), (path)) : -1)
+// ex: MyType *d = NULL; dmap_open_mmap(d, "map.bin", (DmapOptions){0}); if(!d) { /* rebuild */ }
+#define dmap_open_mmap(d, path, ...) ((d) = DMAP_TYPEOF(d) dmap__open_mmap((path), false, __VA_ARGS__))
+#define dmap_open_mmap_cow(d, path, ...) ((d) = DMAP_TYPEOF(d) dmap__open_mmap((path), true, __VA_ARGS__))
+
+// Streaming: dmap_write_stream serializes the map through write_fn (which returns the bytes it wrote), buffering
+// a bounded amount. dmap_read_stream builds a new map from read_fn (which returns the bytes it read, 0 at the end or
+// on error), or sets d to NULL if the stream is truncated, malformed or doesn't match the map type. Everything read is
+// checked before it is used, so streams from other machines can't make the reader index out of bounds; keys over
+// 16MB are rejected.
+// By default the live entries are sent and rehashed by the reader; indices aren't kept. With ship_table the table
+// is sent as-is instead and nothing is rehashed, keeping indices and the hash seed. That needs the same build on both
+// ends, and the same custom hash_fn if there is one. Keys must be copied by dmap on both ends.
+int dmap__write_stream(DmapHdr *d, size_t (*write_fn)(void *ctx, const void *buf, size_t len), void *ctx, bool ship_table); // 0 or -1
+void *dmap__read_stream(size_t elem_size, bool is_string, size_t (*read_fn)(void *ctx, void *buf, size_t len), void *ctx, DmapOptions options);
+
+#define dmap_write_stream(d, write_fn, ctx, ship_table) ((d) ? dmap__write_stream(dmap_hdr(d), (write_fn), (ctx), (ship_table)) : -1)
+// ex: MyType *d = NULL; dmap_read_stream(d, my_read, sock, (DmapOptions){0}); 
+#define dmap_read_stream(d, read_fn, ctx, ...) ((d) = DMAP_TYPEOF(d) dmap__read_stream(sizeof(*(d)), false, (read_fn), (ctx), __VA_ARGS__))
+#define dmap_kstr_read_stream(d, read_fn, ctx, ...) ((d) = DMAP_TYPEOF(d) dmap__read_stream(sizeof(*(d)), true, (read_fn), (ctx), __VA_ARGS__))
+
+// Statistics: see DmapStats. dmap_probe_histogram walks the table and counts live entries by how far they sit
+// from their home position: hist[i] for i extra probes (slots, or groups with ctrl bytes), with everything at
+// n - 1 or further in hist[n - 1]. It works without DMAP_STATS and returns the longest distance found.
+void dmap__stats(DmapHdr *d, DmapStats *out);
+void dmap__stats_reset(DmapHdr *d);
+int dmap__probe_histogram(DmapHdr *d, size_t *hist, size_t n);
+#define dmap_stats(d, out) dmap__stats((d) ? dmap_hdr(d) : NULL, (out))
+#define dmap_stats_reset(d) ((d) ? dmap__stats_reset(dmap_hdr(d)) : (void)0)
+#define dmap_probe_histogram(d, hist, n) dmap__probe_histogram((d) ? dmap_hdr(d) : NULL, (hist), (n))
+
 // for iterating directly over the entire data array, including items marked as deleted
 int dmap__range(DmapHdr *d); 
 #define dmap_range(d)(dmap__range((d) ? dmap_hdr(d) : NULL))
+// true if data index i holds a live value (i < dmap_range(d))
+#define dmap_is_live(d, i) ((d) && ((dmap_hdr(d)->occupied[(size_t)(i) >> 6] >> ((size_t)(i) & 63)) & 1))
+
+// key of the live entry at data index i, or NULL; expected O(1), one probe sequence with no key compares. Points
+// into the map, so it is only valid until the next insert or delete. For string keys the size is written to
+// *key_size (not NUL terminated)
+const void *dmap__key_at(DmapHdr *d, int idx, size_t *key_size);
+#define dmap_key_at(d, i) ((d) ? dmap__key_at(dmap_hdr(d), (i), NULL) : NULL)
+#define dmap_kstr_key_at(d, i, key_size) ((d) ? dmap__key_at(dmap_hdr(d), (i), (key_size)) : NULL)
+
+// Iteration over live entries only, no sentinel values needed. Inserting or deleting while iterating isn't supported.
+typedef struct DmapIter {
+    const void *key; // the entry's key as stored: not NUL terminated for strings
+    size_t key_size;
+    int idx;         // the entry's index into the data array
+    int pos;         // internal
+} DmapIter;
+
+int dmap__next_idx(DmapHdr *d, int idx); // next live index after idx, or DMAP_INVALID
+bool dmap__iter_next(DmapHdr *d, DmapIter *it);
+
+// visits the index of every live value in data order, skipping dead indices 64 at a time
+// ex: dmap_foreach(d, i) { use(d[i]); }
+#define dmap_foreach(d, i) for(int i = (d) ? dmap__next_idx(dmap_hdr(d), -1) : DMAP_INVALID; i != DMAP_INVALID; i = dmap__next_idx(dmap_hdr(d), i))
+// visits every live entry with its key, in table order
+// ex: dmap_foreach_entry(d, it) { use(it.key, it.key_size, d[it.idx]); }
+#define dmap_foreach_entry(d, it) for(DmapIter it = {0}; (d) && dmap__iter_next(dmap_hdr(d), &it); )
+
+///////////////////////
+// Concurrent read-mostly map (needs C11 atomics). Any number of threads may read while writers are serialized
+// internally; lookups are wait-free. Keeps two copies of the map, so it uses twice the memory of a dmap.
+// Values are copied out, since a pointer into the map could be invalidated by the next write.
+///////////////////////
+typedef struct DmapConcurrent DmapConcurrent;
+
+DmapConcurrent *dmap__concurrent_new(size_t val_size, bool is_string, DmapOptions options);
+int dmap__concurrent_insert(DmapConcurrent *c, void *key, size_t key_size, const void *val, size_t val_size);
+int dmap__concurrent_delete(DmapConcurrent *c, void *key, size_t key_size);
+bool dmap__concurrent_get(DmapConcurrent *c, void *key, size_t key_size, void *val_out);
+int dmap_concurrent_count(DmapConcurrent *c);
+void dmap_concurrent_free(DmapConcurrent *c);
+
+// ex: DmapConcurrent *c = dmap_concurrent_new(MyType, (DmapOptions){0});
+#define dmap_concurrent_new(type, ...) dmap__concurrent_new(sizeof(type), false, __VA_ARGS__)
+#define dmap_kstr_concurrent_new(type, ...) dmap__concurrent_new(sizeof(type), true, __VA_ARGS__)
+// insert or update; 'v' points to the value. Returns the data index, the same in both copies
+#define dmap_concurrent_insert(c, k, v) dmap__concurrent_insert((c), (k), sizeof(*(k)), (v), sizeof(*(v)))
+#define dmap_kstr_concurrent_insert(c, k, key_size, v) dmap__concurrent_insert((c), (k), (key_size), (v), sizeof(*(v)))
+// returns the data index of the deleted entry or DMAP_INVALID
+#define dmap_concurrent_delete(c, k) dmap__concurrent_delete((c), (k), sizeof(*(k)))
+#define dmap_kstr_concurrent_delete(c, k, key_size) dmap__concurrent_delete((c), (k), (key_size))
+// copies the value for 'k' to *out (if out is not NULL); returns false if the key is not found. Safe from any thread
+#define dmap_concurrent_get(c, k, out) dmap__concurrent_get((c), (k), sizeof(*(k)), (out))
+#define dmap_kstr_concurrent_get(c, k, key_size, out) dmap__concurrent_get((c), (k), (key_size), (out))
+
+///////////////////////
+// Sharded map for multiple writers (needs C11 atomics): independent dmaps behind a lock each, picked by a fold of the hash.
+// Keys are hashed once. Returned indices encode the shard and stay stable; read a value back with dmap_sharded_read.
+///////////////////////
+typedef struct DmapSharded DmapSharded;
+
+DmapSharded *dmap__sharded_new(size_t val_size, bool is_string, int num_shards, DmapOptions options);
+int dmap__sharded_insert(DmapSharded *s, void *key, size_t key_size, const void *val, size_t val_size);
+int dmap__sharded_get(DmapSharded *s, void *key, size_t key_size, void *val_out);
+int dmap__sharded_delete(DmapSharded *s, void *key, size_t key_size);
+bool dmap_sharded_read(DmapSharded *s, int idx, void *val_out); // copies the value at idx; false if idx is out of range or its entry was deleted
+int dmap_sharded_count(DmapSharded *s);
+void dmap_sharded_free(DmapSharded *s);
+
+// ex: DmapSharded *s = dmap_sharded_new(MyType, 16, (DmapOptions){0}); num_shards is rounded up to a power of 2
+#define dmap_sharded_new(type, num_shards, ...) dmap__sharded_new(sizeof(type), false, (num_shards), __VA_ARGS__)
+#define dmap_kstr_sharded_new(type, num_shards, ...) dmap__sharded_new(sizeof(type), true, (num_shards), __VA_ARGS__)
+// insert or update; 'v' points to the value. Returns the index, or DMAP_INVALID if the shard is full and the error handler returns
+#define dmap_sharded_insert(s, k, v) dmap__sharded_insert((s), (k), sizeof(*(k)), (v), sizeof(*(v)))
+#define dmap_kstr_sharded_insert(s, k, key_size, v) dmap__sharded_insert((s), (k), (key_size), (v), sizeof(*(v)))
+// returns the index or DMAP_INVALID, and copies the value to *out if out is not NULL
+#define dmap_sharded_get(s, k, out) dmap__sharded_get((s), (k), sizeof(*(k)), (out))
+#define dmap_kstr_sharded_get(s, k, key_size, out) dmap__sharded_get((s), (k), (key_size), (out))
+// returns the index of the deleted entry or DMAP_INVALID
+#define dmap_sharded_delete(s, k) dmap__sharded_delete((s), (k), sizeof(*(k)))
+#define dmap_kstr_sharded_delete(s, k, key_size) dmap__sharded_delete((s), (k), (key_size))
+
+///////////////////////
+// Sets: keys only. The table is all there is - no data array, data indices or free list - and it probes
+// with ctrl bytes, like DmapOptions.use_ctrl_bytes maps. Keys are copied into the set. A fixed size key takes
+// its own size per slot plus a ctrl byte, a string key 16 bytes plus a ctrl byte, and keys over 8 bytes are
+// copied to the heap (or to the key arena with .use_key_arena).
+// Of DmapOptions, sets use allocator, hash_fn, seeded_hash_fn, hash_engine, hash_seed, cmp_fn,
+// initial_capacity, load_factor (default: DMAP_CTRL_LOAD_FACTOR) and use_key_arena.
+///////////////////////
+typedef struct DmapSet DmapSet;
+
+typedef struct DmapSetIter {
+    const void *key; // the key as stored: not NUL terminated for strings
+    size_t key_size;
+    size_t pos;      // internal
+} DmapSetIter;
+
+DmapSet *dmap__set_new(bool is_string, DmapOptions options);
+bool dmap__set_insert(DmapSet *s, const void *key, size_t key_size);
+bool dmap__set_contains(const DmapSet *s, const void *key, size_t key_size);
+bool dmap__set_delete(DmapSet *s, const void *key, size_t key_size);
+size_t dmap_set_count(const DmapSet *s);
+void dmap_set_reserve(DmapSet *s, size_t n); // room for n keys without a rebuild
+void dmap_set_clear(DmapSet *s);             // removes every key, the table is kept
+void dmap_set_free(DmapSet *s);
+bool dmap_set_iter_next(const DmapSet *s, DmapSetIter *it);
+// Set algebra, in place on dst. Both sets need the same kind of keys. They work table to table: when both
+// sets hash alike (same hash function and hash_seed) the hash of every string key is taken from its slot
+// instead of being computed again, and a union into an empty set copies the whole table.
+void dmap_set_union(DmapSet *dst, const DmapSet *src);      // adds the keys of src
+void dmap_set_intersect(DmapSet *dst, const DmapSet *src);  // keeps only the keys also in src
+void dmap_set_difference(DmapSet *dst, const DmapSet *src); // removes the keys in src
+
+// ex: DmapSet *seen = dmap_set_new((DmapOptions){0});
+#define dmap_set_new(...) dmap__set_new(false, __VA_ARGS__)
+#define dmap_kstr_set_new(...) dmap__set_new(true, __VA_ARGS__)
+// returns true if k was added, false if it was already in the set
+#define dmap_set_insert(s, k) dmap__set_insert((s), (k), sizeof(*(k)))
+#define dmap_kstr_set_insert(s, k, key_size) dmap__set_insert((s), (k), (key_size))
+#define dmap_set_contains(s, k) dmap__set_contains((s), (k), sizeof(*(k)))
+#define dmap_kstr_set_contains(s, k, key_size) dmap__set_contains((s), (k), (key_size))
+// returns true if k was in the set
+#define dmap_set_delete(s, k) dmap__set_delete((s), (k), sizeof(*(k)))
+#define dmap_kstr_set_delete(s, k, key_size) dmap__set_delete((s), (k), (key_size))
+// visits every key, in table order. Inserting or deleting while iterating isn't supported
+// ex: dmap_set_foreach(seen, it) { use(*(const int*)it.key); }
+#define dmap_set_foreach(s, it) for(DmapSetIter it = {0}; (s) && dmap_set_iter_next((s), &it); )
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,389 @@
+#ifndef DMAP_HPP
+#define DMAP_HPP
+// C++17 interface to dmap, header only; link dmap.c as usual.
+//
+// dmap::map<K, V> keeps its values as real objects in the data array. They are constructed in place, moved to the
+// new array when the map grows (rather than realloc'd), and destroyed on erase. Keys are stored by the core:
+// std::string keys as their bytes, looked up by std::string_view without building a string; any other key type
+// has to be trivially copyable, and is hashed and compared as bytes unless Hash / Eq say otherwise.
+//
+// ex: dmap::map<std::string, std::vector<int>> m;
+//     m.try_emplace("ids", 3, 0);             // constructs the vector in place
+//     if(auto it = m.find(some_string_view); it != m.end()) { it->second.push_back(1); }
+//     for(auto [key, ids] : m) { ... }        // key is a std::string_view, ids a std::vector<int>&
+//
+// Iterators visit live entries in data order and give pairs of (key, value reference). Inserts invalidate them,
+// erasing only invalidates iterators to the erased entry.
+#include "dmap.h"
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace dmap {
+
+// the default Hash and Eq: dmap's own hash (with the inline path for keys of up to 8 bytes) and a bytewise compare
+template<typename K> struct hash {};
+template<typename K> struct equal_to {};
+
+template<typename K, typename V, typename Hash = dmap::hash<K>, typename Eq = dmap::equal_to<K>>
+class map {
+    static constexpr bool string_keys = std::is_same_v<K, std::string>;
+    static constexpr bool builtin_hash = std::is_same_v<Hash, dmap::hash<K>>;
+    static constexpr bool builtin_eq = std::is_same_v<Eq, dmap::equal_to<K>>;
+
+    static_assert(string_keys || std::is_trivially_copyable_v<K>, "keys must be std::string or trivially copyable");
+    static_assert(string_keys || alignof(K) <= 8, "keys are stored in table slots or heap copies aligned to 8 bytes");
+    static_assert(alignof(V) <= DMAP_ALIGNMENT, "values are stored in the data array, aligned to DMAP_ALIGNMENT");
+    static_assert(std::is_nothrow_move_constructible_v<V>, "values are moved from inside dmap.c when the map grows, which can't unwind");
+    static_assert(std::is_empty_v<Hash> && std::is_empty_v<Eq>, "Hash and Eq are called through plain function pointers, so they can't hold state");
+
+public:
+    using key_type = K;
+    using mapped_type = V;
+    using size_type = std::size_t;
+    using difference_type = std::ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = Eq;
+    // what lookups take and iterators give back as the key
+    using key_arg = std::conditional_t<string_keys, std::string_view, const K &>;
+
+    template<bool Const>
+    class basic_iterator {
+        using map_ptr = std::conditional_t<Const, const map *, map *>;
+        using value_ref = std::conditional_t<Const, const V &, V &>;
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::pair<key_arg, value_ref>;
+        using reference = value_type; // a pair of references, made on the fly
+        using difference_type = std::ptrdiff_t;
+        struct pointer {
+            value_type entry;
+            const value_type *operator->() const { return &entry; }
+        };
+
+        basic_iterator() = default;
+        template<bool WasConst, typename = std::enable_if_t<Const && !WasConst>>
+        basic_iterator(const basic_iterator<WasConst> &it) : m_(it.m_), idx_(it.idx_) {}
+
+        reference operator*() const { return {m_->key_at(idx_), m_->value_at(idx_)}; }
+        pointer operator->() const { return {**this}; }
+        basic_iterator &operator++() {
+            idx_ = dmap__next_idx(m_->hdr(), idx_);
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator it = *this;
+            ++*this;
+            return it;
+        }
+        // the entry's data index, as returned by the C API
+        int index() const { return idx_; }
+        friend bool operator==(const basic_iterator &a, const basic_iterator &b) { return a.idx_ == b.idx_; }
+        friend bool operator!=(const basic_iterator &a, const basic_iterator &b) { return a.idx_ != b.idx_; }
+
+    private:
+        friend class map;
+        basic_iterator(map_ptr m, int idx) : m_(m), idx_(idx) {}
+        map_ptr m_ = nullptr;
+        int idx_ = DMAP_INVALID;
+    };
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    map() : map(DmapOptions{}) {}
+    // options work as in the C API, except those that would move or drop values behind the map's back: dense,
+    // the cache limits, user managed keys and data_allocator_fn are ignored
+    explicit map(DmapOptions options) : options_(prepare(options)) {}
+    map(std::initializer_list<std::pair<K, V>> entries) : map() {
+        reserve(entries.size());
+        for(const auto &e : entries){
+            try_emplace(e.first, e.second);
+        }
+    }
+    map(const map &other) : options_(other.options_) {
+        reserve(other.size());
+        for(auto [key, val] : other){
+            try_emplace(key, val);
+        }
+    }
+    map(map &&other) noexcept : data_(other.data_), options_(other.options_) {
+        other.data_ = nullptr;
+    }
+    map &operator=(const map &other) {
+        if(this != &other){
+            map copy(other);
+            swap(copy);
+        }
+        return *this;
+    }
+    map &operator=(map &&other) noexcept {
+        if(this != &other){
+            clear();
+            data_ = other.data_;
+            options_ = other.options_;
+            other.data_ = nullptr;
+        }
+        return *this;
+    }
+    ~map() { clear(); }
+
+    void swap(map &other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(options_, other.options_);
+    }
+
+    size_type size() const { return data_ ? (size_type)hdr()->len : 0; }
+    bool empty() const { return size() == 0; }
+    size_type capacity() const { return data_ ? (size_type)hdr()->cap : 0; }
+
+    iterator begin() { return {this, data_ ? dmap__next_idx(hdr(), -1) : DMAP_INVALID}; }
+    iterator end() { return {this, DMAP_INVALID}; }
+    const_iterator begin() const { return {this, data_ ? dmap__next_idx(hdr(), -1) : DMAP_INVALID}; }
+    const_iterator end() const { return {this, DMAP_INVALID}; }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    // makes room for n entries in one allocation; values are moved at most once. Throws std::bad_alloc or 
+    // std::length_error, leaving the map as it was, if that fails
+    void reserve(size_type n) {
+        if(!data_){
+            DmapOptions o = options_;
+            o.initial_capacity = n < (size_type)INT_MAX ? (int)n : 0; // too big: left to dmap__try_reserve to report
+            check(dmap__try_init(sizeof(V), string_keys, o, &data_));
+            if(n <= (size_type)hdr()->cap) return;
+        }
+        check(dmap__try_reserve(hdr(), sizeof(V), n, string_keys, &data_));
+    }
+    // destroys every value and frees the map; the options are kept
+    void clear() noexcept {
+        if(!data_) return;
+        if constexpr(!std::is_trivially_destructible_v<V>){
+            for(int i = dmap__next_idx(hdr(), -1); i != DMAP_INVALID; i = dmap__next_idx(hdr(), i)){
+                value_at(i).~V();
+            }
+        }
+        dmap__free(hdr());
+        data_ = nullptr;
+    }
+
+    iterator find(key_arg key) { return {this, find_index(key)}; }
+    const_iterator find(key_arg key) const { return {this, find_index(key)}; }
+    bool contains(key_arg key) const { return find_index(key) != DMAP_INVALID; }
+    size_type count(key_arg key) const { return contains(key) ? 1 : 0; }
+    V &at(key_arg key) {
+        int idx = find_index(key);
+        if(idx == DMAP_INVALID) throw std::out_of_range("dmap::map::at: key not found");
+        return value_at(idx);
+    }
+    const V &at(key_arg key) const { return const_cast<map *>(this)->at(key); }
+    V &operator[](key_arg key) { return try_emplace(key).first->second; }
+
+    // constructs V(args...) in place if key isn't in the map; otherwise leaves it, and args, alone. Running out of
+    // memory throws std::bad_alloc and leaves the map as it was
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(key_arg key, Args &&...args) {
+        init();
+        DmapHdr *d = hdr();
+        if constexpr(string_keys){
+            check(dmap__try_insert(d, const_cast<char *>(key_data(key)), key.size(), sizeof(V), true, &data_));
+        } else if constexpr(sizeof(K) <= 8){
+            if(d->len + 1 + d->tombstones > d->cap){
+                check(dmap__try_insert(d, const_cast<K *>(&key), sizeof(K), sizeof(V), false, &data_));
+            } else {
+                dmap__fast_insert(d, &key, sizeof(K)); // kept in the table slot, nothing to allocate
+            }
+        } else {
+            check(dmap__try_insert(d, const_cast<K *>(&key), sizeof(K), sizeof(V), false, &data_));
+        }
+        d = hdr();
+        int idx = d->returned_idx;
+        if(!d->returned_new){
+            return {iterator(this, idx), false};
+        }
+        try {
+            ::new(static_cast<void *>(&value_at(idx))) V(std::forward<Args>(args)...);
+        } catch(...) {
+            remove_key(key); // the slot was taken for a value that never got constructed
+            throw;
+        }
+        return {iterator(this, idx), true};
+    }
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(key_arg key, Args &&...args) {
+        return try_emplace(key, std::forward<Args>(args)...);
+    }
+    std::pair<iterator, bool> insert(key_arg key, const V &val) { return try_emplace(key, val); }
+    std::pair<iterator, bool> insert(key_arg key, V &&val) { return try_emplace(key, std::move(val)); }
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(key_arg key, M &&val) {
+        auto res = try_emplace(key, std::forward<M>(val));
+        if(!res.second){
+            res.first->second = std::forward<M>(val);
+        }
+        return res;
+    }
+
+    size_type erase(key_arg key) {
+        int idx = remove_key(key);
+        if(idx == DMAP_INVALID) return 0;
+        value_at(idx).~V(); // its index is free now, but nothing reuses it before the next insert
+        return 1;
+    }
+    // returns the iterator to the entry after pos
+    iterator erase(const_iterator pos) {
+        int next = dmap__next_idx(hdr(), pos.idx_);
+        value_at(pos.idx_).~V();
+        // the key may be stored in its table slot, which can move while the delete runs (incremental resize)
+        size_t key_size = 0;
+        const void *stored = dmap__key_at(hdr(), pos.idx_, &key_size);
+        if constexpr(string_keys){
+            char small[DMAP_INLINE_KSTR_MAX];
+            const char *key = static_cast<const char *>(stored);
+            if(key_size <= sizeof(small)){
+                std::memcpy(small, key, key_size);
+                key = small;
+            }
+            dmap__delete(hdr(), const_cast<char *>(key), key_size);
+        } else {
+            K key;
+            std::memcpy(static_cast<void *>(&key), stored, sizeof(K));
+            dmap__delete(hdr(), &key, sizeof(K));
+        }
+        return {this, next};
+    }
+
+    // the underlying C map, for the rest of the C API (anything that inserts or deletes bypasses V's lifetime)
+    V *data() { return data_; }
+    const V *data() const { return data_; }
+
+private:
+    // long enough for any key a table slot holds inline
+    static constexpr size_t DMAP_INLINE_KSTR_MAX = 32;
+
+    DmapHdr *hdr() const { return data_ ? dmap_hdr(data_) : nullptr; }
+    V &value_at(int idx) const { return data_[idx]; }
+    key_arg key_at(int idx) const {
+        size_t key_size = 0;
+        const void *key = dmap__key_at(hdr(), idx, &key_size);
+        if constexpr(string_keys){
+            return std::string_view(static_cast<const char *>(key), key_size);
+        } else {
+            return *static_cast<const K *>(key);
+        }
+    }
+    static const char *key_data(std::string_view key) { return key.data() ? key.data() : ""; }
+
+    void init() {
+        if(!data_){
+            check(dmap__try_init(sizeof(V), string_keys, options_, &data_));
+        }
+    }
+    // errors from the core's try functions, as exceptions
+    static void check(int err) {
+        if(err == DMAP_ERR_NOMEM){
+            throw std::bad_alloc();
+        }
+        if(err < 0){
+            throw std::length_error(dmap_error_str(err));
+        }
+    }
+    int find_index(key_arg key) const {
+        if(!data_) return DMAP_INVALID;
+        if constexpr(string_keys){
+            return dmap__get_idx(hdr(), const_cast<char *>(key_data(key)), key.size());
+        } else {
+            return dmap__fast_get_idx(hdr(), &key, sizeof(K));
+        }
+    }
+    // deletes key from the core without touching its value; returns the data index it had
+    int remove_key(key_arg key) {
+        if(!data_) return DMAP_INVALID;
+        if constexpr(string_keys){
+            return dmap__delete(hdr(), const_cast<char *>(key_data(key)), key.size());
+        } else {
+            return dmap__delete(hdr(), const_cast<K *>(&key), sizeof(K));
+        }
+    }
+
+    static DmapOptions prepare(DmapOptions o) {
+        o.data_allocator_fn = &map::relocate;
+        o.dense = false; // fills holes with memcpy
+        o.cache_max_entries = 0; // evicts without destroying values
+        o.cache_max_bytes = 0;
+        o.evict_fn = nullptr;
+        o.user_managed_keys = false;
+        o.free_key_fn = nullptr;
+        if constexpr(!builtin_hash){
+            o.hash_fn = &map::hash_thunk;
+            o.seeded_hash_fn = nullptr;
+        }
+        if constexpr(!builtin_eq){
+            o.cmp_fn = &map::eq_thunk;
+        }
+        return o;
+    }
+    static K load_key(const void *key, size_t len) {
+        if constexpr(string_keys){
+            return K(static_cast<const char *>(key), len);
+        } else {
+            K k;
+            std::memcpy(static_cast<void *>(&k), key, sizeof(K));
+            return k;
+        }
+    }
+    static unsigned long long hash_thunk(void *key, size_t len) {
+        if constexpr(string_keys && std::is_invocable_v<const Hash &, std::string_view>){
+            return (unsigned long long)Hash{}(std::string_view(static_cast<const char *>(key), len));
+        } else {
+            return (unsigned long long)Hash{}(load_key(key, len));
+        }
+    }
+    static bool eq_thunk(void *a, void *b, size_t len) {
+        if constexpr(string_keys && std::is_invocable_v<const Eq &, std::string_view, std::string_view>){
+            return Eq{}(std::string_view(static_cast<const char *>(a), len), std::string_view(static_cast<const char *>(b), len));
+        } else {
+            return Eq{}(load_key(a, len), load_key(b, len));
+        }
+    }
+    // data_allocator_fn: the header and data array are reallocated here instead of realloc'd, so live values are
+    // moved into the new array. dmap has not updated the header yet, so it still describes the old one
+    static void *relocate(void *old_hdr, size_t size) {
+        DmapHdr *old = static_cast<DmapHdr *>(old_hdr);
+        if(size == 0){
+            ::operator delete(old_hdr, std::align_val_t(DMAP_ALIGNMENT));
+            return nullptr;
+        }
+        void *mem = ::operator new(size, std::align_val_t(DMAP_ALIGNMENT), std::nothrow);
+        if(!mem || !old){
+            return mem; // dmap reports running out of memory
+        }
+        DmapHdr *d = static_cast<DmapHdr *>(mem);
+        std::memcpy(static_cast<void *>(d), old, offsetof(DmapHdr, data));
+        V *from = reinterpret_cast<V *>(old->data);
+        V *to = reinterpret_cast<V *>(d->data);
+        for(int i = dmap__next_idx(old, -1); i != DMAP_INVALID; i = dmap__next_idx(old, i)){
+            ::new(static_cast<void *>(to + i)) V(std::move(from[i]));
+            from[i].~V();
+        }
+        ::operator delete(old_hdr, std::align_val_t(DMAP_ALIGNMENT));
+        return mem;
+    }
+
+    V *data_ = nullptr; // as in the C API: the data array, NULL until the first insert
+    DmapOptions options_;
+};
+
+template<typename K, typename V, typename H, typename E>
+void swap(map<K, V, H, E> &a, map<K, V, H, E> &b) noexcept { a.swap(b); }
+
+} // namespace dmap
+
+#endif // DMAP_HPP